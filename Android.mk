@@ -141,6 +141,27 @@ LOCAL_CFLAGS := -Werror
 LOCAL_INIT_RC := recovery-refresh.rc
 include $(BUILD_EXECUTABLE)
 
+# recovery_ui_benchmark (times the recovery UI on minui's memory backend)
+# ===============================
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_MODULE := recovery_ui_benchmark
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := \
+    screen_ui.cpp \
+    ui.cpp \
+    ui_benchmark.cpp \
+    wear_ui.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libminui \
+    libpng \
+    libz \
+    libbase \
+    libcutils \
+    liblog
+LOCAL_CFLAGS := -Wno-unused-parameter -Werror
+include $(BUILD_EXECUTABLE)
+
 # libverifier (static library)
 # ===============================
 include $(CLEAR_VARS)
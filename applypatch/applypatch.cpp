@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <linux/falloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,20 +28,37 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
 #include <memory>
+#include <numeric>
+#include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
 #include "edify/expr.h"
 #include "ota_io.h"
 #include "print_sha1.h"
 
-static int LoadPartitionContents(const std::string& filename, FileContents* file);
+// Size of the chunks WriteToPartition() writes and verifies, and that
+// LoadPartitionContents() reads. Each chunk's SHA-1 is recorded while
+// writing, so that a failed verification can resume writing at the first
+// bad chunk.
+static constexpr size_t kPartitionChunkSize = 1 << 20;
+
+template <typename Buffer>
+static int LoadPartitionContents(const std::string& filename, Buffer* data,
+                                 uint8_t sha1[SHA_DIGEST_LENGTH], struct stat* st);
 static ssize_t FileSink(const unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -52,33 +70,117 @@ static int GenerateTarget(FileContents* source_file,
                           size_t target_size,
                           const Value* bonus_data);
 
-// Read a file into memory; store the file contents and associated metadata in *file.
-// Return 0 on success.
-int LoadFileContents(const char* filename, FileContents* file) {
+// Returns a writable pointer to the contents of 'buffer', which is either a
+// std::vector<unsigned char> or a std::string.
+template <typename Buffer>
+static unsigned char* BufferData(Buffer& buffer) {
+  return buffer.empty() ? nullptr : reinterpret_cast<unsigned char*>(&buffer[0]);
+}
+
+// Read a file into 'data' and compute its SHA-1. 'data' may be a
+// std::vector<unsigned char> or a std::string, so that callers handing the
+// contents to an edify Value don't need another copy. A regular file is
+// read into the existing storage of 'data', so callers loading many files
+// can reuse one buffer; 'data' is left empty if the read fails. Return 0 on
+// success.
+template <typename Buffer>
+static int LoadContents(const char* filename, Buffer* data, uint8_t sha1[SHA_DIGEST_LENGTH],
+                        struct stat* st) {
   // A special 'filename' beginning with "EMMC:" means to load the contents of a partition.
   if (strncmp(filename, "EMMC:", 5) == 0) {
-    return LoadPartitionContents(filename, file);
+    return LoadPartitionContents(filename, data, sha1, st);
   }
 
-  if (stat(filename, &file->st) == -1) {
+  if (stat(filename, st) == -1) {
     printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
     return -1;
   }
 
-  std::vector<unsigned char> data(file->st.st_size);
   unique_file f(ota_fopen(filename, "rb"));
   if (!f) {
     printf("failed to open \"%s\": %s\n", filename, strerror(errno));
     return -1;
   }
 
-  size_t bytes_read = ota_fread(data.data(), 1, data.size(), f.get());
-  if (bytes_read != data.size()) {
-    printf("short read of \"%s\" (%zu bytes of %zu)\n", filename, bytes_read, data.size());
+  data->resize(st->st_size);
+  size_t bytes_read = ota_fread(BufferData(*data), 1, data->size(), f.get());
+  if (bytes_read != data->size()) {
+    printf("short read of \"%s\" (%zu bytes of %zu)\n", filename, bytes_read, data->size());
+    data->clear();
+    return -1;
+  }
+  SHA1(BufferData(*data), data->size(), sha1);
+  return 0;
+}
+
+// Read a file into memory; store the file contents and associated metadata in *file.
+// Return 0 on success.
+int LoadFileContents(const char* filename, FileContents* file) {
+  return LoadContents(filename, &file->data, file->sha1, &file->st);
+}
+
+int LoadFileContents(const char* filename, std::string* data) {
+  uint8_t sha1[SHA_DIGEST_LENGTH];
+  struct stat st;
+  return LoadContents(filename, data, sha1, &st);
+}
+
+// Compute the digest of a file, or of a partition given as
+// "EMMC:<partition_device>[:<size>]", streaming it through a fixed-size
+// buffer instead of loading it into memory. Without a size, the partition is
+// hashed up to its end. Return 0 on success.
+int HashFileContents(const char* filename, const EVP_MD* md, std::vector<uint8_t>* digest) {
+  std::string path(filename);
+  bool has_size = false;
+  size_t size = 0;
+  if (strncmp(filename, "EMMC:", 5) == 0) {
+    std::vector<std::string> pieces = android::base::Split(filename, ":");
+    if (pieces.size() < 2 || pieces.size() > 3 ||
+        (pieces.size() == 3 && !android::base::ParseUint(pieces[2], &size))) {
+      printf("HashFileContents called with bad filename \"%s\"\n", filename);
+      return -1;
+    }
+    path = pieces[1];
+    has_size = (pieces.size() == 3);
+  }
+
+  unique_fd fd(ota_open(path.c_str(), O_RDONLY));
+  if (fd == -1) {
+    printf("failed to open \"%s\": %s\n", path.c_str(), strerror(errno));
+    return -1;
+  }
+
+  std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX*)> ctx(
+      EVP_MD_CTX_create(), [](EVP_MD_CTX* c) { EVP_MD_CTX_destroy(c); });
+  if (!ctx || EVP_DigestInit_ex(ctx.get(), md, nullptr) != 1) {
+    printf("failed to init digest for \"%s\"\n", filename);
     return -1;
   }
-  file->data = std::move(data);
-  SHA1(file->data.data(), file->data.size(), file->sha1);
+
+  std::vector<unsigned char> buffer(1 << 20);
+  size_t total = 0;
+  while (!has_size || total < size) {
+    size_t to_read = buffer.size();
+    if (has_size && size - total < to_read) {
+      to_read = size - total;
+    }
+    ssize_t read_count = TEMP_FAILURE_RETRY(ota_read(fd, buffer.data(), to_read));
+    if (read_count == -1) {
+      printf("failed to read \"%s\" at %zu: %s\n", path.c_str(), total, strerror(errno));
+      return -1;
+    } else if (read_count == 0) {
+      if (has_size) {
+        printf("short read (%zu bytes of %zu) for \"%s\"\n", total, size, path.c_str());
+        return -1;
+      }
+      break;
+    }
+    EVP_DigestUpdate(ctx.get(), buffer.data(), read_count);
+    total += read_count;
+  }
+
+  digest->resize(EVP_MD_size(md));
+  EVP_DigestFinal_ex(ctx.get(), digest->data(), nullptr);
   return 0;
 }
 
@@ -96,7 +198,15 @@ int LoadFileContents(const char* filename, FileContents* file) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
-static int LoadPartitionContents(const std::string& filename, FileContents* file) {
+//
+// All candidates are checked in a single pass over the partition. If
+// 'data' is null, only the SHA-1 of the matching prefix is computed, and
+// the partition is streamed through a kPartitionChunkSize buffer instead of
+// being loaded. Otherwise 'data' only grows as far as the partition has been
+// read, rather than to the largest candidate size up front.
+template <typename Buffer>
+static int LoadPartitionContents(const std::string& filename, Buffer* data,
+                                 uint8_t sha1[SHA_DIGEST_LENGTH], struct stat* st) {
   std::vector<std::string> pieces = android::base::Split(filename, ":");
   if (pieces.size() < 4 || pieces.size() % 2 != 0 || pieces[0] != "EMMC") {
     printf("LoadPartitionContents called with bad filename \"%s\"\n", filename.c_str());
@@ -127,9 +237,16 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
   SHA_CTX sha_ctx;
   SHA1_Init(&sha_ctx);
 
-  // Allocate enough memory to hold the largest size.
-  std::vector<unsigned char> buffer(pairs[pair_count - 1].first);
-  unsigned char* buffer_ptr = buffer.data();
+  // Reserve (but don't touch) enough memory to hold the largest size, so that
+  // growing the buffer never reallocates. In hash-only mode, a single chunk
+  // is reused for the whole partition.
+  Buffer buffer;
+  std::vector<unsigned char> chunk;
+  if (data != nullptr) {
+    buffer.reserve(pairs[pair_count - 1].first);
+  } else {
+    chunk.resize(std::min(kPartitionChunkSize, pairs[pair_count - 1].first));
+  }
   size_t buffer_size = 0;  // # bytes read so far
   bool found = false;
 
@@ -139,16 +256,21 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
 
     // Read enough additional bytes to get us up to the next size. (Again,
     // we're trying the possibilities in order of increasing size).
-    size_t next = current_size - buffer_size;
-    if (next > 0) {
-      size_t read = ota_fread(buffer_ptr, 1, next, dev.get());
+    while (buffer_size < current_size) {
+      size_t next = std::min(current_size - buffer_size, kPartitionChunkSize);
+      unsigned char* ptr = chunk.data();
+      if (data != nullptr) {
+        buffer.resize(buffer_size + next);
+        ptr = BufferData(buffer) + buffer_size;
+      }
+      size_t read = ota_fread(ptr, 1, next, dev.get());
       if (next != read) {
-        printf("short read (%zu bytes of %zu) for partition \"%s\"\n", read, next, partition);
+        printf("short read (%zu bytes of %zu) for partition \"%s\"\n", buffer_size + read,
+               current_size, partition);
         return -1;
       }
-      SHA1_Update(&sha_ctx, buffer_ptr, read);
+      SHA1_Update(&sha_ctx, ptr, read);
       buffer_size += read;
-      buffer_ptr += read;
     }
 
     // Duplicate the SHA context and finalize the duplicate so we can
@@ -178,18 +300,37 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
     return -1;
   }
 
-  SHA1_Final(file->sha1, &sha_ctx);
+  SHA1_Final(sha1, &sha_ctx);
 
-  buffer.resize(buffer_size);
-  file->data = std::move(buffer);
+  if (data != nullptr) {
+    *data = std::move(buffer);
+  }
   // Fake some stat() info.
-  file->st.st_mode = 0644;
-  file->st.st_uid = 0;
-  file->st.st_gid = 0;
+  st->st_mode = 0644;
+  st->st_uid = 0;
+  st->st_gid = 0;
+  st->st_size = buffer_size;
 
   return 0;
 }
 
+// Compute the SHA-1 of a file without keeping its contents. A partition
+// given as "EMMC:<partition_device>:<size>:<sha1>:..." is matched against
+// all of its (size, sha1) candidates in a single streaming pass, and 'sha1'
+// receives the digest of the matching prefix. Return 0 on success.
+int LoadFileSha1(const char* filename, uint8_t sha1[SHA_DIGEST_LENGTH]) {
+  if (strncmp(filename, "EMMC:", 5) == 0) {
+    struct stat st;
+    return LoadPartitionContents<std::vector<unsigned char>>(filename, nullptr, sha1, &st);
+  }
+
+  std::vector<uint8_t> digest;
+  if (HashFileContents(filename, EVP_sha1(), &digest) != 0) {
+    return -1;
+  }
+  memcpy(sha1, digest.data(), SHA_DIGEST_LENGTH);
+  return 0;
+}
 
 // Save the contents of the given FileContents object under the given
 // filename.  Return 0 on success.
@@ -227,6 +368,88 @@ int SaveFileContents(const char* filename, const FileContents* file) {
   return 0;
 }
 
+// Open 'partition' for buffered reads starting at 'offset', after dropping
+// the next 'len' bytes from the page cache so that the reads really come
+// from the device. Return 0 on success.
+static int ReopenUncached(const char* partition, size_t offset, size_t len, unique_fd* fd) {
+  fd->reset(ota_open(partition, O_RDONLY));
+  if (*fd == -1) {
+    printf("failed to reopen %s for verify: %s\n", partition, strerror(errno));
+    return -1;
+  }
+  // Only drop the range we wrote, rather than the whole page cache.
+  int err = posix_fadvise(*fd, offset, len, POSIX_FADV_DONTNEED);
+  if (err != 0) {
+    printf("failed to drop cached pages of %s: %s\n", partition, strerror(err));
+  }
+  if (TEMP_FAILURE_RETRY(lseek(*fd, offset, SEEK_SET)) == -1) {
+    printf("failed seek on %s: %s\n", partition, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Read back the first 'len' bytes of 'partition' and compare them against
+// the chunk digests in 'expected'. The range is read with O_DIRECT where the
+// device supports it; otherwise (or from the first short direct read on)
+// its pages are dropped from the page cache first. Return the offset
+// of the first chunk that doesn't match ('len' if everything does), or -1
+// on I/O errors.
+static ssize_t VerifyPartitionChunks(const char* partition, size_t len,
+                                     const std::vector<std::string>& expected) {
+  unique_fd fd(ota_open(partition, O_RDONLY | O_DIRECT));
+  bool direct = (fd != -1);
+  if (!direct && ReopenUncached(partition, 0, len, &fd) != 0) {
+    return -1;
+  }
+
+  // O_DIRECT needs an aligned buffer. Reads are done in whole chunks, which
+  // keeps them block-aligned even for the last, partial chunk.
+  void* aligned = nullptr;
+  if (posix_memalign(&aligned, 4096, kPartitionChunkSize) != 0) {
+    printf("failed to allocate verify buffer\n");
+    return -1;
+  }
+  std::unique_ptr<unsigned char, decltype(&free)> buffer(static_cast<unsigned char*>(aligned),
+                                                          free);
+
+  for (size_t p = 0; p < len; p += kPartitionChunkSize) {
+    size_t to_verify = std::min(len - p, kPartitionChunkSize);
+    size_t so_far = 0;
+    while (so_far < to_verify) {
+      ssize_t read_count = TEMP_FAILURE_RETRY(
+          ota_read(fd, buffer.get() + so_far, kPartitionChunkSize - so_far));
+      if (read_count == -1) {
+        printf("verify read error %s at %zu: %s\n", partition, p + so_far, strerror(errno));
+        return -1;
+      } else if (read_count == 0) {
+        printf("verify read reached unexpected EOF, %s at %zu\n", partition, p + so_far);
+        return -1;
+      }
+      so_far += read_count;
+      // After a short read the rest of the request is no longer aligned, so
+      // O_DIRECT would fail with EINVAL; read the remainder uncached instead.
+      if (direct && so_far < to_verify) {
+        printf("short direct read of %s at %zu; continuing uncached\n", partition, p + so_far);
+        if (ReopenUncached(partition, p + so_far, len - p - so_far, &fd) != 0) {
+          return -1;
+        }
+        direct = false;
+      }
+    }
+
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(buffer.get(), to_verify, digest);
+    if (memcmp(digest, expected[p / kPartitionChunkSize].data(), SHA_DIGEST_LENGTH) != 0) {
+      printf("verification failed in chunk starting at %zu\n", p);
+      return p;
+    }
+  }
+
+  printf("  verified %zu bytes of %s (%s)\n", len, partition, direct ? "direct" : "uncached");
+  return len;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "EMMC:<partition_device>[:...]". The target name
 // might contain multiple colons, but WriteToPartition() only uses the first
@@ -245,6 +468,14 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
     return -1;
   }
 
+  // Hash the data chunk by chunk, to verify the written partition against.
+  std::vector<std::string> expected;
+  for (size_t p = 0; p < len; p += kPartitionChunkSize) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(data + p, std::min(len - p, kPartitionChunkSize), digest);
+    expected.emplace_back(reinterpret_cast<const char*>(digest), SHA_DIGEST_LENGTH);
+  }
+
   size_t start = 0;
   bool success = false;
   for (size_t attempt = 0; attempt < 2; ++attempt) {
@@ -253,8 +484,7 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
       return -1;
     }
     while (start < len) {
-      size_t to_write = len - start;
-      if (to_write > 1 << 20) to_write = 1 << 20;
+      size_t to_write = std::min(len - start, kPartitionChunkSize);
 
       ssize_t written = TEMP_FAILURE_RETRY(ota_write(fd, data + start, to_write));
       if (written == -1) {
@@ -268,81 +498,23 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
       printf("failed to sync to %s: %s\n", partition, strerror(errno));
       return -1;
     }
-    if (ota_close(fd) != 0) {
-      printf("failed to close %s: %s\n", partition, strerror(errno));
-      return -1;
-    }
-
-    fd.reset(ota_open(partition, O_RDONLY));
-    if (fd == -1) {
-      printf("failed to reopen %s for verify: %s\n", partition, strerror(errno));
-      return -1;
-    }
-
-    // Drop caches so our subsequent verification read won't just be reading the cache.
-    sync();
-    unique_fd dc(ota_open("/proc/sys/vm/drop_caches", O_WRONLY));
-    if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
-      printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
-    } else {
-      printf("  caches dropped\n");
-    }
-    ota_close(dc);
-    sleep(1);
 
-    // Verify.
-    if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
-      printf("failed to seek back to beginning of %s: %s\n", partition, strerror(errno));
+    auto verify_start = std::chrono::steady_clock::now();
+    ssize_t verified = VerifyPartitionChunks(partition, len, expected);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - verify_start;
+    if (verified == -1) {
       return -1;
     }
+    printf("  verify took %.3f s (%.1f MiB/s)\n", duration.count(),
+           duration.count() > 0 ? verified / duration.count() / (1 << 20) : 0.0);
 
-    unsigned char buffer[4096];
-    start = len;
-    for (size_t p = 0; p < len; p += sizeof(buffer)) {
-      size_t to_read = len - p;
-      if (to_read > sizeof(buffer)) {
-        to_read = sizeof(buffer);
-      }
-
-      size_t so_far = 0;
-      while (so_far < to_read) {
-        ssize_t read_count = TEMP_FAILURE_RETRY(ota_read(fd, buffer + so_far, to_read - so_far));
-        if (read_count == -1) {
-          printf("verify read error %s at %zu: %s\n", partition, p, strerror(errno));
-          return -1;
-        } else if (read_count == 0) {
-          printf("verify read reached unexpected EOF, %s at %zu\n", partition, p);
-          return -1;
-        }
-        if (static_cast<size_t>(read_count) < to_read) {
-          printf("short verify read %s at %zu: %zd %zu\n", partition, p, read_count, to_read);
-        }
-        so_far += read_count;
-      }
-
-      if (memcmp(buffer, data + p, to_read) != 0) {
-        printf("verification failed starting at %zu\n", p);
-        start = p;
-        break;
-      }
-    }
-
-    if (start == len) {
+    if (static_cast<size_t>(verified) == len) {
       printf("verification read succeeded (attempt %zu)\n", attempt + 1);
       success = true;
       break;
     }
-
-    if (ota_close(fd) != 0) {
-      printf("failed to close %s: %s\n", partition, strerror(errno));
-      return -1;
-    }
-
-    fd.reset(ota_open(partition, O_RDWR));
-    if (fd == -1) {
-      printf("failed to reopen %s for retry write && verify: %s\n", partition, strerror(errno));
-      return -1;
-    }
+    // Rewrite from the first chunk that failed to verify.
+    start = verified;
   }
 
   if (!success) {
@@ -406,14 +578,16 @@ static int FindMatchingPatch(uint8_t* sha1, const std::vector<std::string>& patc
 // match any of the sha1's on the command line (argv[3:]).  Returns
 // nonzero otherwise.
 int applypatch_check(const char* filename, const std::vector<std::string>& patch_sha1_str) {
-  FileContents file;
+  // Only the SHA-1s are needed here, so neither the file nor a partition is
+  // loaded into memory.
+  uint8_t sha1[SHA_DIGEST_LENGTH];
 
   // It's okay to specify no sha1s; the check will pass if the
-  // LoadFileContents is successful.  (Useful for reading
+  // LoadFileSha1 is successful.  (Useful for reading
   // partitions, where the filename encodes the sha1s; no need to
   // check them twice.)
-  if (LoadFileContents(filename, &file) != 0 ||
-      (!patch_sha1_str.empty() && FindMatchingPatch(file.sha1, patch_sha1_str) < 0)) {
+  if (LoadFileSha1(filename, sha1) != 0 ||
+      (!patch_sha1_str.empty() && FindMatchingPatch(sha1, patch_sha1_str) < 0)) {
     printf("file \"%s\" doesn't have any of expected sha1 sums; checking cache\n", filename);
 
     // If the source file is missing or corrupted, it might be because
@@ -421,12 +595,12 @@ int applypatch_check(const char* filename, const std::vector<std::string>& patch
     // should have been made in CACHE_TEMP_SOURCE.  If that file
     // exists and matches the sha1 we're looking for, the check still
     // passes.
-    if (LoadFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
+    if (LoadFileSha1(CACHE_TEMP_SOURCE, sha1) != 0) {
       printf("failed to load cache file\n");
       return 1;
     }
 
-    if (FindMatchingPatch(file.sha1, patch_sha1_str) < 0) {
+    if (FindMatchingPatch(sha1, patch_sha1_str) < 0) {
       printf("cache bits don't match any sha1 for \"%s\"\n", filename);
       return 1;
     }
@@ -454,12 +628,6 @@ ssize_t FileSink(const unsigned char* data, ssize_t len, void* token) {
     return done;
 }
 
-ssize_t MemorySink(const unsigned char* data, ssize_t len, void* token) {
-    std::string* s = static_cast<std::string*>(token);
-    s->append(reinterpret_cast<const char*>(data), len);
-    return len;
-}
-
 // Return the amount of free space (in bytes) on the filesystem
 // containing filename.  filename must exist.  Return -1 on error.
 size_t FreeSpaceForFile(const char* filename) {
@@ -612,15 +780,16 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
   pieces.push_back(std::to_string(target_size));
   pieces.push_back(target_sha1_str);
   std::string fullname = android::base::Join(pieces, ':');
-  FileContents source_file;
-  if (LoadPartitionContents(fullname, &source_file) == 0 &&
-      memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
+  uint8_t partition_sha1[SHA_DIGEST_LENGTH];
+  if (LoadFileSha1(fullname.c_str(), partition_sha1) == 0 &&
+      memcmp(partition_sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
     // The early-exit case: the image was already applied, this partition
     // has the desired hash, nothing for us to do.
     printf("already %s\n", short_sha1(target_sha1).c_str());
     return 0;
   }
 
+  FileContents source_file;
   if (LoadFileContents(source_filename, &source_file) == 0) {
     if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
       // The source doesn't have desired checksum.
@@ -638,6 +807,304 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
   return 0;
 }
 
+// Sink that writes the patched output straight to a partition. The output
+// is staged in chunks of kPartitionChunkSize, and the SHA-1 of each chunk is
+// recorded for verifying the partition afterwards.
+struct PartitionSink {
+  unique_fd fd;
+  std::vector<unsigned char> buffer;
+  size_t written = 0;
+  std::vector<std::string> digests;
+};
+
+static bool FlushPartitionSink(PartitionSink* ps) {
+  if (ps->buffer.empty()) {
+    return true;
+  }
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(ps->buffer.data(), ps->buffer.size(), digest);
+  ps->digests.emplace_back(reinterpret_cast<const char*>(digest), SHA_DIGEST_LENGTH);
+
+  size_t done = 0;
+  while (done < ps->buffer.size()) {
+    ssize_t wrote = TEMP_FAILURE_RETRY(ota_write(ps->fd, ps->buffer.data() + done,
+                                                 ps->buffer.size() - done));
+    if (wrote == -1) {
+      printf("error writing %zu bytes at %zu: %s\n", ps->buffer.size() - done,
+             ps->written + done, strerror(errno));
+      return false;
+    }
+    done += wrote;
+  }
+  ps->written += done;
+  ps->buffer.clear();
+  return true;
+}
+
+static ssize_t PartitionSinkFn(const unsigned char* data, ssize_t len, void* token) {
+  PartitionSink* ps = static_cast<PartitionSink*>(token);
+  ssize_t done = 0;
+  while (done < len) {
+    size_t to_copy = std::min(static_cast<size_t>(len - done),
+                              kPartitionChunkSize - ps->buffer.size());
+    ps->buffer.insert(ps->buffer.end(), data + done, data + done + to_copy);
+    done += to_copy;
+    if (ps->buffer.size() == kPartitionChunkSize && !FlushPartitionSink(ps)) {
+      return done - to_copy;
+    }
+  }
+  return done;
+}
+
+// Size of the writes FileTargetSinkFn() issues. The patched output is
+// collected into blocks of this size, so that every write but the last
+// starts and ends on a block boundary.
+static constexpr size_t kFileSinkBlockSize = 256 << 10;
+
+// Sink that batches the patched output for a "<tgt-file>.patch" file. The
+// file is written without O_SYNC, and the caller fsyncs it once before the
+// rename.
+struct FileTargetSink {
+  int fd;
+  std::vector<unsigned char> buffer;
+  size_t written = 0;
+};
+
+static bool FlushFileTargetSink(FileTargetSink* fs) {
+  if (fs->buffer.empty()) {
+    return true;
+  }
+  ssize_t wrote = FileSink(fs->buffer.data(), fs->buffer.size(), &fs->fd);
+  if (wrote != static_cast<ssize_t>(fs->buffer.size())) {
+    return false;
+  }
+  fs->written += wrote;
+  fs->buffer.clear();
+  return true;
+}
+
+static ssize_t FileTargetSinkFn(const unsigned char* data, ssize_t len, void* token) {
+  FileTargetSink* fs = static_cast<FileTargetSink*>(token);
+  ssize_t done = 0;
+  while (done < len) {
+    size_t to_copy = std::min(static_cast<size_t>(len - done),
+                              kFileSinkBlockSize - fs->buffer.size());
+    fs->buffer.insert(fs->buffer.end(), data + done, data + done + to_copy);
+    done += to_copy;
+    if (fs->buffer.size() == kFileSinkBlockSize && !FlushFileTargetSink(fs)) {
+      return done - to_copy;
+    }
+  }
+  return done;
+}
+
+// Apply the patch to 'source', writing the output straight to the target
+// partition ("EMMC:<partition_device>[:...]") instead of collecting it in
+// memory first, then read the partition back to verify it. The caller must
+// have backed up the source to CACHE_TEMP_SOURCE, since the partition is
+// overwritten before the output's SHA-1 is known; on failure the partition
+// may hold a partial or wrong image and the backup is what a retry patches
+// from. Return 0 on success.
+static int GeneratePartitionTarget(const FileContents* source, const Value* patch,
+                                   bool use_bsdiff, const char* target_filename,
+                                   const uint8_t target_sha1[SHA_DIGEST_LENGTH],
+                                   const Value* bonus_data) {
+  std::vector<std::string> pieces = android::base::Split(target_filename, ":");
+  if (pieces.size() < 2 || pieces[0] != "EMMC") {
+    printf("GeneratePartitionTarget called with bad target (%s)\n", target_filename);
+    return 1;
+  }
+  const char* partition = pieces[1].c_str();
+
+  for (size_t attempt = 0; attempt < 2; ++attempt) {
+    PartitionSink ps;
+    ps.fd.reset(ota_open(partition, O_WRONLY));
+    if (ps.fd == -1) {
+      printf("failed to open %s: %s\n", partition, strerror(errno));
+      return 1;
+    }
+    ps.buffer.reserve(kPartitionChunkSize);
+
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    int result;
+    if (use_bsdiff) {
+      result = ApplyBSDiffPatch(source->data.data(), source->data.size(), patch, 0,
+                                PartitionSinkFn, &ps, &ctx);
+    } else {
+      result = ApplyImagePatch(source->data.data(), source->data.size(), patch, PartitionSinkFn,
+                               &ps, &ctx, bonus_data);
+    }
+    if (result == 0 && !FlushPartitionSink(&ps)) {
+      result = 1;
+    }
+    if (result == 0 && ota_fsync(ps.fd) != 0) {
+      printf("failed to sync to %s: %s\n", partition, strerror(errno));
+      result = 1;
+    }
+    if (ota_close(ps.fd) != 0) {
+      printf("failed to close %s: %s\n", partition, strerror(errno));
+      result = 1;
+    }
+    if (result != 0) {
+      printf("applying patch failed\n");
+      return 1;
+    }
+
+    uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
+    SHA1_Final(current_target_sha1, &ctx);
+    if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
+      printf("patch did not produce expected sha1\n");
+      return 1;
+    }
+    printf("now %s\n", short_sha1(target_sha1).c_str());
+
+    ssize_t verified = VerifyPartitionChunks(partition, ps.written, ps.digests);
+    if (verified == -1) {
+      return 1;
+    }
+    if (static_cast<size_t>(verified) == ps.written) {
+      printf("verification read succeeded (attempt %zu)\n", attempt + 1);
+      sync();
+      return 0;
+    }
+    // The output isn't kept around, so patch again to rewrite it.
+    printf("rewriting %s\n", partition);
+  }
+
+  printf("failed to verify after all attempts\n");
+  return 1;
+}
+
+// Assume that target_filename (eg "/system/app/Foo.apk") is located on the
+// same filesystem as its top-level directory ("/system"). We need something
+// that exists for calling statfs().
+static std::string TargetFilesystem(const std::string& target_filename) {
+  std::string target_fs = target_filename;
+  auto slash_pos = target_fs.find('/', 1);
+  if (slash_pos != std::string::npos) {
+    target_fs.resize(slash_pos);
+  }
+  return target_fs;
+}
+
+// Determine whether 'patch' is a bsdiff or an imgdiff patch. Return 0 on
+// success.
+static int GetPatchType(const Value* patch, bool* use_bsdiff) {
+  if (patch->type != VAL_BLOB) {
+    printf("patch is not a blob\n");
+    return 1;
+  }
+
+  const char* header = &patch->data[0];
+  size_t header_bytes_read = patch->data.size();
+  if (header_bytes_read >= 8 && memcmp(header, "BSDIFF40", 8) == 0) {
+    *use_bsdiff = true;
+  } else if (header_bytes_read >= 8 && memcmp(header, "IMGDIFF2", 8) == 0) {
+    *use_bsdiff = false;
+  } else {
+    printf("Unknown patch file format\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Apply the patch to 'source', writing the output to 'tmp_target_filename'
+// and accumulating its SHA-1 in 'ctx'. 'block_buffer' is the staging buffer
+// for the writes, which callers may reuse across files. Return 0 on success.
+static int WritePatchedFile(const FileContents* source, const Value* patch, bool use_bsdiff,
+                            const std::string& tmp_target_filename, size_t target_size,
+                            const Value* bonus_data, std::vector<unsigned char>* block_buffer,
+                            SHA_CTX* ctx) {
+  // The writes are buffered; the single fsync below makes the file durable
+  // before the rename.
+  auto start = std::chrono::steady_clock::now();
+  unique_fd output_fd(ota_open(tmp_target_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                               S_IRUSR | S_IWUSR));
+  if (output_fd == -1) {
+    printf("failed to open output file %s: %s\n", tmp_target_filename.c_str(), strerror(errno));
+    return 1;
+  }
+
+  FileTargetSink fs;
+  fs.fd = output_fd;
+  fs.buffer = std::move(*block_buffer);
+  fs.buffer.clear();
+  fs.buffer.reserve(kFileSinkBlockSize);
+  SinkFn sink = FileTargetSinkFn;
+  void* token = &fs;
+
+  SHA1_Init(ctx);
+
+  // Reserve the blocks up front so the file isn't fragmented by the
+  // incremental writes. Filesystems without fallocate support (or without
+  // support for this mode, which some report as EINVAL) are fine, and an
+  // empty target has nothing to reserve: fallocate() rejects a zero length.
+  int result;
+  if (target_size > 0 && fallocate(output_fd, FALLOC_FL_KEEP_SIZE, 0, target_size) != 0 &&
+      errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL) {
+    printf("failed to allocate %zu bytes for \"%s\": %s\n", target_size,
+           tmp_target_filename.c_str(), strerror(errno));
+    result = 1;
+  } else if (use_bsdiff) {
+    result = ApplyBSDiffPatch(source->data.data(), source->data.size(), patch, 0, sink, token,
+                              ctx);
+  } else {
+    result = ApplyImagePatch(source->data.data(), source->data.size(), patch, sink, token, ctx,
+                             bonus_data);
+  }
+  if (result == 0 && !FlushFileTargetSink(&fs)) {
+    result = 1;
+  }
+  *block_buffer = std::move(fs.buffer);
+
+  if (ota_fsync(output_fd) != 0) {
+    printf("failed to fsync file \"%s\": %s\n", tmp_target_filename.c_str(), strerror(errno));
+    result = 1;
+  }
+  if (ota_close(output_fd) != 0) {
+    printf("failed to close file \"%s\": %s\n", tmp_target_filename.c_str(), strerror(errno));
+    result = 1;
+  }
+  std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+  printf("wrote %zu bytes to \"%s\" in %.3f s\n", fs.written, tmp_target_filename.c_str(),
+         duration.count());
+  return result;
+}
+
+// Check the SHA-1 accumulated in 'ctx' by WritePatchedFile(), give
+// "<tgt-file>.patch" the owner, group, and mode of 'source', and rename it
+// over the target. Return 0 on success.
+static int CommitPatchedFile(const FileContents* source, const std::string& tmp_target_filename,
+                             const char* target_filename,
+                             const uint8_t target_sha1[SHA_DIGEST_LENGTH], SHA_CTX* ctx) {
+  uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
+  SHA1_Final(current_target_sha1, ctx);
+  if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
+    printf("patch did not produce expected sha1\n");
+    return 1;
+  } else {
+    printf("now %s\n", short_sha1(target_sha1).c_str());
+  }
+
+  // Give the .patch file the same owner, group, and mode of the original source file.
+  if (chmod(tmp_target_filename.c_str(), source->st.st_mode) != 0) {
+    printf("chmod of \"%s\" failed: %s\n", tmp_target_filename.c_str(), strerror(errno));
+    return 1;
+  }
+  if (chown(tmp_target_filename.c_str(), source->st.st_uid, source->st.st_gid) != 0) {
+    printf("chown of \"%s\" failed: %s\n", tmp_target_filename.c_str(), strerror(errno));
+    return 1;
+  }
+
+  // Finally, rename the .patch file to replace the target file.
+  if (rename(tmp_target_filename.c_str(), target_filename) != 0) {
+    printf("rename of .patch to \"%s\" failed: %s\n", target_filename, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -647,14 +1114,7 @@ static int GenerateTarget(FileContents* source_file,
                           const uint8_t target_sha1[SHA_DIGEST_LENGTH],
                           size_t target_size,
                           const Value* bonus_data) {
-  // assume that target_filename (eg "/system/app/Foo.apk") is located
-  // on the same filesystem as its top-level directory ("/system").
-  // We need something that exists for calling statfs().
-  std::string target_fs = target_filename;
-  auto slash_pos = target_fs.find('/', 1);
-  if (slash_pos != std::string::npos) {
-    target_fs.resize(slash_pos);
-  }
+  std::string target_fs = TargetFilesystem(target_filename);
 
   FileContents* source_to_use;
   const Value* patch;
@@ -666,42 +1126,25 @@ static int GenerateTarget(FileContents* source_file,
     patch = copy_patch_value;
   }
 
-  if (patch->type != VAL_BLOB) {
-    printf("patch is not a blob\n");
-    return 1;
-  }
-
-  const char* header = &patch->data[0];
-  size_t header_bytes_read = patch->data.size();
   bool use_bsdiff = false;
-  if (header_bytes_read >= 8 && memcmp(header, "BSDIFF40", 8) == 0) {
-    use_bsdiff = true;
-  } else if (header_bytes_read >= 8 && memcmp(header, "IMGDIFF2", 8) == 0) {
-    use_bsdiff = false;
-  } else {
-    printf("Unknown patch file format\n");
+  if (GetPatchType(patch, &use_bsdiff) != 0) {
     return 1;
   }
 
   bool target_is_partition = (strncmp(target_filename, "EMMC:", 5) == 0);
   const std::string tmp_target_filename = std::string(target_filename) + ".patch";
 
-  int retry = 1;
-  bool made_copy = false;
-  SHA_CTX ctx;
-  std::string memory_sink_str;  // Don't need to reserve space.
-  do {
-    // Is there enough room in the target filesystem to hold the patched file?
-
-    if (target_is_partition) {
-      // If the target is a partition, we're actually going to
-      // write the output to /tmp and then copy it to the
-      // partition.  statfs() always returns 0 blocks free for
-      // /tmp, so instead we'll just assume that /tmp has enough
-      // space to hold the file.
-
-      // We still write the original source to cache, in case
-      // the partition write is interrupted.
+  if (target_is_partition) {
+    // The patched output is written straight to the partition, and its
+    // SHA-1 is only known once the whole patch has been applied. The source
+    // SHA-1 has been matched against the patch list already, but a patch
+    // that produces the wrong output, or an interrupted write, still leaves
+    // the partition holding a partial or wrong image. So first write the
+    // original source to cache, and keep it there until the output has been
+    // verified. If the target is also the source, the next attempt won't
+    // match any source SHA-1 and patches from CACHE_TEMP_SOURCE instead. In
+    // that case source_file is empty and the copy must be left alone.
+    if (source_patch_value != nullptr) {
       if (MakeFreeSpaceOnCache(source_file->data.size()) < 0) {
         printf("not enough free space on /cache\n");
         return 1;
@@ -710,94 +1153,69 @@ static int GenerateTarget(FileContents* source_file,
         printf("failed to back up source file\n");
         return 1;
       }
-      made_copy = true;
-      retry = 0;
-    } else {
-      bool enough_space = false;
-      if (retry > 0) {
-        size_t free_space = FreeSpaceForFile(target_fs.c_str());
-        enough_space = (free_space > (256 << 10)) &&          // 256k (two-block) minimum
-                       (free_space > (target_size * 3 / 2));  // 50% margin of error
-        if (!enough_space) {
-          printf("target %zu bytes; free space %zu bytes; retry %d; enough %d\n", target_size,
-                 free_space, retry, enough_space);
-        }
-      }
+    }
+    if (GeneratePartitionTarget(source_to_use, patch, use_bsdiff, target_filename, target_sha1,
+                                bonus_data) != 0) {
+      return 1;
+    }
+    // We created the copy, and we're here, so we can delete it.
+    unlink(CACHE_TEMP_SOURCE);
+    return 0;
+  }
 
+  int retry = 1;
+  bool made_copy = false;
+  SHA_CTX ctx;
+  do {
+    // Is there enough room in the target filesystem to hold the patched file?
+    bool enough_space = false;
+    if (retry > 0) {
+      size_t free_space = FreeSpaceForFile(target_fs.c_str());
+      enough_space = (free_space > (256 << 10)) &&          // 256k (two-block) minimum
+                     (free_space > (target_size * 3 / 2));  // 50% margin of error
       if (!enough_space) {
-        retry = 0;
+        printf("target %zu bytes; free space %zu bytes; retry %d; enough %d\n", target_size,
+               free_space, retry, enough_space);
       }
+    }
 
-      if (!enough_space && source_patch_value != nullptr) {
-        // Using the original source, but not enough free space.  First
-        // copy the source file to cache, then delete it from the original
-        // location.
-
-        if (strncmp(source_filename, "EMMC:", 5) == 0) {
-          // It's impossible to free space on the target filesystem by
-          // deleting the source if the source is a partition.  If
-          // we're ever in a state where we need to do this, fail.
-          printf("not enough free space for target but source is partition\n");
-          return 1;
-        }
-
-        if (MakeFreeSpaceOnCache(source_file->data.size()) < 0) {
-          printf("not enough free space on /cache\n");
-          return 1;
-        }
+    if (!enough_space) {
+      retry = 0;
+    }
 
-        if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-          printf("failed to back up source file\n");
-          return 1;
-        }
-        made_copy = true;
-        unlink(source_filename);
+    if (!enough_space && source_patch_value != nullptr) {
+      // Using the original source, but not enough free space.  First
+      // copy the source file to cache, then delete it from the original
+      // location.
 
-        size_t free_space = FreeSpaceForFile(target_fs.c_str());
-        printf("(now %zu bytes free for target) ", free_space);
+      if (strncmp(source_filename, "EMMC:", 5) == 0) {
+        // It's impossible to free space on the target filesystem by
+        // deleting the source if the source is a partition.  If
+        // we're ever in a state where we need to do this, fail.
+        printf("not enough free space for target but source is partition\n");
+        return 1;
       }
-    }
 
-    SinkFn sink = nullptr;
-    void* token = nullptr;
-    unique_fd output_fd;
-    if (target_is_partition) {
-      // We store the decoded output in memory.
-      sink = MemorySink;
-      token = &memory_sink_str;
-    } else {
-      // We write the decoded output to "<tgt-file>.patch".
-      output_fd.reset(ota_open(tmp_target_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_SYNC,
-                               S_IRUSR | S_IWUSR));
-      if (output_fd == -1) {
-        printf("failed to open output file %s: %s\n", tmp_target_filename.c_str(), strerror(errno));
+      if (MakeFreeSpaceOnCache(source_file->data.size()) < 0) {
+        printf("not enough free space on /cache\n");
         return 1;
       }
-      sink = FileSink;
-      token = &output_fd;
-    }
 
-    SHA1_Init(&ctx);
+      if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+        printf("failed to back up source file\n");
+        return 1;
+      }
+      made_copy = true;
+      unlink(source_filename);
 
-    int result;
-    if (use_bsdiff) {
-      result = ApplyBSDiffPatch(source_to_use->data.data(), source_to_use->data.size(), patch, 0,
-                                sink, token, &ctx);
-    } else {
-      result = ApplyImagePatch(source_to_use->data.data(), source_to_use->data.size(), patch, sink,
-                               token, &ctx, bonus_data);
+      size_t free_space = FreeSpaceForFile(target_fs.c_str());
+      printf("(now %zu bytes free for target) ", free_space);
     }
 
-    if (!target_is_partition) {
-      if (ota_fsync(output_fd) != 0) {
-        printf("failed to fsync file \"%s\": %s\n", tmp_target_filename.c_str(), strerror(errno));
-        result = 1;
-      }
-      if (ota_close(output_fd) != 0) {
-        printf("failed to close file \"%s\": %s\n", tmp_target_filename.c_str(), strerror(errno));
-        result = 1;
-      }
-    }
+    // We write the decoded output to "<tgt-file>.patch".
+    std::vector<unsigned char> block_buffer;
+    int result = WritePatchedFile(source_to_use, patch, use_bsdiff, tmp_target_filename,
+                                  target_size, bonus_data, &block_buffer, &ctx);
 
     if (result != 0) {
       if (retry == 0) {
@@ -806,55 +1224,281 @@ static int GenerateTarget(FileContents* source_file,
       } else {
         printf("applying patch failed; retrying\n");
       }
-      if (!target_is_partition) {
-        unlink(tmp_target_filename.c_str());
-      }
+      unlink(tmp_target_filename.c_str());
     } else {
       // succeeded; no need to retry
       break;
     }
   } while (retry-- > 0);
 
-  uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
-  SHA1_Final(current_target_sha1, &ctx);
-  if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
-    printf("patch did not produce expected sha1\n");
+  if (CommitPatchedFile(source_to_use, tmp_target_filename, target_filename, target_sha1,
+                        &ctx) != 0) {
     return 1;
-  } else {
-    printf("now %s\n", short_sha1(target_sha1).c_str());
   }
 
-  if (target_is_partition) {
-    // Copy the temp file to the partition.
-    if (WriteToPartition(reinterpret_cast<const unsigned char*>(memory_sink_str.c_str()),
-                         memory_sink_str.size(), target_filename) != 0) {
-      printf("write of patched data to %s failed\n", target_filename);
-      return 1;
+  // If this run of applypatch created the copy, and we're here, we can delete it.
+  if (made_copy) {
+    unlink(CACHE_TEMP_SOURCE);
+  }
+
+  // Success!
+  return 0;
+}
+
+// Parse a batch manifest into 'jobs'. Each non-empty line that doesn't
+// start with '#' describes one file, with the arguments of applypatch():
+//
+//   <src-file> <tgt-file> <tgt-sha1> <tgt-size> <src-sha1>:<patch> [<src-sha1>:<patch> ...]
+//
+// <tgt-file> may be "-" to mean "the same as <src-file>". The patch names
+// are stored in PatchJob::patch_names; loading them is up to the caller.
+// Returns true on success.
+bool ParsePatchManifest(const std::string& manifest, std::vector<PatchJob>* jobs) {
+  for (const auto& line : android::base::Split(manifest, "\n")) {
+    std::string trimmed = android::base::Trim(line);
+    if (trimmed.empty() || trimmed[0] == '#') {
+      continue;
     }
-  } else {
-    // Give the .patch file the same owner, group, and mode of the original source file.
-    if (chmod(tmp_target_filename.c_str(), source_to_use->st.st_mode) != 0) {
-      printf("chmod of \"%s\" failed: %s\n", tmp_target_filename.c_str(), strerror(errno));
+
+    std::vector<std::string> fields;
+    for (const auto& field : android::base::Split(trimmed, " \t")) {
+      if (!field.empty()) {
+        fields.push_back(field);
+      }
+    }
+    if (fields.size() < 5) {
+      printf("too few fields in manifest line \"%s\"\n", trimmed.c_str());
+      return false;
+    }
+
+    PatchJob job;
+    job.source_filename = fields[0];
+    job.target_filename = fields[1] == "-" ? fields[0] : fields[1];
+    job.target_sha1 = fields[2];
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    if (ParseSha1(job.target_sha1.c_str(), digest) != 0) {
+      printf("failed to parse tgt-sha1 \"%s\"\n", job.target_sha1.c_str());
+      return false;
+    }
+    if (!android::base::ParseUint(fields[3], &job.target_size) || job.target_size == 0) {
+      printf("can't parse \"%s\" as byte count\n", fields[3].c_str());
+      return false;
+    }
+    for (size_t i = 4; i < fields.size(); ++i) {
+      size_t colon = fields[i].find(':');
+      if (colon == std::string::npos ||
+          ParseSha1(fields[i].substr(0, colon).c_str(), digest) != 0) {
+        printf("failed to parse patch argument \"%s\"\n", fields[i].c_str());
+        return false;
+      }
+      job.patch_sha1s.push_back(fields[i].substr(0, colon));
+      job.patch_names.push_back(fields[i].substr(colon + 1));
+    }
+    jobs->push_back(std::move(job));
+  }
+  return true;
+}
+
+// Patch a regular file without any of the fallbacks of applypatch(): the
+// caller has already checked the free space on the target filesystem, and
+// a source that doesn't match any of the patches is simply a failure here,
+// rather than a reason to look at CACHE_TEMP_SOURCE. 'source_file' and
+// 'block_buffer' are reused across calls. Return 0 on success.
+static int PatchFileJob(const PatchJob& job, const Value* bonus_data, FileContents* source_file,
+                        std::vector<unsigned char>* block_buffer) {
+  const char* source_filename = job.source_filename.c_str();
+  const char* target_filename = job.target_filename.c_str();
+
+  uint8_t target_sha1[SHA_DIGEST_LENGTH];
+  if (ParseSha1(job.target_sha1.c_str(), target_sha1) != 0) {
+    printf("failed to parse tgt-sha1 \"%s\"\n", job.target_sha1.c_str());
+    return 1;
+  }
+
+  // The early-exit case: the patch was already applied. A target patched
+  // in place is checked below, once the source has been loaded anyway.
+  bool in_place = (job.source_filename == job.target_filename);
+  uint8_t current_sha1[SHA_DIGEST_LENGTH];
+  if (!in_place && LoadFileSha1(target_filename, current_sha1) == 0 &&
+      memcmp(current_sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
+    printf("patch %s: already %s\n", source_filename, short_sha1(target_sha1).c_str());
+    return 0;
+  }
+
+  if (LoadFileContents(source_filename, source_file) != 0) {
+    return 1;
+  }
+  if (in_place && memcmp(source_file->sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
+    printf("patch %s: already %s\n", source_filename, short_sha1(target_sha1).c_str());
+    return 0;
+  }
+
+  int to_use = FindMatchingPatch(source_file->sha1, job.patch_sha1s);
+  if (to_use < 0) {
+    printf("patch %s: source file is bad\n", source_filename);
+    return 1;
+  }
+  const Value* patch = job.patches[to_use].get();
+  bool use_bsdiff = false;
+  if (GetPatchType(patch, &use_bsdiff) != 0) {
+    return 1;
+  }
+
+  const std::string tmp_target_filename = job.target_filename + ".patch";
+  SHA_CTX ctx;
+  if (WritePatchedFile(source_file, patch, use_bsdiff, tmp_target_filename, job.target_size,
+                       bonus_data, block_buffer, &ctx) != 0) {
+    printf("patch %s: applying patch failed\n", source_filename);
+    unlink(tmp_target_filename.c_str());
+    return 1;
+  }
+  printf("patch %s: ", source_filename);
+  return CommitPatchedFile(source_file, tmp_target_filename, target_filename, target_sha1, &ctx);
+}
+
+// The file or partition device that 'filename' names, for telling whether
+// two jobs of a batch touch the same thing.
+static std::string PatchedObject(const std::string& filename) {
+  if (strncmp(filename.c_str(), "EMMC:", 5) == 0) {
+    std::vector<std::string> pieces = android::base::Split(filename, ":");
+    return pieces[1];
+  }
+  return filename;
+}
+
+// Apply many patches at once. The regular files are sorted by their
+// on-disk location (device and inode) and patched on a pool of worker
+// threads, each reusing its buffers from file to file. The free space is
+// checked once per target filesystem for the whole batch instead of once
+// per file.
+//
+// Partitions, and any file that fails in the worker pool, go through
+// applypatch() one at a time afterwards, so they still get its
+// CACHE_TEMP_SOURCE handling. The same is done for all files if the batch
+// doesn't fit on its target filesystems. A batch in which a target appears
+// twice, or is also the source of another job, is rejected, since its jobs
+// would depend on the order they run in.
+int applypatch_batch(const std::vector<PatchJob>& jobs, const Value* bonus_data) {
+  auto start = std::chrono::steady_clock::now();
+
+  std::set<std::string> targets;
+  for (const auto& job : jobs) {
+    if (!targets.insert(PatchedObject(job.target_filename)).second) {
+      printf("\"%s\" is the target of more than one patch\n", job.target_filename.c_str());
       return 1;
     }
-    if (chown(tmp_target_filename.c_str(), source_to_use->st.st_uid,
-              source_to_use->st.st_gid) != 0) {
-      printf("chown of \"%s\" failed: %s\n", tmp_target_filename.c_str(), strerror(errno));
+  }
+  for (const auto& job : jobs) {
+    std::string source = PatchedObject(job.source_filename);
+    if (source != PatchedObject(job.target_filename) && targets.count(source) != 0) {
+      printf("\"%s\" is both a source and the target of another patch\n",
+             job.source_filename.c_str());
       return 1;
     }
+  }
 
-    // Finally, rename the .patch file to replace the target file.
-    if (rename(tmp_target_filename.c_str(), target_filename) != 0) {
-      printf("rename of .patch to \"%s\" failed: %s\n", target_filename, strerror(errno));
+  std::vector<const PatchJob*> serial;
+  std::vector<std::pair<std::pair<dev_t, ino_t>, const PatchJob*>> located;
+  std::map<std::string, std::vector<size_t>> target_sizes;
+  for (const auto& job : jobs) {
+    if (job.patches.size() != job.patch_sha1s.size()) {
+      printf("patches for \"%s\" haven't been loaded\n", job.source_filename.c_str());
       return 1;
     }
+    if (strncmp(job.source_filename.c_str(), "EMMC:", 5) == 0 ||
+        strncmp(job.target_filename.c_str(), "EMMC:", 5) == 0) {
+      serial.push_back(&job);
+      continue;
+    }
+    // Missing sources sort last; applypatch() may still find them in the cache.
+    struct stat st;
+    std::pair<dev_t, ino_t> location(static_cast<dev_t>(-1), static_cast<ino_t>(-1));
+    if (stat(job.source_filename.c_str(), &st) == 0) {
+      location = { st.st_dev, st.st_ino };
+    }
+    located.push_back({ location, &job });
+    target_sizes[TargetFilesystem(job.target_filename)].push_back(job.target_size);
+  }
+  std::stable_sort(located.begin(), located.end(),
+                   [](const std::pair<std::pair<dev_t, ino_t>, const PatchJob*>& a,
+                      const std::pair<std::pair<dev_t, ino_t>, const PatchJob*>& b) {
+                     return a.first < b.first;
+                   });
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t thread_count = std::max<size_t>(1, std::min<size_t>(located.size(), cpus > 0 ? cpus : 1));
+
+  // Each worker may hold a "<tgt-file>.patch" at the same time as the old
+  // target, and a committed target frees its old copy. So at worst the
+  // 'thread_count' largest targets of a filesystem are in flight together;
+  // require room for those, with the same margin GenerateTarget() uses for
+  // a single file.
+  bool enough_space = true;
+  for (auto& fs : target_sizes) {
+    std::vector<size_t>& sizes = fs.second;
+    size_t in_flight = std::min(sizes.size(), thread_count);
+    std::partial_sort(sizes.begin(), sizes.begin() + in_flight, sizes.end(),
+                      std::greater<size_t>());
+    size_t needed = std::accumulate(sizes.begin(), sizes.begin() + in_flight, size_t(0));
+    size_t free_space = FreeSpaceForFile(fs.first.c_str());
+    if (free_space == static_cast<size_t>(-1) || free_space <= (256 << 10) ||
+        free_space <= needed * 3 / 2) {
+      printf("batch needs %zu bytes on %s; free space %zu bytes; patching one at a time\n",
+             needed, fs.first.c_str(), free_space);
+      enough_space = false;
+    }
   }
 
-  // If this run of applypatch created the copy, and we're here, we can delete it.
-  if (made_copy) {
-    unlink(CACHE_TEMP_SOURCE);
+  std::vector<const PatchJob*> pooled;
+  for (const auto& entry : located) {
+    (enough_space ? pooled : serial).push_back(entry.second);
   }
 
-  // Success!
-  return 0;
+  std::vector<int> results(pooled.size(), 1);
+  if (pooled.empty()) {
+    thread_count = 1;
+  }
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    FileContents source_file;
+    std::vector<unsigned char> block_buffer;
+    for (size_t i = next++; i < pooled.size(); i = next++) {
+      results[i] = PatchFileJob(*pooled[i], bonus_data, &source_file, &block_buffer);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  size_t patched_bytes = 0;
+  for (size_t i = 0; i < pooled.size(); ++i) {
+    if (results[i] == 0) {
+      patched_bytes += pooled[i]->target_size;
+    } else {
+      serial.push_back(pooled[i]);
+    }
+  }
+
+  size_t failed = 0;
+  for (const PatchJob* job : serial) {
+    if (applypatch(job->source_filename.c_str(), job->target_filename.c_str(),
+                   job->target_sha1.c_str(), job->target_size, job->patch_sha1s, job->patches,
+                   bonus_data) != 0) {
+      ++failed;
+    } else {
+      patched_bytes += job->target_size;
+    }
+  }
+
+  std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+  double seconds = duration.count();
+  printf("batch: %zu of %zu files (%zu bytes) done in %.3f s (%.2f MiB/s) using %zu threads\n",
+         jobs.size() - failed, jobs.size(), patched_bytes, seconds,
+         seconds > 0 ? patched_bytes / seconds / (1 << 20) : 0.0, thread_count);
+  return failed == 0 ? 0 : 1;
 }
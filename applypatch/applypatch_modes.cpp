@@ -16,6 +16,7 @@
 
 #include "applypatch_modes.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +26,7 @@
 #include <string>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <openssl/sha.h>
@@ -87,6 +89,37 @@ static bool ParsePatchArgs(int argc, const char** argv, std::vector<std::string>
     return true;
 }
 
+// Patch all the files listed in a manifest; see ParsePatchManifest() for
+// the format. The patch names in the manifest are paths of patch files.
+static int BatchMode(int argc, const char** argv) {
+    if (argc != 3) {
+        return 2;
+    }
+
+    std::string manifest;
+    if (!android::base::ReadFileToString(argv[2], &manifest)) {
+        printf("failed to read manifest \"%s\": %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    std::vector<PatchJob> jobs;
+    if (!ParsePatchManifest(manifest, &jobs)) {
+        printf("failed to parse manifest \"%s\"\n", argv[2]);
+        return 1;
+    }
+
+    for (auto& job : jobs) {
+        for (const auto& patch_name : job.patch_names) {
+            FileContents fc;
+            if (LoadFileContents(patch_name.c_str(), &fc) != 0) {
+                return 1;
+            }
+            job.patches.push_back(std::make_unique<Value>(
+                    VAL_BLOB, std::string(fc.data.cbegin(), fc.data.cend())));
+        }
+    }
+    return applypatch_batch(jobs, nullptr);
+}
+
 static int FlashMode(const char* src_filename, const char* tgt_filename,
                      const char* tgt_sha1, size_t tgt_size) {
     return applypatch_flash(src_filename, tgt_filename, tgt_sha1, tgt_size);
@@ -164,6 +197,9 @@ static int PatchMode(int argc, const char** argv) {
 // - otherwise, or if any error is encountered, exits with non-zero
 //   status.
 //
+// With -m, each line of <manifest> gives the arguments for one file as
+// above, and the files are patched in a single batch.
+//
 // <src-file> (or <file> in check mode) may refer to an EMMC partition
 // to read the source data.  See the comments for the
 // LoadPartitionContents() function for the format of such a filename.
@@ -175,13 +211,14 @@ int applypatch_modes(int argc, const char** argv) {
             "usage: %s [-b <bonus-file>] <src-file> <tgt-file> <tgt-sha1> <tgt-size> "
             "[<src-sha1>:<patch> ...]\n"
             "   or  %s -c <file> [<sha1> ...]\n"
+            "   or  %s -m <manifest>\n"
             "   or  %s -s <bytes>\n"
             "   or  %s -l\n"
             "\n"
             "Filenames may be of the form\n"
             "  EMMC:<partition>:<len_1>:<sha1_1>:<len_2>:<sha1_2>:...\n"
             "to specify reading from or writing to an EMMC partition.\n\n",
-            argv[0], argv[0], argv[0], argv[0]);
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 2;
     }
 
@@ -191,6 +228,8 @@ int applypatch_modes(int argc, const char** argv) {
         result = ShowLicenses();
     } else if (strncmp(argv[1], "-c", 3) == 0) {
         result = CheckMode(argc, argv);
+    } else if (strncmp(argv[1], "-m", 3) == 0) {
+        result = BatchMode(argc, argv);
     } else if (strncmp(argv[1], "-s", 3) == 0) {
         result = SpaceMode(argc, argv);
     } else {
@@ -27,6 +27,9 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <bzlib.h>
 
 #include "openssl/sha.h"
@@ -98,26 +101,19 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
-
-    std::vector<unsigned char> new_data;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset, &new_data) != 0) {
-        return -1;
-    }
+// The output is produced and handed to the sink in segments of at most this
+// many bytes, so that applying a patch doesn't need to hold the whole new file.
+static constexpr off_t kOutputSegmentSize = 1 << 20;
 
-    if (sink(new_data.data(), new_data.size(), token) < static_cast<ssize_t>(new_data.size())) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
-    }
-    if (ctx) SHA1_Update(ctx, new_data.data(), new_data.size());
-    return 0;
+static ssize_t VectorSink(const unsigned char* data, ssize_t len, void* token) {
+    std::vector<unsigned char>* v = static_cast<std::vector<unsigned char>*>(token);
+    v->insert(v->end(), data, data + len);
+    return len;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        std::vector<unsigned char>* new_data) {
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -178,11 +174,19 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         printf("failed to bzinit extra stream (%d)\n", bzerr);
     }
 
-    new_data->resize(new_size);
+    std::vector<unsigned char> segment(std::min<off_t>(new_size, kOutputSegmentSize));
+    auto emit = [&](size_t len) {
+        if (sink(segment.data(), len, token) < static_cast<ssize_t>(len)) {
+            printf("short write of output: %d (%s)\n", errno, strerror(errno));
+            return false;
+        }
+        if (ctx) SHA1_Update(ctx, segment.data(), len);
+        return true;
+    };
 
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    int i;
+    off_t i, len;
     unsigned char buf[24];
     while (newpos < new_size) {
         // Read control data
@@ -205,16 +209,21 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
             return 1;
         }
 
-        // Read diff string
-        if (FillBuffer(new_data->data() + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
-
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read diff string and add old data to it, one segment at a time
+        for (off_t done = 0; done < ctrl[0]; done += len) {
+            len = std::min(ctrl[0] - done, kOutputSegmentSize);
+            if (FillBuffer(segment.data(), len, &dstream) != 0) {
+                printf("error while reading diff stream\n");
+                return 1;
+            }
+            for (i = 0; i < len; ++i) {
+                off_t pos = oldpos + done + i;
+                if ((pos >= 0) && (pos < old_size)) {
+                    segment[i] += old_data[pos];
+                }
+            }
+            if (!emit(len)) {
+                return 1;
             }
         }
 
@@ -229,9 +238,15 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         }
 
         // Read extra string
-        if (FillBuffer(new_data->data() + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        for (off_t done = 0; done < ctrl[1]; done += len) {
+            len = std::min(ctrl[1] - done, kOutputSegmentSize);
+            if (FillBuffer(segment.data(), len, &estream) != 0) {
+                printf("error while reading extra stream\n");
+                return 1;
+            }
+            if (!emit(len)) {
+                return 1;
+            }
         }
 
         // Adjust pointers
@@ -244,3 +259,19 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     BZ2_bzDecompressEnd(&estream);
     return 0;
 }
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        std::vector<unsigned char>* new_data) {
+    new_data->clear();
+    if (patch->data.size() >= static_cast<size_t>(patch_offset) + 32) {
+        const unsigned char* header =
+                reinterpret_cast<const unsigned char*>(&patch->data[patch_offset]);
+        off_t new_size = offtin(header+24);
+        if (new_size > 0) {
+            new_data->reserve(new_size);
+        }
+    }
+    return ApplyBSDiffPatch(old_data, old_size, patch, patch_offset, VectorSink, new_data,
+                            nullptr);
+}
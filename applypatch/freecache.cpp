@@ -19,13 +19,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <ctype.h>
 
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 
@@ -72,23 +75,140 @@ static int EliminateOpenFiles(std::set<std::string>* files) {
   return 0;
 }
 
-static std::set<std::string> FindExpendableFiles() {
+// We're allowed to delete unopened regular files in any of these
+// directories.
+static const char* kExpendableDirs[] = { "/cache", "/cache/recovery/otatest" };
+
+// An index of the expendable files on /cache and their sizes. Building it
+// requires scanning the directories and every /proc/<pid>/fd entry, so it's
+// built once per process (i.e. once per update) and then kept up to date with
+// inotify. Files that show up after the index has been built are never
+// considered expendable, since we don't know whether they are open; that
+// includes an indexed path that is re-created or renamed over.
+//
+// Callers may run on several threads (apply_patch_batch(), parallel()), so
+// the index is only touched with expendable_index_lock held.
+struct ExpendableIndex {
+  bool valid = false;
+  int inotify_fd = -1;
+  std::map<int, std::string> watches;
+  // Maps each expendable file to the bytes it occupies on disk.
+  std::map<std::string, size_t> files;
+  size_t total_bytes = 0;
+  size_t scans = 0;
+  size_t scans_avoided = 0;
+};
+
+static ExpendableIndex expendable_index;
+static std::mutex expendable_index_lock;
+
+static void DropFromIndex(const std::string& path) {
+  auto it = expendable_index.files.find(path);
+  if (it != expendable_index.files.end()) {
+    expendable_index.total_bytes -= it->second;
+    expendable_index.files.erase(it);
+  }
+}
+
+static void UpdateIndexedSize(const std::string& path) {
+  auto it = expendable_index.files.find(path);
+  if (it == expendable_index.files.end()) {
+    return;
+  }
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    DropFromIndex(path);
+    return;
+  }
+  expendable_index.total_bytes -= it->second;
+  it->second = st.st_blocks * 512;
+  expendable_index.total_bytes += it->second;
+}
+
+static void InvalidateIndex() {
+  if (expendable_index.inotify_fd != -1) {
+    close(expendable_index.inotify_fd);
+  }
+  expendable_index.inotify_fd = -1;
+  expendable_index.watches.clear();
+  expendable_index.files.clear();
+  expendable_index.total_bytes = 0;
+  expendable_index.valid = false;
+}
+
+// Applies the pending inotify events to the index. Returns false if the
+// index can no longer be trusted and needs a full rescan.
+static bool DrainIndexEvents() {
+  if (expendable_index.inotify_fd == -1) {
+    return false;
+  }
+  alignas(struct inotify_event) char buf[4096];
+  while (true) {
+    ssize_t len = read(expendable_index.inotify_fd, buf, sizeof(buf));
+    if (len == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        return true;
+      }
+      printf("failed to read inotify events: %s\n", strerror(errno));
+      return false;
+    }
+    for (char* p = buf; p < buf + len; ) {
+      const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+      p += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        return false;
+      }
+      auto watch = expendable_index.watches.find(event->wd);
+      if (watch == expendable_index.watches.end() || event->len == 0) {
+        continue;
+      }
+      std::string path = watch->second + "/" + event->name;
+      if (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_CREATE | IN_MOVED_TO)) {
+        DropFromIndex(path);
+      } else if (event->mask & (IN_CLOSE_WRITE | IN_ATTRIB)) {
+        UpdateIndexedSize(path);
+      }
+    }
+  }
+}
+
+static void BuildIndex() {
+  InvalidateIndex();
+  expendable_index.scans++;
+
+  // Start watching before scanning, so that no change is missed in between.
+  expendable_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (expendable_index.inotify_fd == -1) {
+    printf("failed to init inotify: %s\n", strerror(errno));
+  }
+
   std::set<std::string> files;
-  // We're allowed to delete unopened regular files in any of these
-  // directories.
-  const char* dirs[2] = {"/cache", "/cache/recovery/otatest"};
+  for (const char* dir : kExpendableDirs) {
+    if (expendable_index.inotify_fd != -1) {
+      int wd = inotify_add_watch(expendable_index.inotify_fd, dir,
+                                 IN_DELETE | IN_MOVED_FROM | IN_CREATE | IN_MOVED_TO |
+                                 IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+      if (wd == -1) {
+        printf("failed to watch %s: %s\n", dir, strerror(errno));
+      } else {
+        expendable_index.watches[wd] = dir;
+      }
+    }
 
-  for (size_t i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
-    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dirs[i]), closedir);
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir), closedir);
     if (!d) {
-      printf("error opening %s: %s\n", dirs[i], strerror(errno));
+      printf("error opening %s: %s\n", dir, strerror(errno));
       continue;
     }
 
     // Look for regular files in the directory (not in any subdirectories).
     struct dirent* de;
     while ((de = readdir(d.get())) != 0) {
-      std::string path = std::string(dirs[i]) + "/" + de->d_name;
+      std::string path = std::string(dir) + "/" + de->d_name;
 
       // We can't delete CACHE_TEMP_SOURCE; if it's there we might have
       // restarted during installation and could be depending on it to
@@ -106,19 +226,45 @@ static std::set<std::string> FindExpendableFiles() {
 
   printf("%zu regular files in deletable directories\n", files.size());
   if (EliminateOpenFiles(&files) < 0) {
-    return std::set<std::string>();
+    InvalidateIndex();
+    return;
+  }
+
+  for (const auto& file : files) {
+    struct stat st;
+    if (stat(file.c_str(), &st) == 0) {
+      size_t bytes = st.st_blocks * 512;
+      expendable_index.files[file] = bytes;
+      expendable_index.total_bytes += bytes;
+    }
+  }
+  // Without inotify we can't tell when the index goes stale, so it's only
+  // good for this call.
+  expendable_index.valid = (expendable_index.inotify_fd != -1);
+}
+
+static const std::map<std::string, size_t>& FindExpendableFiles() {
+  if (expendable_index.valid && DrainIndexEvents()) {
+    expendable_index.scans_avoided++;
+  } else {
+    BuildIndex();
   }
-  return files;
+  printf("%zu expendable files (%zu bytes) on /cache; %zu scans, %zu avoided\n",
+         expendable_index.files.size(), expendable_index.total_bytes, expendable_index.scans,
+         expendable_index.scans_avoided);
+  return expendable_index.files;
 }
 
 int MakeFreeSpaceOnCache(size_t bytes_needed) {
+  std::lock_guard<std::mutex> lock(expendable_index_lock);
   size_t free_now = FreeSpaceForFile("/cache");
   printf("%zu bytes free on /cache (%zu needed)\n", free_now, bytes_needed);
 
   if (free_now >= bytes_needed) {
     return 0;
   }
-  std::set<std::string> files = FindExpendableFiles();
+  // Take a copy, since unlinking files below updates the index.
+  std::map<std::string, size_t> files = FindExpendableFiles();
   if (files.empty()) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
@@ -132,10 +278,11 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
   // Instead, we'll be dumb.
 
   for (const auto& file : files) {
-    unlink(file.c_str());
+    unlink(file.first.c_str());
+    DropFromIndex(file.first);
     free_now = FreeSpaceForFile("/cache");
-    printf("deleted %s; now %zu bytes free\n", file.c_str(), free_now);
-    if (free_now < bytes_needed) {
+    printf("deleted %s; now %zu bytes free\n", file.first.c_str(), free_now);
+    if (free_now >= bytes_needed) {
         break;
     }
   }
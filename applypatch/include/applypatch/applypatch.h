@@ -24,6 +24,7 @@
 #include <string>
 #include <vector>
 
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
 #include "edify/expr.h"
@@ -43,6 +44,21 @@ struct FileContents {
 
 typedef ssize_t (*SinkFn)(const unsigned char*, ssize_t, void*);
 
+// One file to be patched by applypatch_batch(). The fields mirror the
+// arguments of applypatch(); 'patch_names' holds the names the patches were
+// given in the manifest, for the caller to load into 'patches'. Unlike
+// applypatch(), 'target_filename' can't be "-"; ParsePatchManifest()
+// resolves that to the source.
+struct PatchJob {
+  std::string source_filename;
+  std::string target_filename;
+  std::string target_sha1;
+  size_t target_size;
+  std::vector<std::string> patch_sha1s;
+  std::vector<std::string> patch_names;
+  std::vector<std::unique_ptr<Value>> patches;
+};
+
 // applypatch.cpp
 int ShowLicenses();
 size_t FreeSpaceForFile(const char* filename);
@@ -60,8 +76,13 @@ int applypatch_check(const char* filename,
                      const std::vector<std::string>& patch_sha1_str);
 int applypatch_flash(const char* source_filename, const char* target_filename,
                      const char* target_sha1_str, size_t target_size);
+int applypatch_batch(const std::vector<PatchJob>& jobs, const Value* bonus_data);
+bool ParsePatchManifest(const std::string& manifest, std::vector<PatchJob>* jobs);
 
 int LoadFileContents(const char* filename, FileContents* file);
+int LoadFileContents(const char* filename, std::string* data);
+int HashFileContents(const char* filename, const EVP_MD* md, std::vector<uint8_t>* digest);
+int LoadFileSha1(const char* filename, uint8_t sha1[SHA_DIGEST_LENGTH]);
 int SaveFileContents(const char* filename, const FileContents* file);
 
 // bspatch.cpp
@@ -57,9 +57,10 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    ExprArena arena;
     Expr* root;
     int error_count = 0;
-    int error = parse_string(buffer.data(), &root, &error_count);
+    int error = parse_string(buffer.data(), &root, &error_count, &arena);
     printf("parse returned %d; %d errors encountered\n", error, error_count);
     if (error == 0 || error_count > 0) {
 
@@ -22,9 +22,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/parseint.h>
@@ -54,7 +59,7 @@ bool Evaluate(State* state, Expr* expr, std::string* result) {
         return false;
     }
 
-    *result = v->data;
+    *result = std::move(v->data);
     return true;
 }
 
@@ -73,20 +78,30 @@ Value* StringValue(const std::string& str) {
     return StringValue(str.c_str());
 }
 
+Value* StringValue(std::string&& str) {
+    // Keep the truncate-at-NUL behavior of the copying versions.
+    str.resize(strlen(str.c_str()));
+    return new Value(VAL_STRING, std::move(str));
+}
+
 Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
         return StringValue("");
     }
+    // The first argument's buffer becomes the result.
     std::string result;
-    for (int i = 0; i < argc; ++i) {
-        std::string str;
+    if (!Evaluate(state, argv[0], &result)) {
+        return nullptr;
+    }
+    std::string str;
+    for (int i = 1; i < argc; ++i) {
         if (!Evaluate(state, argv[i], &str)) {
             return nullptr;
         }
         result += str;
     }
 
-    return StringValue(result);
+    return StringValue(std::move(result));
 }
 
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -146,7 +161,7 @@ Value* SleepFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
     sleep(v);
 
-    return StringValue(val);
+    return StringValue(std::move(val));
 }
 
 Value* StdoutFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -182,7 +197,7 @@ Value* LogicalOrFn(const char* name, State* state,
     if (!BooleanString(left)) {
         return EvaluateValue(state, argv[1]);
     } else {
-        return StringValue(left);
+        return StringValue(std::move(left));
     }
 }
 
@@ -208,7 +223,7 @@ Value* SubstringFn(const char* name, State* state,
         return nullptr;
     }
 
-    std::string result = (haystack.find(needle) != std::string::npos) ? "t" : "";
+    const char* result = (haystack.find(needle) != std::string::npos) ? "t" : "";
     return StringValue(result);
 }
 
@@ -254,21 +269,25 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
         return nullptr;
     }
 
-    std::vector<std::string> args;
-    if (!ReadArgs(state, 2, argv, &args)) {
+    std::string left;
+    if (!Evaluate(state, argv[0], &left)) {
+        return nullptr;
+    }
+    std::string right;
+    if (!Evaluate(state, argv[1], &right)) {
         return nullptr;
     }
 
     // Parse up to at least long long or 64-bit integers.
     int64_t l_int;
-    if (!android::base::ParseInt(args[0].c_str(), &l_int)) {
-        state->errmsg = "failed to parse int in " + args[0];
+    if (!android::base::ParseInt(left.c_str(), &l_int)) {
+        state->errmsg = "failed to parse int in " + left;
         return nullptr;
     }
 
     int64_t r_int;
-    if (!android::base::ParseInt(args[1].c_str(), &r_int)) {
-        state->errmsg = "failed to parse int in " + args[1];
+    if (!android::base::ParseInt(right.c_str(), &r_int)) {
+        state->errmsg = "failed to parse int in " + right;
         return nullptr;
     }
 
@@ -289,6 +308,57 @@ Value* GreaterThanIntFn(const char* name, State* state,
     return LessThanIntFn(name, state, 2, temp);
 }
 
+// parallel(expr1, expr2, ...)
+//   Evaluates the arguments concurrently and returns the value of the last
+//   one, like "expr1; expr2; ...". Every argument runs to completion; if any
+//   of them aborts, the error of the first one in argument order is reported,
+//   so the outcome doesn't depend on scheduling. The arguments must not
+//   depend on each other's side effects. Functions registered elsewhere
+//   must be safe to call from several threads at once; see the notes in
+//   updater/install.cpp for which of the updater's are serialized.
+Value* ParallelFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc == 0) {
+        return StringValue("");
+    }
+
+    // Each branch gets its own State, so that errmsg and the error and cause
+    // codes are never written by two threads.
+    std::vector<State> states;
+    states.reserve(argc);
+    for (int i = 0; i < argc; ++i) {
+        states.emplace_back(state->script, state->cookie);
+        states.back().is_retry = state->is_retry;
+    }
+
+    std::vector<std::unique_ptr<Value>> results(argc);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = std::max(1, std::min<int>(argc, cpus > 0 ? cpus : 1));
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < argc; i = next++) {
+            results[i].reset(EvaluateValue(&states[i], argv[i]));
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    for (int i = 0; i < argc; ++i) {
+        if (!results[i]) {
+            state->errmsg = states[i].errmsg;
+            state->error_code = states[i].error_code;
+            state->cause_code = states[i].cause_code;
+            return nullptr;
+        }
+    }
+    return results[argc - 1].release();
+}
+
 Value* Literal(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(name);
 }
@@ -299,16 +369,120 @@ Value* Literal(const char* name, State* state, int argc, Expr* argv[]) {
 
 static std::unordered_map<std::string, Function> fn_table;
 
+// A perfect hash over fn_table, built by hash-and-displace: every name is
+// first hashed into a bucket, and each bucket then gets a seed under which
+// all of its names land in distinct, free slots.
+struct FunctionIndex {
+    struct Slot {
+        const std::string* name = nullptr;
+        Function fn = nullptr;
+    };
+
+    std::vector<uint32_t> seeds;
+    std::vector<Slot> slots;
+    bool stale = true;
+};
+
+static FunctionIndex fn_index;
+
+static uint32_t HashName(uint32_t seed, const char* name, size_t size) {
+    // FNV-1a, followed by the murmur3 finalizer so that nearby seeds give
+    // unrelated slots.
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ static_cast<uint8_t>(name[i])) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// Try to place every bucket into 'slot_count' slots. Returns false if some
+// bucket finds no seed within the search limit.
+static bool BuildFunctionIndex(size_t slot_count) {
+    size_t bucket_count = fn_table.size() / 2 + 1;
+    std::vector<std::vector<std::unordered_map<std::string, Function>::const_iterator>> buckets(
+        bucket_count);
+    for (auto it = fn_table.cbegin(); it != fn_table.cend(); ++it) {
+        buckets[HashName(0, it->first.data(), it->first.size()) % bucket_count].push_back(it);
+    }
+
+    // Place the largest buckets first, while the table is still empty.
+    std::vector<size_t> order(bucket_count);
+    for (size_t i = 0; i < bucket_count; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    fn_index.seeds.assign(bucket_count, 0);
+    fn_index.slots.assign(slot_count, FunctionIndex::Slot());
+    std::vector<size_t> placed;
+    for (size_t b : order) {
+        if (buckets[b].empty()) {
+            break;
+        }
+        bool found = false;
+        for (uint32_t seed = 1; seed < (1u << 16) && !found; ++seed) {
+            placed.clear();
+            for (const auto& it : buckets[b]) {
+                size_t slot = HashName(seed, it->first.data(), it->first.size()) % slot_count;
+                if (fn_index.slots[slot].name != nullptr ||
+                    std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+                    break;
+                }
+                placed.push_back(slot);
+            }
+            if (placed.size() == buckets[b].size()) {
+                for (size_t i = 0; i < placed.size(); ++i) {
+                    fn_index.slots[placed[i]] = { &buckets[b][i]->first, buckets[b][i]->second };
+                }
+                fn_index.seeds[b] = seed;
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void RegisterFunction(const std::string& name, Function fn) {
     fn_table[name] = fn;
+    fn_index.stale = true;
+}
+
+void UnregisterFunction(const std::string& name) {
+    if (fn_table.erase(name) != 0) {
+        fn_index.stale = true;
+    }
 }
 
 Function FindFunction(const std::string& name) {
-    if (fn_table.find(name) == fn_table.end()) {
+    if (fn_table.empty()) {
+        return nullptr;
+    }
+    if (fn_index.stale) {
+        size_t slot_count = fn_table.size() + fn_table.size() / 4 + 1;
+        while (!BuildFunctionIndex(slot_count)) {
+            slot_count += slot_count / 4 + 1;
+        }
+        fn_index.stale = false;
+    }
+
+    uint32_t bucket = HashName(0, name.data(), name.size()) % fn_index.seeds.size();
+    uint32_t slot = HashName(fn_index.seeds[bucket], name.data(), name.size()) %
+                    fn_index.slots.size();
+    const FunctionIndex::Slot& entry = fn_index.slots[slot];
+    if (entry.name == nullptr || *entry.name != name) {
         return nullptr;
-    } else {
-        return fn_table[name];
     }
+    return entry.fn;
 }
 
 void RegisterBuiltins() {
@@ -319,12 +493,168 @@ void RegisterBuiltins() {
     RegisterFunction("is_substring", SubstringFn);
     RegisterFunction("stdout", StdoutFn);
     RegisterFunction("sleep", SleepFn);
+    RegisterFunction("parallel", ParallelFn);
 
     RegisterFunction("less_than_int", LessThanIntFn);
     RegisterFunction("greater_than_int", GreaterThanIntFn);
 }
 
 
+// -----------------------------------------------------------------
+//   the Value pool
+// -----------------------------------------------------------------
+
+// Freed Values are kept on a per-thread free list and reused by the next
+// allocation. Slots are carved out of chunks that are never returned to the
+// heap, so a Value may be freed on a different thread than the one that
+// allocated it. When a thread exits, its free list goes to a shared list
+// that other threads refill from.
+//
+// Values may still be freed while a thread's (or the process's) other
+// thread_local and static objects are being destroyed. So the per-thread
+// list is a plain pointer, the shared lock is never destroyed, and once a
+// thread has handed its list over, its later frees go to the shared list.
+
+struct FreeValue {
+    FreeValue* next;
+};
+
+static constexpr size_t kValuesPerChunk = 64;
+
+static std::mutex& SharedFreeValuesLock() {
+    static std::mutex* lock = new std::mutex;
+    return *lock;
+}
+static FreeValue* shared_free_values = nullptr;
+
+static void PushFreeValues(FreeValue** list, FreeValue* head) {
+    FreeValue* tail = head;
+    while (tail->next != nullptr) {
+        tail = tail->next;
+    }
+    tail->next = *list;
+    *list = head;
+}
+
+static thread_local FreeValue* free_values = nullptr;
+static thread_local bool free_values_released = false;
+
+// Hands this thread's free list over to shared_free_values when the thread
+// exits. Touching 'armed' constructs it, which is done whenever the list
+// goes from empty to non-empty.
+struct FreeValuesReleaser {
+    bool armed = false;
+
+    ~FreeValuesReleaser() {
+        if (free_values != nullptr) {
+            std::lock_guard<std::mutex> lock(SharedFreeValuesLock());
+            PushFreeValues(&shared_free_values, free_values);
+            free_values = nullptr;
+        }
+        free_values_released = true;
+    }
+};
+
+static thread_local FreeValuesReleaser free_values_releaser;
+
+// Returns a list of free slots, taken from the shared list if it has any.
+static FreeValue* TakeFreeValues() {
+    {
+        std::lock_guard<std::mutex> lock(SharedFreeValuesLock());
+        FreeValue* head = shared_free_values;
+        shared_free_values = nullptr;
+        if (head != nullptr) {
+            return head;
+        }
+    }
+    FreeValue* head = nullptr;
+    char* chunk = static_cast<char*>(::operator new(kValuesPerChunk * sizeof(Value)));
+    for (size_t i = kValuesPerChunk; i > 0; --i) {
+        FreeValue* slot = reinterpret_cast<FreeValue*>(chunk + (i - 1) * sizeof(Value));
+        slot->next = head;
+        head = slot;
+    }
+    return head;
+}
+
+void* Value::operator new(size_t size) {
+    if (size != sizeof(Value)) {
+        return ::operator new(size);
+    }
+    if (free_values == nullptr) {
+        FreeValue* head = TakeFreeValues();
+        if (free_values_released) {
+            // Nothing would hand a new list over any more; keep only the
+            // slot being allocated.
+            if (head->next != nullptr) {
+                std::lock_guard<std::mutex> lock(SharedFreeValuesLock());
+                PushFreeValues(&shared_free_values, head->next);
+            }
+            return head;
+        }
+        free_values_releaser.armed = true;
+        free_values = head;
+    }
+    FreeValue* slot = free_values;
+    free_values = slot->next;
+    return slot;
+}
+
+void Value::operator delete(void* ptr, size_t size) {
+    if (ptr == nullptr) {
+        return;
+    }
+    if (size != sizeof(Value)) {
+        ::operator delete(ptr);
+        return;
+    }
+    FreeValue* slot = static_cast<FreeValue*>(ptr);
+    if (free_values_released) {
+        std::lock_guard<std::mutex> lock(SharedFreeValuesLock());
+        slot->next = shared_free_values;
+        shared_free_values = slot;
+        return;
+    }
+    if (free_values == nullptr) {
+        free_values_releaser.armed = true;
+    }
+    slot->next = free_values;
+    free_values = slot;
+}
+
+// -----------------------------------------------------------------
+//   the parse tree arena
+// -----------------------------------------------------------------
+
+void* ExprArena::Allocate(size_t size) {
+    constexpr size_t kAlign = alignof(Expr);
+    size = (size + kAlign - 1) & ~(kAlign - 1);
+    allocated_ += size;
+
+    // Oversized requests get a block of their own, so they don't waste the
+    // rest of the current one.
+    if (size > kBlockSize / 4) {
+        blocks_.emplace_back(new char[size]);
+        return blocks_.back().get();
+    }
+    if (size > remaining_) {
+        blocks_.emplace_back(new char[kBlockSize]);
+        next_ = blocks_.back().get();
+        remaining_ = kBlockSize;
+    }
+    void* result = next_;
+    next_ += size;
+    remaining_ -= size;
+    return result;
+}
+
+char* ExprArena::Strdup(const char* str, size_t size) {
+    char* result = static_cast<char*>(Allocate(size + 1));
+    memcpy(result, str, size);
+    result[size] = '\0';
+    return result;
+}
+
 // -----------------------------------------------------------------
 //   convenience methods for functions
 // -----------------------------------------------------------------
@@ -336,13 +666,14 @@ bool ReadArgs(State* state, int argc, Expr* argv[], std::vector<std::string>* ar
     if (args == nullptr) {
         return false;
     }
+    args->reserve(args->size() + argc);
     for (int i = 0; i < argc; ++i) {
         std::string var;
         if (!Evaluate(state, argv[i], &var)) {
             args->clear();
             return false;
         }
-        args->push_back(var);
+        args->push_back(std::move(var));
     }
     return true;
 }
@@ -355,6 +686,7 @@ bool ReadValueArgs(State* state, int argc, Expr* argv[],
     if (args == nullptr) {
         return false;
     }
+    args->reserve(args->size() + argc);
     for (int i = 0; i < argc; ++i) {
         std::unique_ptr<Value> v(EvaluateValue(state, argv[i]));
         if (!v) {
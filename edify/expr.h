@@ -17,8 +17,13 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stddef.h>
 #include <unistd.h>
+
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "error_code.h"
 
@@ -61,6 +66,17 @@ struct Value {
     Value(ValueType type, const std::string& str) :
         type(type),
         data(str) {}
+
+    Value(ValueType type, std::string&& str) :
+        type(type),
+        data(std::move(str)) {}
+
+    // Values come from a pool of recycled slots instead of a heap
+    // allocation per intermediate result. Together with the short string
+    // optimization this makes results like "t" and "" allocation-free;
+    // callers still own the returned Value and delete it as before.
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr, size_t size);
 };
 
 struct Expr;
@@ -75,6 +91,41 @@ struct Expr {
     int start, end;
 };
 
+// Bump allocator that owns every Expr, argv array and name of a parsed
+// script, so that the whole tree is freed at once when the arena goes away.
+// Expr pointers from parse_string() must not outlive the arena.
+class ExprArena {
+  public:
+    ExprArena() = default;
+    ExprArena(const ExprArena&) = delete;
+    ExprArena& operator=(const ExprArena&) = delete;
+
+    // Returns uninitialized memory aligned for any Expr field.
+    void* Allocate(size_t size);
+
+    Expr* NewExpr() {
+        return static_cast<Expr*>(Allocate(sizeof(Expr)));
+    }
+
+    Expr** NewArgv(size_t count) {
+        return static_cast<Expr**>(Allocate(count * sizeof(Expr*)));
+    }
+
+    // Copy 'size' bytes of 'str' into the arena and NUL-terminate them.
+    char* Strdup(const char* str, size_t size);
+
+    // Total bytes handed out, for diagnostics.
+    size_t allocated() const { return allocated_; }
+
+  private:
+    static constexpr size_t kBlockSize = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* next_ = nullptr;
+    size_t remaining_ = 0;
+    size_t allocated_ = 0;
+};
+
 // Take one of the Expr*s passed to the function as an argument,
 // evaluate it, return the resulting Value.  The caller takes
 // ownership of the returned Value.
@@ -106,16 +157,22 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AbortFn(const char* name, State* state, int argc, Expr* argv[]);
+Value* ParallelFn(const char* name, State* state, int argc, Expr* argv[]);
 
 // Register a new function.  The same Function may be registered under
 // multiple names, but a given name should only be used once.
 void RegisterFunction(const std::string& name, Function fn);
 
+// Remove a function registered with RegisterFunction(), if there is one.
+void UnregisterFunction(const std::string& name);
+
 // Register all the builtins.
 void RegisterBuiltins();
 
 // Find the Function for a given name; return NULL if no such function
-// exists.
+// exists. The first lookup after a RegisterFunction() call builds a
+// perfect hash over the registered names, so each later lookup is one
+// probe and one string compare.
 Function FindFunction(const std::string& name);
 
 // --- convenience functions for use in functions ---
@@ -145,6 +202,11 @@ Value* StringValue(const char* str);
 
 Value* StringValue(const std::string& str);
 
-int parse_string(const char* str, Expr** root, int* error_count);
+// Moves the payload instead of copying it, so functions can return a result
+// they built locally without another allocation.
+Value* StringValue(std::string&& str);
+
+// Parse 'str' into a tree of Exprs allocated from 'arena'.
+int parse_string(const char* str, Expr** root, int* error_count, ExprArena* arena);
 
 #endif  // _EXPRESSION_H
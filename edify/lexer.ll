@@ -25,6 +25,7 @@
 int gLine = 1;
 int gColumn = 1;
 int gPos = 0;
+ExprArena* gArena = nullptr;
 
 std::string string_buffer;
 
@@ -53,7 +54,7 @@ std::string string_buffer;
       ++gColumn;
       ++gPos;
       BEGIN(INITIAL);
-      yylval.str = strdup(string_buffer.c_str());
+      yylval.str = gArena->Strdup(string_buffer.data(), string_buffer.size());
       yylloc.end = gPos;
       return STRING;
   }
@@ -92,7 +93,7 @@ endif             ADVANCE; return ENDIF;
 
 [a-zA-Z0-9_:/.]+ {
   ADVANCE;
-  yylval.str = strdup(yytext);
+  yylval.str = gArena->Strdup(yytext, yyleng);
   return STRING;
 }
 
@@ -19,15 +19,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <vector>
+
 #include "expr.h"
 #include "yydefs.h"
 #include "parser.h"
 
 extern int gLine;
 extern int gColumn;
+extern ExprArena* gArena;
 
-void yyerror(Expr** root, int* error_count, const char* s);
-int yyparse(Expr** root, int* error_count);
+void yyerror(Expr** root, int* error_count, ExprArena* arena, const char* s);
+int yyparse(Expr** root, int* error_count, ExprArena* arena);
 
 struct yy_buffer_state;
 void yy_switch_to_buffer(struct yy_buffer_state* new_buffer);
@@ -35,14 +38,19 @@ struct yy_buffer_state* yy_scan_string(const char* yystr);
 
 // Convenience function for building expressions with a fixed number
 // of arguments.
-static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
+// Arguments of the calls being parsed. Inner calls are reduced before the
+// outer argument list grows, so each arglist is a contiguous range at the
+// top of the stack, which gets copied into an exact-size argv.
+static std::vector<Expr*> arg_stack;
+
+static Expr* Build(ExprArena* arena, Function fn, YYLTYPE loc, size_t count, ...) {
     va_list v;
     va_start(v, count);
-    Expr* e = static_cast<Expr*>(malloc(sizeof(Expr)));
+    Expr* e = arena->NewExpr();
     e->fn = fn;
     e->name = "(operator)";
     e->argc = count;
-    e->argv = static_cast<Expr**>(malloc(count * sizeof(Expr*)));
+    e->argv = arena->NewArgv(count);
     for (size_t i = 0; i < count; ++i) {
         e->argv[i] = va_arg(v, Expr*);
     }
@@ -60,8 +68,8 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
     char* str;
     Expr* expr;
     struct {
+        int start;
         int argc;
-        Expr** argv;
     } args;
 }
 
@@ -72,6 +80,7 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
 
 %parse-param {Expr** root}
 %parse-param {int* error_count}
+%parse-param {ExprArena* arena}
 %error-verbose
 
 /* declarations in increasing order of precedence */
@@ -89,7 +98,7 @@ input:  expr           { *root = $1; }
 ;
 
 expr:  STRING {
-    $$ = static_cast<Expr*>(malloc(sizeof(Expr)));
+    $$ = arena->NewExpr();
     $$->fn = Literal;
     $$->name = $1;
     $$->argc = 0;
@@ -99,52 +108,57 @@ expr:  STRING {
 }
 |  '(' expr ')'                      { $$ = $2; $$->start=@$.start; $$->end=@$.end; }
 |  expr ';'                          { $$ = $1; $$->start=@1.start; $$->end=@1.end; }
-|  expr ';' expr                     { $$ = Build(SequenceFn, @$, 2, $1, $3); }
+|  expr ';' expr                     { $$ = Build(arena, SequenceFn, @$, 2, $1, $3); }
 |  error ';' expr                    { $$ = $3; $$->start=@$.start; $$->end=@$.end; }
-|  expr '+' expr                     { $$ = Build(ConcatFn, @$, 2, $1, $3); }
-|  expr EQ expr                      { $$ = Build(EqualityFn, @$, 2, $1, $3); }
-|  expr NE expr                      { $$ = Build(InequalityFn, @$, 2, $1, $3); }
-|  expr AND expr                     { $$ = Build(LogicalAndFn, @$, 2, $1, $3); }
-|  expr OR expr                      { $$ = Build(LogicalOrFn, @$, 2, $1, $3); }
-|  '!' expr                          { $$ = Build(LogicalNotFn, @$, 1, $2); }
-|  IF expr THEN expr ENDIF           { $$ = Build(IfElseFn, @$, 2, $2, $4); }
-|  IF expr THEN expr ELSE expr ENDIF { $$ = Build(IfElseFn, @$, 3, $2, $4, $6); }
+|  expr '+' expr                     { $$ = Build(arena, ConcatFn, @$, 2, $1, $3); }
+|  expr EQ expr                      { $$ = Build(arena, EqualityFn, @$, 2, $1, $3); }
+|  expr NE expr                      { $$ = Build(arena, InequalityFn, @$, 2, $1, $3); }
+|  expr AND expr                     { $$ = Build(arena, LogicalAndFn, @$, 2, $1, $3); }
+|  expr OR expr                      { $$ = Build(arena, LogicalOrFn, @$, 2, $1, $3); }
+|  '!' expr                          { $$ = Build(arena, LogicalNotFn, @$, 1, $2); }
+|  IF expr THEN expr ENDIF           { $$ = Build(arena, IfElseFn, @$, 2, $2, $4); }
+|  IF expr THEN expr ELSE expr ENDIF { $$ = Build(arena, IfElseFn, @$, 3, $2, $4, $6); }
 | STRING '(' arglist ')' {
-    $$ = static_cast<Expr*>(malloc(sizeof(Expr)));
+    $$ = arena->NewExpr();
     $$->fn = FindFunction($1);
     if ($$->fn == nullptr) {
         char buffer[256];
         snprintf(buffer, sizeof(buffer), "unknown function \"%s\"", $1);
-        yyerror(root, error_count, buffer);
+        yyerror(root, error_count, arena, buffer);
         YYERROR;
     }
     $$->name = $1;
     $$->argc = $3.argc;
-    $$->argv = $3.argv;
+    $$->argv = nullptr;
+    if ($3.argc > 0) {
+        $$->argv = arena->NewArgv($3.argc);
+        memcpy($$->argv, &arg_stack[$3.start], $3.argc * sizeof(Expr*));
+    }
+    arg_stack.resize($3.start);
     $$->start = @$.start;
     $$->end = @$.end;
 }
 ;
 
 arglist:    /* empty */ {
+    $$.start = arg_stack.size();
     $$.argc = 0;
-    $$.argv = NULL;
 }
 | expr {
+    $$.start = arg_stack.size();
     $$.argc = 1;
-    $$.argv = static_cast<Expr**>(malloc(sizeof(Expr*)));
-    $$.argv[0] = $1;
+    arg_stack.push_back($1);
 }
 | arglist ',' expr {
-    $$.argc = $1.argc + 1;
-    $$.argv = static_cast<Expr**>(realloc($$.argv, $$.argc * sizeof(Expr*)));
-    $$.argv[$$.argc-1] = $3;
+    $$ = $1;
+    ++$$.argc;
+    arg_stack.push_back($3);
 }
 ;
 
 %%
 
-void yyerror(Expr** root, int* error_count, const char* s) {
+void yyerror(Expr** root, int* error_count, ExprArena* arena, const char* s) {
   if (strlen(s) == 0) {
     s = "syntax error";
   }
@@ -152,7 +166,15 @@ void yyerror(Expr** root, int* error_count, const char* s) {
   ++*error_count;
 }
 
-int parse_string(const char* str, Expr** root, int* error_count) {
+int parse_string(const char* str, Expr** root, int* error_count, ExprArena* arena) {
+    // The lexer has no parameters of its own; it copies tokens into the
+    // arena through gArena.
+    gArena = arena;
+    arg_stack.clear();
     yy_switch_to_buffer(yy_scan_string(str));
-    return yyparse(root, error_count);
+    int result = yyparse(root, error_count, arena);
+    gArena = nullptr;
+    arg_stack.clear();
+    arg_stack.shrink_to_fit();
+    return result;
 }
@@ -42,6 +42,7 @@
 #include "error_code.h"
 #include "install.h"
 #include "minui/minui.h"
+#include "otautil/StatusChannel.h"
 #include "otautil/SysUtil.h"
 #include "roots.h"
 #include "ui.h"
@@ -350,6 +351,10 @@ try_update_binary(const char* path, ZipArchiveHandle zip, bool* wipe_cache,
     //            to be able to reboot during installation (useful for
     //            debugging packages that don't exit).
     //
+    //     The same commands may also be sent as the binary frames
+    //     described in otautil/StatusChannel.h. We set STATUS_FRAMES_ENV
+    //     to tell the update binary that we understand them.
+    //
     //   - the name of the package zip file.
     //
     //   - an optional argument "retry" if this update is a retry of a failed
@@ -363,6 +368,9 @@ try_update_binary(const char* path, ZipArchiveHandle zip, bool* wipe_cache,
         chr_args[i] = args[i].c_str();
     }
 
+    // Set it here rather than in the child, which shouldn't allocate after fork().
+    setenv(STATUS_FRAMES_ENV, "1", 1);
+
     pid_t pid = fork();
 
     if (pid == -1) {
@@ -384,52 +392,51 @@ try_update_binary(const char* path, ZipArchiveHandle zip, bool* wipe_cache,
     *wipe_cache = false;
     bool retry_update = false;
 
-    char buffer[1024];
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
-
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
-
-            ui->ShowProgress(fraction * (1-VERIFICATION_PROGRESS_FRACTION), seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui->SetProgress(fraction);
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str) {
-                ui->PrintOnScreenOnly("%s", str);
-            } else {
-                ui->PrintOnScreenOnly("\n");
-            }
-            fflush(stdout);
-        } else if (strcmp(command, "wipe_cache") == 0) {
-            *wipe_cache = true;
-        } else if (strcmp(command, "clear_display") == 0) {
-            ui->SetBackground(RecoveryUI::NONE);
-        } else if (strcmp(command, "enable_reboot") == 0) {
-            // packages can explicitly request that they want the user
-            // to be able to reboot during installation (useful for
-            // debugging packages that don't exit).
-            ui->SetEnableReboot(true);
-        } else if (strcmp(command, "retry_update") == 0) {
-            retry_update = true;
-        } else if (strcmp(command, "log") == 0) {
-            // Save the logging request from updater and write to
-            // last_install later.
-            log_buffer.push_back(std::string(strtok(NULL, "\n")));
-        } else {
-            LOG(ERROR) << "unknown command [" << command << "]";
+    StatusReader from_child(pipefd[0]);
+    StatusMessage message;
+    while (from_child.Next(&message)) {
+        switch (message.command) {
+            case StatusCommand::PROGRESS:
+                ui->ShowProgress(message.fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                                 message.seconds);
+                break;
+            case StatusCommand::SET_PROGRESS:
+                ui->SetProgress(message.fraction);
+                break;
+            case StatusCommand::UI_PRINT:
+                if (!message.text.empty()) {
+                    ui->PrintOnScreenOnly("%s", message.text.c_str());
+                } else {
+                    ui->PrintOnScreenOnly("\n");
+                }
+                fflush(stdout);
+                break;
+            case StatusCommand::WIPE_CACHE:
+                *wipe_cache = true;
+                break;
+            case StatusCommand::CLEAR_DISPLAY:
+                ui->SetBackground(RecoveryUI::NONE);
+                break;
+            case StatusCommand::ENABLE_REBOOT:
+                // packages can explicitly request that they want the user
+                // to be able to reboot during installation (useful for
+                // debugging packages that don't exit).
+                ui->SetEnableReboot(true);
+                break;
+            case StatusCommand::RETRY_UPDATE:
+                retry_update = true;
+                break;
+            case StatusCommand::LOG:
+                // Save the logging request from updater and write to
+                // last_install later.
+                log_buffer.push_back(message.text);
+                break;
+            default:
+                LOG(ERROR) << "unknown command [" << message.text << "]";
+                break;
         }
     }
-    fclose(from_child);
+    close(pipefd[0]);
 
     int status;
     waitpid(pid, &status, 0);
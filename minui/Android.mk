@@ -2,11 +2,14 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+    blend.cpp \
     events.cpp \
+    glyph_cache.cpp \
     graphics.cpp \
     graphics_adf.cpp \
     graphics_drm.cpp \
     graphics_fbdev.cpp \
+    graphics_memory.cpp \
     resources.cpp \
 
 LOCAL_WHOLE_STATIC_LIBRARIES += libadf
@@ -49,3 +52,13 @@ LOCAL_WHOLE_STATIC_LIBRARIES += libminui
 LOCAL_SHARED_LIBRARIES := libpng
 LOCAL_CFLAGS := -Werror
 include $(BUILD_SHARED_LIBRARY)
+
+# minui_benchmark (times the pixel kernels on an offscreen surface)
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := benchmark.cpp
+LOCAL_MODULE := minui_benchmark
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libminui
+LOCAL_CFLAGS := -Werror
+include $(BUILD_EXECUTABLE)
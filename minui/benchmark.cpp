@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times the minui pixel kernels against their portable versions by
+// drawing full frames into an offscreen surface, and gr_text()'s glyph
+// cache against blending each character from the font.
+//
+//   minui_benchmark [width height [font_scale [frames]]]
+//
+// The defaults are a 1440x2560 (xxxhdpi) panel and the built-in 10x18
+// font scaled up 4x, which is about the size of the xxxhdpi font.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "blend.h"
+#include "font_10x18.h"
+#include "glyph_cache.h"
+#include "minui.h"
+
+typedef void (*MaskKernel)(const unsigned char*, int, unsigned char*, int, int, int,
+                           unsigned char, unsigned char, unsigned char, unsigned char);
+typedef void (*FillKernel)(unsigned char*, int, int, int,
+                           unsigned char, unsigned char, unsigned char, unsigned char);
+
+static double now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Decodes the built-in font into a GRSurface the same way gr_init_font()
+// does, scaled up by 'scale' with softened edges so that the mask has
+// the mix of 0, 255 and partial values a real anti-aliased font has.
+static GRFont* load_font(int scale) {
+    int width = font.width, height = font.height;
+    std::vector<unsigned char> bits(width * height);
+    unsigned char* out = bits.data();
+    unsigned char data;
+    unsigned char* in = font.rundata;
+    while ((data = *in++)) {
+        memset(out, (data & 0x80) ? 255 : 0, data & 0x7f);
+        out += (data & 0x7f);
+    }
+
+    GRSurface* texture = static_cast<GRSurface*>(malloc(sizeof(GRSurface)));
+    texture->width = width * scale;
+    texture->height = height * scale;
+    texture->row_bytes = texture->width;
+    texture->pixel_bytes = 1;
+    texture->data = static_cast<unsigned char*>(malloc(texture->width * texture->height));
+    for (int y = 0; y < texture->height; ++y) {
+        const unsigned char* src = bits.data() + (y / scale) * width;
+        unsigned char* dst = texture->data + y * texture->row_bytes;
+        for (int x = 0; x < texture->width; ++x) {
+            int left = src[(x > 0 ? x - 1 : x) / scale];
+            int right = src[(x + 1 < texture->width ? x + 1 : x) / scale];
+            dst[x] = (left + 2 * src[x / scale] + right) / 4;
+        }
+    }
+
+    GRFont* f = static_cast<GRFont*>(malloc(sizeof(GRFont)));
+    f->texture = texture;
+    f->char_width = font.char_width * scale;
+    f->char_height = font.char_height * scale;
+    return f;
+}
+
+// Fills the surface with text the way gr_text() lays it out.
+static void draw_text_screen(GRSurface* surface, const GRFont* f, MaskKernel kernel,
+                             unsigned char alpha) {
+    char ch = ' ';
+    for (int y = 0; y + f->char_height <= surface->height; y += f->char_height) {
+        for (int x = 0; x + f->char_width <= surface->width; x += f->char_width) {
+            unsigned char* src_p = f->texture->data + (ch - ' ') * f->char_width;
+            unsigned char* dst_p = surface->data + y * surface->row_bytes +
+                                   x * surface->pixel_bytes;
+            kernel(src_p, f->texture->row_bytes, dst_p, surface->row_bytes,
+                   f->char_width, f->char_height, 255, 255, 0, alpha);
+            ch = (ch == '~') ? ' ' : ch + 1;
+        }
+    }
+}
+
+// Draws lines of text the way gr_text() used to, one blend per character.
+static void draw_lines_blended(GRSurface* surface, const GRFont* f, const char* line,
+                               int lines, unsigned char alpha) {
+    int count = strlen(line);
+    for (int y = 0; y < lines; ++y) {
+        unsigned char* dst_p = surface->data + y * f->char_height * surface->row_bytes;
+        for (int i = 0; i < count; ++i, dst_p += f->char_width * surface->pixel_bytes) {
+            unsigned char* src_p = f->texture->data + (line[i] - ' ') * f->char_width;
+            blend_mask(src_p, f->texture->row_bytes, dst_p, surface->row_bytes,
+                       f->char_width, f->char_height, 255, 255, 0, alpha);
+        }
+    }
+}
+
+static void draw_lines_cached(GRSurface* surface, const GRFont* f, const char* line,
+                              int lines, unsigned char alpha) {
+    int count = strlen(line);
+    for (int y = 0; y < lines; ++y) {
+        glyph_cache_text(f, line, count, false,
+                         surface->data + y * f->char_height * surface->row_bytes,
+                         surface->row_bytes, 255, 255, 0, alpha);
+    }
+}
+
+static double time_frames(int frames, const std::function<void()>& draw) {
+    draw();  // warm up
+    double start = now_ms();
+    for (int i = 0; i < frames; ++i) {
+        draw();
+    }
+    return (now_ms() - start) / frames;
+}
+
+static void report(const char* name, double generic_ms, double simd_ms) {
+    printf("%-22s generic %8.3f ms   simd %8.3f ms   %5.2fx\n",
+           name, generic_ms, simd_ms, generic_ms / simd_ms);
+}
+
+int main(int argc, char** argv) {
+    int width = argc > 2 ? atoi(argv[1]) : 1440;
+    int height = argc > 2 ? atoi(argv[2]) : 2560;
+    int scale = argc > 3 ? atoi(argv[3]) : 4;
+    int frames = argc > 4 ? atoi(argv[4]) : 20;
+    if (width <= 0 || height <= 0 || scale <= 0 || frames <= 0) {
+        fprintf(stderr, "usage: %s [width height [font_scale [frames]]]\n", argv[0]);
+        return 1;
+    }
+
+    GRSurface surface;
+    surface.width = width;
+    surface.height = height;
+    surface.pixel_bytes = 4;
+    surface.row_bytes = width * 4;
+    surface.data = static_cast<unsigned char*>(calloc(height, surface.row_bytes));
+    GRFont* f = load_font(scale);
+
+    printf("%dx%d surface, %dx%d glyphs, %d frames\n",
+           width, height, f->char_width, f->char_height, frames);
+
+    FillKernel fills[] = { blend_fill_generic, blend_fill };
+    double clear[2], fill[2];
+    for (int k = 0; k < 2; ++k) {
+        clear[k] = time_frames(frames, [&]() {
+            fills[k](surface.data, surface.row_bytes, width, height, 0x20, 0x40, 0x60, 255);
+        });
+        fill[k] = time_frames(frames, [&]() {
+            fills[k](surface.data, surface.row_bytes, width, height, 0x20, 0x40, 0x60, 128);
+        });
+    }
+    report("clear (non-gray)", clear[0], clear[1]);
+    report("fill (alpha 128)", fill[0], fill[1]);
+
+    MaskKernel masks[] = { blend_mask_generic, blend_mask };
+    double text[2], translucent[2];
+    for (int k = 0; k < 2; ++k) {
+        text[k] = time_frames(frames, [&]() {
+            draw_text_screen(&surface, f, masks[k], 255);
+        });
+        translucent[k] = time_frames(frames, [&]() {
+            draw_text_screen(&surface, f, masks[k], 160);
+        });
+    }
+    report("text (opaque)", text[0], text[1]);
+    report("text (alpha 160)", translucent[0], translucent[1]);
+
+    // A screenful of the same menu line, as recovery draws it.
+    static const char kLine[] = "Apply update from ADB";
+    int line_chars = std::min<int>(strlen(kLine), width / f->char_width);
+    std::string line(kLine, line_chars);
+    int lines = height / f->char_height;
+    for (unsigned char alpha : { 255, 160 }) {
+        double blended = time_frames(frames, [&]() {
+            draw_lines_blended(&surface, f, line.c_str(), lines, alpha);
+        });
+        double cached = time_frames(frames, [&]() {
+            draw_lines_cached(&surface, f, line.c_str(), lines, alpha);
+        });
+        printf("%d-char line (alpha %3d)  blended %6.2f us   cached %6.2f us   %5.2fx\n",
+               line_chars, alpha, blended * 1000 / lines, cached * 1000 / lines,
+               blended / cached);
+    }
+    printf("glyph cache: %zu bytes\n", glyph_cache_bytes());
+
+    return 0;
+}
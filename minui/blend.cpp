@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "blend.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define BLEND_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLEND_NEON 1
+#endif
+
+static void mask_row_generic(const unsigned char* sx, unsigned char* px, int width,
+                             unsigned char r, unsigned char g, unsigned char b,
+                             unsigned char ca) {
+    for (int i = 0; i < width; ++i, px += 4) {
+        unsigned int a = sx[i];
+        if (ca < 255) a = div255(a * ca);
+        if (a == 255) {
+            px[0] = r;
+            px[1] = g;
+            px[2] = b;
+        } else if (a > 0) {
+            unsigned int inv = 255 - a;
+            px[0] = div255(px[0] * inv + r * a);
+            px[1] = div255(px[1] * inv + g * a);
+            px[2] = div255(px[2] * inv + b * a);
+        }
+    }
+}
+
+static void fill_row_generic(unsigned char* px, int width,
+                             unsigned char r, unsigned char g, unsigned char b,
+                             unsigned char a) {
+    if (a == 255) {
+        // One 32-bit read-modify-write per pixel; building the words from
+        // bytes keeps this independent of endianness.
+        const unsigned char color_bytes[4] = { r, g, b, 0 };
+        const unsigned char keep_bytes[4] = { 0, 0, 0, 0xff };
+        uint32_t color, keep;
+        memcpy(&color, color_bytes, 4);
+        memcpy(&keep, keep_bytes, 4);
+        for (int i = 0; i < width; ++i, px += 4) {
+            uint32_t v;
+            memcpy(&v, px, 4);
+            v = (v & keep) | color;
+            memcpy(px, &v, 4);
+        }
+        return;
+    }
+
+    unsigned int inv = 255 - a;
+    unsigned int ra = r * a, ga = g * a, ba = b * a;
+    for (int i = 0; i < width; ++i, px += 4) {
+        px[0] = div255(px[0] * inv + ra);
+        px[1] = div255(px[1] * inv + ga);
+        px[2] = div255(px[2] * inv + ba);
+    }
+}
+
+void blend_mask_generic(const unsigned char* src, int src_row_bytes,
+                        unsigned char* dst, int dst_row_bytes, int width, int height,
+                        unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    if (a == 0) return;
+    for (int j = 0; j < height; ++j) {
+        mask_row_generic(src, dst, width, r, g, b, a);
+        src += src_row_bytes;
+        dst += dst_row_bytes;
+    }
+}
+
+void blend_fill_generic(unsigned char* dst, int dst_row_bytes, int width, int height,
+                        unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    if (a == 0) return;
+    for (int j = 0; j < height; ++j) {
+        fill_row_generic(dst, width, r, g, b, a);
+        dst += dst_row_bytes;
+    }
+}
+
+#if defined(BLEND_SSE2)
+
+// SSE2 works on four pixels at a time, widened to two registers of
+// 16-bit lanes.  The fourth byte of each pixel gets alpha 0, which
+// leaves it unchanged.
+
+static inline __m128i div255_epu16(__m128i x) {
+    __m128i t = _mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8));
+    return _mm_srli_epi16(t, 8);
+}
+
+// (d * (255 - alpha) + color * alpha) / 255 in each 16-bit lane.
+static inline __m128i blend_half(__m128i d, __m128i alpha16, __m128i color16) {
+    __m128i inv = _mm_sub_epi16(_mm_set1_epi16(255), alpha16);
+    return div255_epu16(_mm_add_epi16(_mm_mullo_epi16(d, inv),
+                                      _mm_mullo_epi16(color16, alpha16)));
+}
+
+static void mask_row(const unsigned char* sx, unsigned char* px, int width,
+                     unsigned char r, unsigned char g, unsigned char b, unsigned char ca) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i channels = _mm_set1_epi32(0x00ffffff);
+    const __m128i color8 = _mm_set1_epi32(r | (g << 8) | (b << 16));
+    const __m128i color16 = _mm_unpacklo_epi8(color8, zero);
+    const __m128i scale = _mm_set1_epi16(ca);
+
+    int i = 0;
+    for (; i + 4 <= width; i += 4, sx += 4, px += 16) {
+        uint32_t m;
+        memcpy(&m, sx, 4);
+        if (m == 0) continue;
+
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(px));
+        if (m == 0xffffffff && ca == 255) {
+            d = _mm_or_si128(_mm_andnot_si128(channels, d), color8);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(px), d);
+            continue;
+        }
+
+        // Spread each mask byte over its pixel's three color channels.
+        __m128i alpha = _mm_cvtsi32_si128(static_cast<int>(m));
+        alpha = _mm_unpacklo_epi8(alpha, alpha);
+        alpha = _mm_unpacklo_epi16(alpha, alpha);
+        alpha = _mm_and_si128(alpha, channels);
+
+        __m128i alpha_lo = _mm_unpacklo_epi8(alpha, zero);
+        __m128i alpha_hi = _mm_unpackhi_epi8(alpha, zero);
+        if (ca < 255) {
+            alpha_lo = div255_epu16(_mm_mullo_epi16(alpha_lo, scale));
+            alpha_hi = div255_epu16(_mm_mullo_epi16(alpha_hi, scale));
+        }
+
+        __m128i lo = blend_half(_mm_unpacklo_epi8(d, zero), alpha_lo, color16);
+        __m128i hi = blend_half(_mm_unpackhi_epi8(d, zero), alpha_hi, color16);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(px), _mm_packus_epi16(lo, hi));
+    }
+    mask_row_generic(sx, px, width - i, r, g, b, ca);
+}
+
+static void fill_row(unsigned char* px, int width,
+                     unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i channels = _mm_set1_epi32(0x00ffffff);
+    const __m128i color8 = _mm_set1_epi32(r | (g << 8) | (b << 16));
+
+    int i = 0;
+    if (a == 255) {
+        for (; i + 4 <= width; i += 4, px += 16) {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(px));
+            d = _mm_or_si128(_mm_andnot_si128(channels, d), color8);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(px), d);
+        }
+    } else {
+        const __m128i alpha16 = _mm_unpacklo_epi8(
+            _mm_and_si128(_mm_set1_epi8(static_cast<char>(a)), channels), zero);
+        const __m128i color16 = _mm_unpacklo_epi8(color8, zero);
+        for (; i + 4 <= width; i += 4, px += 16) {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(px));
+            __m128i lo = blend_half(_mm_unpacklo_epi8(d, zero), alpha16, color16);
+            __m128i hi = blend_half(_mm_unpackhi_epi8(d, zero), alpha16, color16);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(px), _mm_packus_epi16(lo, hi));
+        }
+    }
+    fill_row_generic(px, width - i, r, g, b, a);
+}
+
+#elif defined(BLEND_NEON)
+
+// NEON works on eight pixels at a time, split into channel planes by
+// vld4; the fourth plane is stored back as it was loaded.
+
+static inline uint8x8_t div255_u16(uint16x8_t x) {
+    uint16x8_t t = vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8));
+    return vshrn_n_u16(t, 8);
+}
+
+static inline uint8x8_t blend_plane(uint8x8_t d, uint8x8_t alpha, uint8x8_t inv, uint8x8_t c) {
+    return div255_u16(vmlal_u8(vmull_u8(d, inv), c, alpha));
+}
+
+static void mask_row(const unsigned char* sx, unsigned char* px, int width,
+                     unsigned char r, unsigned char g, unsigned char b, unsigned char ca) {
+    const uint8x8_t vr = vdup_n_u8(r);
+    const uint8x8_t vg = vdup_n_u8(g);
+    const uint8x8_t vb = vdup_n_u8(b);
+    const uint8x8_t scale = vdup_n_u8(ca);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8, sx += 8, px += 32) {
+        uint64_t m;
+        memcpy(&m, sx, 8);
+        if (m == 0) continue;
+
+        uint8x8x4_t d = vld4_u8(px);
+        if (m == ~0ULL && ca == 255) {
+            d.val[0] = vr;
+            d.val[1] = vg;
+            d.val[2] = vb;
+        } else {
+            uint8x8_t alpha = vld1_u8(sx);
+            if (ca < 255) alpha = div255_u16(vmull_u8(alpha, scale));
+            uint8x8_t inv = vsub_u8(vdup_n_u8(255), alpha);
+            d.val[0] = blend_plane(d.val[0], alpha, inv, vr);
+            d.val[1] = blend_plane(d.val[1], alpha, inv, vg);
+            d.val[2] = blend_plane(d.val[2], alpha, inv, vb);
+        }
+        vst4_u8(px, d);
+    }
+    mask_row_generic(sx, px, width - i, r, g, b, ca);
+}
+
+static void fill_row(unsigned char* px, int width,
+                     unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    const uint8x8_t vr = vdup_n_u8(r);
+    const uint8x8_t vg = vdup_n_u8(g);
+    const uint8x8_t vb = vdup_n_u8(b);
+    const uint8x8_t alpha = vdup_n_u8(a);
+    const uint8x8_t inv = vdup_n_u8(255 - a);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8, px += 32) {
+        uint8x8x4_t d = vld4_u8(px);
+        if (a == 255) {
+            d.val[0] = vr;
+            d.val[1] = vg;
+            d.val[2] = vb;
+        } else {
+            d.val[0] = blend_plane(d.val[0], alpha, inv, vr);
+            d.val[1] = blend_plane(d.val[1], alpha, inv, vg);
+            d.val[2] = blend_plane(d.val[2], alpha, inv, vb);
+        }
+        vst4_u8(px, d);
+    }
+    fill_row_generic(px, width - i, r, g, b, a);
+}
+
+#else
+
+static void mask_row(const unsigned char* sx, unsigned char* px, int width,
+                     unsigned char r, unsigned char g, unsigned char b, unsigned char ca) {
+    mask_row_generic(sx, px, width, r, g, b, ca);
+}
+
+static void fill_row(unsigned char* px, int width,
+                     unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    fill_row_generic(px, width, r, g, b, a);
+}
+
+#endif
+
+void blend_mask(const unsigned char* src, int src_row_bytes,
+                unsigned char* dst, int dst_row_bytes, int width, int height,
+                unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    if (a == 0) return;
+    for (int j = 0; j < height; ++j) {
+        mask_row(src, dst, width, r, g, b, a);
+        src += src_row_bytes;
+        dst += dst_row_bytes;
+    }
+}
+
+void blend_mask_row(const unsigned char* src, unsigned char* dst, int width,
+                    unsigned char r, unsigned char g, unsigned char b) {
+    mask_row(src, dst, width, r, g, b, 255);
+}
+
+void blend_fill(unsigned char* dst, int dst_row_bytes, int width, int height,
+                unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    if (a == 0) return;
+    for (int j = 0; j < height; ++j) {
+        fill_row(dst, width, r, g, b, a);
+        dst += dst_row_bytes;
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_BLEND_H_
+#define _MINUI_BLEND_H_
+
+// Pixel kernels behind gr_text(), gr_texticon(), gr_fill() and
+// gr_clear().  Destination pixels are 4 bytes; the first three are the
+// color channels (in whatever order gr_color() stored r, g and b) and
+// the fourth is never touched.  Blending rounds down, as in
+// (dst * (255 - a) + color * a) / 255.
+//
+// The plain entry points use SSE2 or NEON when the target has them;
+// the *_generic versions are the portable per-pixel code they must
+// match byte for byte.
+
+// x / 255, rounded down, for 0 <= x <= 255 * 255.  This is what every
+// kernel uses instead of a division, so they all agree exactly.
+static inline unsigned int div255(unsigned int x) {
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+// Blends 'color' into 'dst' through the 8-bit alpha mask 'src', with
+// each mask value first scaled by 'a'.
+void blend_mask(const unsigned char* src, int src_row_bytes,
+                unsigned char* dst, int dst_row_bytes, int width, int height,
+                unsigned char r, unsigned char g, unsigned char b, unsigned char a);
+
+// One row of blend_mask() with a == 255, for masks that have already
+// been scaled.
+void blend_mask_row(const unsigned char* src, unsigned char* dst, int width,
+                    unsigned char r, unsigned char g, unsigned char b);
+
+// Blends 'color' into every pixel of 'dst' with constant alpha 'a'.
+// a == 255 simply stores the color.
+void blend_fill(unsigned char* dst, int dst_row_bytes, int width, int height,
+                unsigned char r, unsigned char g, unsigned char b, unsigned char a);
+
+void blend_mask_generic(const unsigned char* src, int src_row_bytes,
+                        unsigned char* dst, int dst_row_bytes, int width, int height,
+                        unsigned char r, unsigned char g, unsigned char b, unsigned char a);
+void blend_fill_generic(unsigned char* dst, int dst_row_bytes, int width, int height,
+                        unsigned char r, unsigned char g, unsigned char b, unsigned char a);
+
+#endif
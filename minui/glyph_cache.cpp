@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "glyph_cache.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "blend.h"
+
+// The part of one row of a glyph between 'x' and 'x + width' that isn't
+// transparent; its alpha values start at 'offset' in the glyph's
+// 'alphas'.
+struct GlyphSpan {
+    uint16_t y;
+    uint16_t x;
+    uint16_t width;
+    uint32_t offset;
+};
+
+// Transparent stretches at least this long split a row into two spans;
+// shorter ones cost less to blend through than to skip.
+static const int kSpanGap = 8;
+
+struct Glyph {
+    bool built = false;
+    std::vector<GlyphSpan> spans;
+    std::vector<unsigned char> alphas;
+};
+
+// The glyphs for every character of one font, weight and alpha.
+struct GlyphSet {
+    const GRFont* font;
+    const unsigned char* texture_data;
+    bool bold;
+    unsigned char alpha;
+    size_t bytes;
+    Glyph glyphs['~' - ' ' + 1];
+};
+
+// Most recently used first.
+static std::vector<std::unique_ptr<GlyphSet>> glyph_sets;
+static size_t glyph_sets_bytes = 0;
+
+static GlyphSet* find_glyph_set(const GRFont* font, bool bold, unsigned char alpha) {
+    for (auto it = glyph_sets.begin(); it != glyph_sets.end(); ++it) {
+        const GlyphSet& set = **it;
+        if (set.font == font && set.texture_data == font->texture->data &&
+            set.bold == bold && set.alpha == alpha) {
+            std::rotate(glyph_sets.begin(), it, it + 1);
+            return glyph_sets.front().get();
+        }
+    }
+
+    std::unique_ptr<GlyphSet> set(new GlyphSet);
+    set->font = font;
+    set->texture_data = font->texture->data;
+    set->bold = bold;
+    set->alpha = alpha;
+    set->bytes = sizeof(GlyphSet);
+    glyph_sets_bytes += set->bytes;
+    glyph_sets.insert(glyph_sets.begin(), std::move(set));
+    return glyph_sets.front().get();
+}
+
+static void build_glyph(const GRFont* font, int index, bool bold, unsigned char ca,
+                        Glyph* glyph) {
+    const GRSurface* texture = font->texture;
+    const unsigned char* src = texture->data + index * font->char_width +
+                               (bold ? font->char_height * texture->row_bytes : 0);
+    int width = font->char_width;
+    std::vector<unsigned char> row(width);
+
+    for (int y = 0; y < font->char_height; ++y, src += texture->row_bytes) {
+        for (int x = 0; x < width; ++x) {
+            row[x] = (ca < 255) ? div255(src[x] * ca) : src[x];
+        }
+
+        int x = 0;
+        while (true) {
+            while (x < width && row[x] == 0) ++x;
+            if (x == width) break;
+
+            int start = x;
+            int end = ++x;
+            for (; x < width && x - end < kSpanGap; ++x) {
+                if (row[x] != 0) end = x + 1;
+            }
+            glyph->spans.push_back(GlyphSpan{ static_cast<uint16_t>(y),
+                                              static_cast<uint16_t>(start),
+                                              static_cast<uint16_t>(end - start),
+                                              static_cast<uint32_t>(glyph->alphas.size()) });
+            glyph->alphas.insert(glyph->alphas.end(), &row[start], &row[end]);
+            x = end;
+        }
+    }
+
+    glyph->spans.shrink_to_fit();
+    glyph->alphas.shrink_to_fit();
+    glyph->built = true;
+}
+
+static size_t glyph_bytes(const Glyph& glyph) {
+    return glyph.spans.capacity() * sizeof(GlyphSpan) + glyph.alphas.capacity();
+}
+
+static void draw_glyph(const Glyph& glyph, unsigned char* dst, int dst_row_bytes,
+                       unsigned char r, unsigned char g, unsigned char b) {
+    for (const GlyphSpan& span : glyph.spans) {
+        blend_mask_row(&glyph.alphas[span.offset], dst + span.y * dst_row_bytes + span.x * 4,
+                       span.width, r, g, b);
+    }
+}
+
+void glyph_cache_text(const GRFont* font, const char* s, int count, bool bold,
+                      unsigned char* dst, int dst_row_bytes,
+                      unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    if (a == 0 || count <= 0) return;
+
+    // Spans store positions in 16 bits; no real font comes anywhere near
+    // that.
+    if (font->char_width > 0xffff || font->char_height > 0xffff) {
+        for (int i = 0; i < count; ++i) {
+            unsigned char ch = s[i];
+            if (ch < ' ' || ch > '~') ch = '?';
+            blend_mask(font->texture->data + (ch - ' ') * font->char_width +
+                       (bold ? font->char_height * font->texture->row_bytes : 0),
+                       font->texture->row_bytes, dst + i * font->char_width * 4, dst_row_bytes,
+                       font->char_width, font->char_height, r, g, b, a);
+        }
+        return;
+    }
+
+    GlyphSet* set = find_glyph_set(font, bold, a);
+    for (int i = 0; i < count; ++i) {
+        unsigned char ch = s[i];
+        if (ch < ' ' || ch > '~') ch = '?';
+        Glyph& glyph = set->glyphs[ch - ' '];
+        if (!glyph.built) {
+            build_glyph(font, ch - ' ', bold, a, &glyph);
+            set->bytes += glyph_bytes(glyph);
+            glyph_sets_bytes += glyph_bytes(glyph);
+        }
+        draw_glyph(glyph, dst + i * font->char_width * 4, dst_row_bytes, r, g, b);
+    }
+
+    while (glyph_sets_bytes > kGlyphCacheBytes && glyph_sets.size() > 1) {
+        glyph_sets_bytes -= glyph_sets.back()->bytes;
+        glyph_sets.pop_back();
+    }
+}
+
+size_t glyph_cache_bytes() {
+    return glyph_sets_bytes;
+}
+
+void glyph_cache_clear() {
+    glyph_sets.clear();
+    glyph_sets_bytes = 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_GLYPH_CACHE_H_
+#define _MINUI_GLYPH_CACHE_H_
+
+#include <stddef.h>
+
+#include "minui.h"
+
+// gr_text() draws through a cache of glyphs that have already been
+// prepared for blending: each row is cut down to the spans that aren't
+// transparent, and their alpha values are already scaled by the text
+// alpha.  A glyph depends on the font, the character, bold and the
+// alpha; the color is applied as it's drawn.  The results are byte for
+// byte what blend_mask() would produce.
+//
+// The cache holds at most kGlyphCacheBytes, plus whatever the glyph
+// set for the text being drawn needs; the sets used least recently are
+// dropped first.
+
+static const size_t kGlyphCacheBytes = 256 * 1024;
+
+// Draws the first 'count' characters of 's' side by side, starting at
+// the top left pixel 'dst' of a 4-byte-per-pixel surface.  Characters
+// outside ' ' to '~' are drawn as '?'.  'bold' picks the font's second
+// row of glyphs, which the caller has checked exists.
+void glyph_cache_text(const GRFont* font, const char* s, int count, bool bold,
+                      unsigned char* dst, int dst_row_bytes,
+                      unsigned char r, unsigned char g, unsigned char b, unsigned char a);
+
+// How much memory the cached glyphs are using.
+size_t glyph_cache_bytes();
+
+// Drops every cached glyph.  Needed before a font is freed.
+void glyph_cache_clear();
+
+#endif
@@ -31,7 +31,11 @@
 
 #include <time.h>
 
+#include <algorithm>
+
+#include "blend.h"
 #include "font_10x18.h"
+#include "glyph_cache.h"
 #include "minui.h"
 #include "graphics.h"
 
@@ -54,6 +58,129 @@ static bool outside(int x, int y)
     return x < 0 || x >= gr_draw->width || y < 0 || y >= gr_draw->height;
 }
 
+// Damage tracking.
+//
+// Display buffers are often write-combined device memory, which is slow
+// to read back, so nothing draws into them directly: gr_draw is a copy of
+// the screen in system RAM, and every drawing call adds the area it
+// touched to gr_damage.  The backend may hand out any of several buffers
+// to be displayed next, so gr_flip() remembers the damage of the last few
+// frames and which frame each buffer last displayed, and passes the
+// backend the parts of gr_draw that its next buffer is missing.
+
+static constexpr int kMaxDamageRects = 8;
+static constexpr unsigned int kDamageHistory = 4;
+
+struct GRDamage {
+    int count;
+    GRRect rects[kMaxDamageRects];
+};
+
+static GRDamage gr_damage;                          // changes to gr_draw this frame
+static GRDamage gr_damage_history[kDamageHistory];  // by frame % kDamageHistory
+static unsigned int gr_frame = 0;                   // frames displayed so far
+
+// The frame each buffer the backend has handed out last displayed.
+static struct {
+    GRSurface* surface;
+    unsigned int frame;
+} gr_surface_frames[kDamageHistory];
+
+static GRSurface* gr_target = NULL;  // the backend's buffer to display next
+
+static bool contains(const GRRect& outer, const GRRect& inner) {
+    return inner.x >= outer.x && inner.x + inner.w <= outer.x + outer.w &&
+           inner.y >= outer.y && inner.y + inner.h <= outer.y + outer.h;
+}
+
+static void damage_add(GRDamage* damage, int x, int y, int w, int h) {
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > gr_draw->width) w = gr_draw->width - x;
+    if (y + h > gr_draw->height) h = gr_draw->height - y;
+    if (w <= 0 || h <= 0) return;
+
+    GRRect r = { x, y, w, h };
+    for (int i = 0; i < damage->count; ++i) {
+        if (contains(damage->rects[i], r)) return;
+    }
+    if (damage->count == kMaxDamageRects) {
+        // Out of room; fall back to the bounding box.
+        int x1 = r.x, y1 = r.y, x2 = r.x + r.w, y2 = r.y + r.h;
+        for (int i = 0; i < damage->count; ++i) {
+            const GRRect& d = damage->rects[i];
+            if (d.x < x1) x1 = d.x;
+            if (d.y < y1) y1 = d.y;
+            if (d.x + d.w > x2) x2 = d.x + d.w;
+            if (d.y + d.h > y2) y2 = d.y + d.h;
+        }
+        r = { x1, y1, x2 - x1, y2 - y1 };
+        damage->count = 0;
+    }
+    damage->rects[damage->count++] = r;
+}
+
+static void damage_add_all(GRDamage* damage) {
+    damage->count = 0;
+    damage_add(damage, 0, 0, gr_draw->width, gr_draw->height);
+}
+
+// Works out where gr_target differs from gr_draw: this frame's damage,
+// plus that of the frames displayed since gr_target last was.
+static void target_damage(GRDamage* missing) {
+    *missing = gr_damage;
+    for (size_t i = 0; i < kDamageHistory; ++i) {
+        if (gr_surface_frames[i].surface == gr_target) {
+            unsigned int frame = gr_surface_frames[i].frame;
+            if (gr_frame - frame > kDamageHistory) break;
+            while (++frame <= gr_frame) {
+                const GRDamage& damage = gr_damage_history[frame % kDamageHistory];
+                for (int j = 0; j < damage.count; ++j) {
+                    const GRRect& r = damage.rects[j];
+                    damage_add(missing, r.x, r.y, r.w, r.h);
+                }
+            }
+            return;
+        }
+    }
+    // A buffer we haven't seen (or not for too long): copy all of it.
+    damage_add_all(missing);
+}
+
+// Called after a flip, to remember what 'displayed' holds.
+static void record_frame(GRSurface* displayed) {
+    gr_damage_history[gr_frame % kDamageHistory] = gr_damage;
+    gr_damage.count = 0;
+
+    // Take over the slot of the buffer that has been idle the longest.
+    size_t slot = 0;
+    for (size_t i = 0; i < kDamageHistory; ++i) {
+        if (gr_surface_frames[i].surface == displayed) {
+            slot = i;
+            break;
+        }
+        if (gr_surface_frames[i].frame < gr_surface_frames[slot].frame) slot = i;
+    }
+    gr_surface_frames[slot].surface = displayed;
+    gr_surface_frames[slot].frame = gr_frame;
+}
+
+size_t gr_copy_damage(const GRSurface* source, GRSurface* dest,
+                      const GRRect* damage, int count) {
+    size_t bytes = 0;
+    for (int i = 0; i < count; ++i) {
+        const GRRect& r = damage[i];
+        size_t offset = r.x * source->pixel_bytes;
+        size_t length = r.w * source->pixel_bytes;
+        for (int y = r.y; y < r.y + r.h; ++y) {
+            memcpy(dest->data + y * dest->row_bytes + offset,
+                   source->data + y * source->row_bytes + offset, length);
+        }
+        bytes += r.h * length;
+    }
+    return bytes;
+}
+
 const GRFont* gr_sys_font()
 {
     return gr_font;
@@ -74,61 +201,30 @@ static void text_blend(unsigned char* src_p, int src_row_bytes,
                        unsigned char* dst_p, int dst_row_bytes,
                        int width, int height)
 {
-    for (int j = 0; j < height; ++j) {
-        unsigned char* sx = src_p;
-        unsigned char* px = dst_p;
-        for (int i = 0; i < width; ++i) {
-            unsigned char a = *sx++;
-            if (gr_current_a < 255) a = ((int)a * gr_current_a) / 255;
-            if (a == 255) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            } else if (a > 0) {
-                *px = (*px * (255-a) + gr_current_r * a) / 255;
-                ++px;
-                *px = (*px * (255-a) + gr_current_g * a) / 255;
-                ++px;
-                *px = (*px * (255-a) + gr_current_b * a) / 255;
-                ++px;
-                ++px;
-            } else {
-                px += 4;
-            }
-        }
-        src_p += src_row_bytes;
-        dst_p += dst_row_bytes;
-    }
+    blend_mask(src_p, src_row_bytes, dst_p, dst_row_bytes, width, height,
+               gr_current_r, gr_current_g, gr_current_b, gr_current_a);
 }
 
 void gr_text(const GRFont* font, int x, int y, const char *s, bool bold)
 {
-    if (!font->texture || gr_current_a == 0) return;
+    if (!font->texture || font->char_width <= 0 || gr_current_a == 0) return;
 
     bold = bold && (font->texture->height != font->char_height);
 
     x += overscan_offset_x;
     y += overscan_offset_y;
 
-    unsigned char ch;
-    while ((ch = *s++)) {
-        if (outside(x, y) || outside(x+font->char_width-1, y+font->char_height-1)) break;
+    // Draw as many whole characters as fit.
+    if (outside(x, y) || outside(x, y+font->char_height-1)) return;
+    int count = std::min<size_t>(strlen(s), (gr_draw->width - x) / font->char_width);
+    if (count == 0) return;
 
-        if (ch < ' ' || ch > '~') {
-            ch = '?';
-        }
-
-        unsigned char* src_p = font->texture->data + ((ch - ' ') * font->char_width) +
-                               (bold ? font->char_height * font->texture->row_bytes : 0);
-        unsigned char* dst_p = gr_draw->data + y*gr_draw->row_bytes + x*gr_draw->pixel_bytes;
+    damage_add(&gr_damage, x, y, count * font->char_width, font->char_height);
 
-        text_blend(src_p, font->texture->row_bytes,
-                   dst_p, gr_draw->row_bytes,
-                   font->char_width, font->char_height);
-
-        x += font->char_width;
-    }
+    glyph_cache_text(font, s, count, bold,
+                     gr_draw->data + y*gr_draw->row_bytes + x*gr_draw->pixel_bytes,
+                     gr_draw->row_bytes,
+                     gr_current_r, gr_current_g, gr_current_b, gr_current_a);
 }
 
 void gr_texticon(int x, int y, GRSurface* icon) {
@@ -144,6 +240,8 @@ void gr_texticon(int x, int y, GRSurface* icon) {
 
     if (outside(x, y) || outside(x+icon->width-1, y+icon->height-1)) return;
 
+    damage_add(&gr_damage, x, y, icon->width, icon->height);
+
     unsigned char* src_p = icon->data;
     unsigned char* dst_p = gr_draw->data + y*gr_draw->row_bytes + x*gr_draw->pixel_bytes;
 
@@ -169,19 +267,13 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
 
 void gr_clear()
 {
+    damage_add_all(&gr_damage);
+
     if (gr_current_r == gr_current_g && gr_current_r == gr_current_b) {
         memset(gr_draw->data, gr_current_r, gr_draw->height * gr_draw->row_bytes);
     } else {
-        unsigned char* px = gr_draw->data;
-        for (int y = 0; y < gr_draw->height; ++y) {
-            for (int x = 0; x < gr_draw->width; ++x) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            }
-            px += gr_draw->row_bytes - (gr_draw->width * gr_draw->pixel_bytes);
-        }
+        blend_fill(gr_draw->data, gr_draw->row_bytes, gr_draw->width, gr_draw->height,
+                   gr_current_r, gr_current_g, gr_current_b, 255);
     }
 }
 
@@ -195,35 +287,11 @@ void gr_fill(int x1, int y1, int x2, int y2)
 
     if (outside(x1, y1) || outside(x2-1, y2-1)) return;
 
+    damage_add(&gr_damage, x1, y1, x2 - x1, y2 - y1);
+
     unsigned char* p = gr_draw->data + y1 * gr_draw->row_bytes + x1 * gr_draw->pixel_bytes;
-    if (gr_current_a == 255) {
-        int x, y;
-        for (y = y1; y < y2; ++y) {
-            unsigned char* px = p;
-            for (x = x1; x < x2; ++x) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            }
-            p += gr_draw->row_bytes;
-        }
-    } else if (gr_current_a > 0) {
-        int x, y;
-        for (y = y1; y < y2; ++y) {
-            unsigned char* px = p;
-            for (x = x1; x < x2; ++x) {
-                *px = (*px * (255-gr_current_a) + gr_current_r * gr_current_a) / 255;
-                ++px;
-                *px = (*px * (255-gr_current_a) + gr_current_g * gr_current_a) / 255;
-                ++px;
-                *px = (*px * (255-gr_current_a) + gr_current_b * gr_current_a) / 255;
-                ++px;
-                ++px;
-            }
-            p += gr_draw->row_bytes;
-        }
-    }
+    blend_fill(p, gr_draw->row_bytes, x2 - x1, y2 - y1,
+               gr_current_r, gr_current_g, gr_current_b, gr_current_a);
 }
 
 void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy) {
@@ -239,6 +307,8 @@ void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy) {
 
     if (outside(dx, dy) || outside(dx+w-1, dy+h-1)) return;
 
+    damage_add(&gr_damage, dx, dy, w, h);
+
     unsigned char* src_p = source->data + sy*source->row_bytes + sx*source->pixel_bytes;
     unsigned char* dst_p = gr_draw->data + dy*gr_draw->row_bytes + dx*gr_draw->pixel_bytes;
 
@@ -250,6 +320,30 @@ void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy) {
     }
 }
 
+void gr_scroll(int x, int y, int w, int h, int dy) {
+    x += overscan_offset_x;
+    y += overscan_offset_y;
+
+    if (outside(x, y) || outside(x+w-1, y+h-1)) return;
+    if (dy <= -h || dy >= h) return;
+
+    damage_add(&gr_damage, x, y, w, h);
+
+    size_t length = w * gr_draw->pixel_bytes;
+    unsigned char* p = gr_draw->data + y*gr_draw->row_bytes + x*gr_draw->pixel_bytes;
+    if (dy < 0) {
+        // Moving up: copy from the top down, so no row is overwritten
+        // before it has been moved.
+        for (int row = 0; row < h + dy; ++row) {
+            memcpy(p + row * gr_draw->row_bytes, p + (row - dy) * gr_draw->row_bytes, length);
+        }
+    } else {
+        for (int row = h - 1; row >= dy; --row) {
+            memcpy(p + row * gr_draw->row_bytes, p + (row - dy) * gr_draw->row_bytes, length);
+        }
+    }
+}
+
 unsigned int gr_get_width(GRSurface* surface) {
     if (surface == NULL) {
         return 0;
@@ -356,7 +450,7 @@ static void gr_test() {
         gr_color(0, 0, 255, 128);
         gr_fill(gr_draw->width - 200 - x, 300, gr_draw->width - x, 500);
 
-        gr_draw = gr_backend->flip(gr_backend);
+        gr_flip();
     }
     printf("getting end time\n");
     time_t end = time(NULL);
@@ -369,34 +463,89 @@ static void gr_test() {
 #endif
 
 void gr_flip() {
-    gr_draw = gr_backend->flip(gr_backend);
+    GRDamage missing;
+    target_damage(&missing);
+    GRSurface* displayed = gr_target;
+    gr_target = gr_backend->flip_damage(gr_backend, gr_draw, missing.rects, missing.count);
+    ++gr_frame;
+    record_frame(displayed);
+}
+
+void frame_stats_add(GRFrameStats* stats, uint64_t* last_frame_us, uint64_t frame_us) {
+    if (stats->frames > 0 && frame_us > *last_frame_us) {
+        uint64_t interval = frame_us - *last_frame_us;
+        stats->last_interval_us = interval;
+        if (interval > stats->max_interval_us) stats->max_interval_us = interval;
+    }
+    ++stats->frames;
+    *last_frame_us = frame_us;
+}
+
+uint64_t frame_stats_now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+bool gr_frame_stats(GRFrameStats* stats) {
+    if (gr_backend == nullptr || gr_backend->frame_stats == nullptr) return false;
+    return gr_backend->frame_stats(gr_backend, stats);
 }
 
 int gr_init(void)
 {
     gr_init_font();
 
-    gr_backend = open_adf();
+    gr_target = NULL;
+    gr_frame = 0;
+    gr_damage.count = 0;
+    memset(gr_surface_frames, 0, sizeof(gr_surface_frames));
+
+    gr_backend = open_memory();
     if (gr_backend) {
-        gr_draw = gr_backend->init(gr_backend);
-        if (!gr_draw) {
-            gr_backend->exit(gr_backend);
+        gr_target = gr_backend->init(gr_backend);
+        if (gr_target == NULL) {
+            return -1;
+        }
+    }
+
+    if (!gr_target) {
+        gr_backend = open_adf();
+        if (gr_backend) {
+            gr_target = gr_backend->init(gr_backend);
+            if (!gr_target) {
+                gr_backend->exit(gr_backend);
+            }
         }
     }
 
-    if (!gr_draw) {
+    if (!gr_target) {
         gr_backend = open_drm();
-        gr_draw = gr_backend->init(gr_backend);
+        gr_target = gr_backend->init(gr_backend);
     }
 
-    if (!gr_draw) {
+    if (!gr_target) {
         gr_backend = open_fbdev();
-        gr_draw = gr_backend->init(gr_backend);
-        if (gr_draw == NULL) {
+        gr_target = gr_backend->init(gr_backend);
+        if (gr_target == NULL) {
             return -1;
         }
     }
 
+    gr_draw = static_cast<GRSurface*>(malloc(sizeof(GRSurface)));
+    gr_draw->width = gr_target->width;
+    gr_draw->height = gr_target->height;
+    gr_draw->pixel_bytes = gr_target->pixel_bytes;
+    gr_draw->row_bytes = gr_target->width * gr_target->pixel_bytes;
+    gr_draw->data = static_cast<unsigned char*>(calloc(gr_draw->height, gr_draw->row_bytes));
+    if (gr_draw->data == NULL) {
+        printf("failed to allocate the drawing surface\n");
+        free(gr_draw);
+        gr_draw = NULL;
+        gr_backend->exit(gr_backend);
+        return -1;
+    }
+
     overscan_offset_x = gr_draw->width * overscan_percent / 100;
     overscan_offset_y = gr_draw->height * overscan_percent / 100;
 
@@ -408,7 +557,12 @@ int gr_init(void)
 
 void gr_exit(void)
 {
+    glyph_cache_clear();
     gr_backend->exit(gr_backend);
+    gr_target = NULL;
+    free(gr_draw->data);
+    free(gr_draw);
+    gr_draw = NULL;
 }
 
 int gr_fb_width(void)
@@ -19,25 +19,51 @@
 
 #include "minui.h"
 
+// A rectangle of a GRSurface, in pixels.
+struct GRRect {
+    int x, y;
+    int w, h;
+};
+
 // TODO: lose the function pointers.
 struct minui_backend {
-    // Initializes the backend and returns a GRSurface* to draw into.
+    // Initializes the backend and returns the first buffer to display.
     GRSurface* (*init)(minui_backend*);
 
-    // Causes the current drawing surface (returned by the most recent
-    // call to flip() or init()) to be displayed, and returns a new
-    // drawing surface.
-    GRSurface* (*flip)(minui_backend*);
+    // Copies the 'damage' rectangles of 'source' into the current buffer
+    // (returned by the most recent call to flip_damage() or init()),
+    // causes it to be displayed, and returns the next buffer.  minui
+    // draws into 'source', a copy of the screen in system RAM, and works
+    // out what each buffer is missing, so backends never read from their
+    // buffers.
+    GRSurface* (*flip_damage)(minui_backend*, const GRSurface* source,
+                              const GRRect* damage, int count);
 
     // Blank (or unblank) the screen.
     void (*blank)(minui_backend*, bool);
 
     // Device cleanup when drawing is done.
     void (*exit)(minui_backend*);
+
+    // Optional.  Fills in the statistics for the frames displayed so far.
+    bool (*frame_stats)(minui_backend*, GRFrameStats* stats);
 };
 
+// Copies the 'damage' rectangles of 'source' into 'dest', which has the
+// same size and format, and returns the number of bytes copied.
+size_t gr_copy_damage(const GRSurface* source, GRSurface* dest,
+                      const GRRect* damage, int count);
+
+// For backends that keep GRFrameStats: counts a frame displayed at
+// 'frame_us' (in CLOCK_MONOTONIC microseconds), given when the previous
+// one was in '*last_frame_us'.
+void frame_stats_add(GRFrameStats* stats, uint64_t* last_frame_us, uint64_t frame_us);
+uint64_t frame_stats_now_us();
+
 minui_backend* open_fbdev();
 minui_backend* open_adf();
 minui_backend* open_drm();
+// Returns NULL unless gr_set_memory_backend() has been called.
+minui_backend* open_memory();
 
 #endif
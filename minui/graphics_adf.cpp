@@ -51,7 +51,8 @@ struct adf_pdata {
     adf_surface_pdata surfaces[2];
 };
 
-static GRSurface* adf_flip(minui_backend *backend);
+static GRSurface* adf_flip_damage(minui_backend *backend, const GRSurface *source,
+                                  const GRRect *damage, int count);
 static void adf_blank(minui_backend *backend, bool blank);
 
 static int adf_surface_init(adf_pdata *pdata, drm_mode_modeinfo *mode, adf_surface_pdata *surf) {
@@ -189,7 +190,9 @@ static GRSurface* adf_init(minui_backend *backend)
     if (pdata->intf_fd < 0)
         return NULL;
 
-    ret = adf_flip(backend);
+    // Post the first buffer as it is; minui fills in every buffer the
+    // first time it is handed one.
+    ret = adf_flip_damage(backend, NULL, NULL, 0);
 
     adf_blank(backend, true);
     adf_blank(backend, false);
@@ -214,11 +217,15 @@ static void adf_sync(adf_surface_pdata *surf)
     }
 }
 
-static GRSurface* adf_flip(minui_backend *backend)
+static GRSurface* adf_flip_damage(minui_backend *backend, const GRSurface *source,
+                                  const GRRect *damage, int count)
 {
     adf_pdata *pdata = (adf_pdata *)backend;
     adf_surface_pdata *surf = &pdata->surfaces[pdata->current_surface];
 
+    // adf_sync() has already made sure the display is done reading it.
+    gr_copy_damage(source, &surf->base, damage, count);
+
     int fence_fd = adf_interface_simple_post(pdata->intf_fd, pdata->eng_id,
             surf->base.width, surf->base.height, pdata->format, surf->fd,
             surf->offset, surf->pitch, -1);
@@ -266,7 +273,7 @@ minui_backend *open_adf()
     }
 
     pdata->base.init = adf_init;
-    pdata->base.flip = adf_flip;
+    pdata->base.flip_damage = adf_flip_damage;
     pdata->base.blank = adf_blank;
     pdata->base.exit = adf_exit;
     return &pdata->base;
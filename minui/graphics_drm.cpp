@@ -15,7 +15,9 @@
  */
 
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,8 +41,24 @@ struct drm_surface {
     uint32_t handle;
 };
 
-static drm_surface *drm_surfaces[2];
-static int current_buffer;
+// Flips are asynchronous: drm_flip_damage() queues one and gets a page
+// flip event once the display has switched to it.  With three buffers
+// there is always one free to copy into while another waits to be shown;
+// with two, drm_flip_damage() has to wait for the flip before handing
+// back the buffer that was on the screen.
+#define MAX_BUFFERS 3
+
+// How long to wait for a page flip event before giving up on it.
+#define FLIP_TIMEOUT_MS 1000
+
+static drm_surface *drm_surfaces[MAX_BUFFERS];
+static int num_buffers;
+static int current_buffer;    // being drawn
+static int displayed_buffer;  // on the screen
+static int pending_buffer;    // waiting for a flip, or -1
+
+static GRFrameStats frame_stats;
+static uint64_t last_frame_us;
 
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
@@ -73,12 +91,55 @@ static void drm_enable_crtc(int drm_fd, drmModeCrtc *crtc,
         printf("drmModeSetCrtc failed ret=%d\n", ret);
 }
 
+// 'data' is the surface drm_flip_damage() queued.
+static void page_flip_handler(int fd __unused, unsigned int sequence __unused,
+                              unsigned int tv_sec, unsigned int tv_usec,
+                              void *data) {
+    // An event for a flip that drm_wait_for_flip() already gave up on can
+    // still turn up later, possibly in the same read as the one for the
+    // flip queued since.  It says nothing about the pending buffer.
+    if (pending_buffer < 0 || data != drm_surfaces[pending_buffer])
+        return;
+
+    frame_stats_add(&frame_stats, &last_frame_us, tv_sec * 1000000ULL + tv_usec);
+
+    displayed_buffer = pending_buffer;
+    pending_buffer = -1;
+}
+
+// Waits for the flip drm_flip_damage() queued, if it hasn't happened yet.
+static void drm_wait_for_flip() {
+    if (pending_buffer < 0)
+        return;
+
+    drmEventContext ev_ctx;
+    memset(&ev_ctx, 0, sizeof(ev_ctx));
+    ev_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+    ev_ctx.page_flip_handler = page_flip_handler;
+
+    uint64_t start = frame_stats_now_us();
+    while (pending_buffer >= 0) {
+        struct pollfd pfd = { drm_fd, POLLIN, 0 };
+        int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, FLIP_TIMEOUT_MS));
+        if (ret <= 0) {
+            // Carry on as if it had happened rather than hang.
+            printf("page flip event didn't arrive (ret=%d)\n", ret);
+            displayed_buffer = pending_buffer;
+            pending_buffer = -1;
+            break;
+        }
+        drmHandleEvent(drm_fd, &ev_ctx);
+    }
+    frame_stats.wait_us += frame_stats_now_us() - start;
+}
+
 static void drm_blank(minui_backend* backend __unused, bool blank) {
+    drm_wait_for_flip();
     if (blank)
         drm_disable_crtc(drm_fd, main_monitor_crtc);
     else
         drm_enable_crtc(drm_fd, main_monitor_crtc,
-                        drm_surfaces[current_buffer]);
+                        drm_surfaces[displayed_buffer]);
 }
 
 static void drm_destroy_surface(struct drm_surface *surface) {
@@ -424,40 +485,82 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
 
     drmModeFreeResources(res);
 
-    drm_surfaces[0] = drm_create_surface(width, height);
-    drm_surfaces[1] = drm_create_surface(width, height);
-    if (!drm_surfaces[0] || !drm_surfaces[1]) {
+    // Two buffers are enough; the third is nice to have.
+    for (num_buffers = 0; num_buffers < MAX_BUFFERS; num_buffers++) {
+        drm_surfaces[num_buffers] = drm_create_surface(width, height);
+        if (!drm_surfaces[num_buffers])
+            break;
+    }
+    if (num_buffers < 2) {
         drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        drmModeFreeResources(res);
+        drm_surfaces[0] = NULL;
         close(drm_fd);
         return NULL;
     }
+    printf("drm: %d buffers\n", num_buffers);
 
     current_buffer = 0;
+    displayed_buffer = 1;
+    pending_buffer = -1;
+    memset(&frame_stats, 0, sizeof(frame_stats));
 
-    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
+    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[displayed_buffer]);
 
     return &(drm_surfaces[0]->base);
 }
 
-static GRSurface* drm_flip(minui_backend* backend __unused) {
+// Returns a buffer that is neither on the screen nor about to be, or -1.
+static int drm_free_buffer() {
+    for (int i = 0; i < num_buffers; i++) {
+        if (i != displayed_buffer && i != pending_buffer)
+            return i;
+    }
+    return -1;
+}
+
+static GRSurface* drm_flip_damage(minui_backend* backend __unused, const GRSurface* source,
+                                  const GRRect* damage, int count) {
     int ret;
 
+    // current_buffer is neither on the screen nor queued, so it can be
+    // brought up to date before waiting for the previous flip.
+    size_t bytes = gr_copy_damage(source, &drm_surfaces[current_buffer]->base, damage, count);
+    frame_stats.bytes_copied += bytes;
+    frame_stats.last_bytes_copied = bytes;
+
+    // Only one flip can be queued at a time.
+    drm_wait_for_flip();
+
     ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
-                          drm_surfaces[current_buffer]->fb_id, 0, NULL);
+                          drm_surfaces[current_buffer]->fb_id,
+                          DRM_MODE_PAGE_FLIP_EVENT, drm_surfaces[current_buffer]);
     if (ret < 0) {
         printf("drmModePageFlip failed ret=%d\n", ret);
         return NULL;
     }
-    current_buffer = 1 - current_buffer;
+    pending_buffer = current_buffer;
+
+    current_buffer = drm_free_buffer();
+    if (current_buffer < 0) {
+        drm_wait_for_flip();
+        current_buffer = drm_free_buffer();
+    }
     return &(drm_surfaces[current_buffer]->base);
 }
 
+static bool drm_frame_stats(minui_backend* backend __unused, GRFrameStats* stats) {
+    *stats = frame_stats;
+    return true;
+}
+
 static void drm_exit(minui_backend* backend __unused) {
+    drm_wait_for_flip();
     drm_disable_crtc(drm_fd, main_monitor_crtc);
-    drm_destroy_surface(drm_surfaces[0]);
-    drm_destroy_surface(drm_surfaces[1]);
+    for (int i = 0; i < num_buffers; i++) {
+        drm_destroy_surface(drm_surfaces[i]);
+        drm_surfaces[i] = NULL;
+    }
+    num_buffers = 0;
     drmModeFreeCrtc(main_monitor_crtc);
     drmModeFreeConnector(main_monitor_connector);
     close(drm_fd);
@@ -466,9 +569,10 @@ static void drm_exit(minui_backend* backend __unused) {
 
 static minui_backend drm_backend = {
     .init = drm_init,
-    .flip = drm_flip,
+    .flip_damage = drm_flip_damage,
     .blank = drm_blank,
     .exit = drm_exit,
+    .frame_stats = drm_frame_stats,
 };
 
 minui_backend* open_drm() {
@@ -34,23 +34,33 @@
 #include "graphics.h"
 
 static GRSurface* fbdev_init(minui_backend*);
-static GRSurface* fbdev_flip(minui_backend*);
+static GRSurface* fbdev_flip_damage(minui_backend*, const GRSurface*, const GRRect*, int);
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
+static bool fbdev_frame_stats(minui_backend*, GRFrameStats*);
 
-static GRSurface gr_framebuffer[2];
-static bool double_buffered;
-static GRSurface* gr_draw = NULL;
-static int displayed_buffer;
+// As many buffers as fit in the framebuffer memory, up to three, with
+// the display panned between them.  Flips hand back the buffer that was
+// displayed longest ago, so with three of them it isn't one that the
+// display may still be reading until the next vsync.
+#define MAX_BUFFERS 3
+
+static GRSurface gr_framebuffer[MAX_BUFFERS];
+static int num_buffers;
+static int draw_buffer;
+
+static GRFrameStats frame_stats;
+static uint64_t last_frame_us;
 
 static fb_var_screeninfo vi;
 static int fb_fd = -1;
 
 static minui_backend my_backend = {
     .init = fbdev_init,
-    .flip = fbdev_flip,
+    .flip_damage = fbdev_flip_damage,
     .blank = fbdev_blank,
     .exit = fbdev_exit,
+    .frame_stats = fbdev_frame_stats,
 };
 
 minui_backend* open_fbdev() {
@@ -66,17 +76,44 @@ static void fbdev_blank(minui_backend* backend __unused, bool blank)
         perror("ioctl(): blank");
 }
 
-static void set_displayed_framebuffer(unsigned n)
+static void set_displayed_framebuffer(int n)
 {
-    if (n > 1 || !double_buffered) return;
+    if (n >= num_buffers || num_buffers == 1) return;
 
-    vi.yres_virtual = gr_framebuffer[0].height * 2;
     vi.yoffset = n * gr_framebuffer[0].height;
-    vi.bits_per_pixel = gr_framebuffer[0].pixel_bytes * 8;
-    if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
-        perror("active fb swap failed");
+    uint64_t start = frame_stats_now_us();
+    if (ioctl(fb_fd, FBIOPAN_DISPLAY, &vi) < 0) {
+        // Some drivers only move the display on FBIOPUT_VSCREENINFO.
+        if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
+            perror("active fb swap failed");
+        }
     }
-    displayed_buffer = n;
+    uint64_t end = frame_stats_now_us();
+    frame_stats.wait_us += end - start;
+    frame_stats_add(&frame_stats, &last_frame_us, end);
+}
+
+// Makes the virtual screen tall enough for 'buffers' buffers, and returns
+// how many the driver agreed to.  If it won't take more than one, the
+// screen is put back the way it was.
+static int set_virtual_height(int fd, int buffers) {
+    fb_var_screeninfo original = vi;
+    for (; buffers > 1; buffers--) {
+        vi = original;
+        vi.yres_virtual = vi.yres * buffers;
+        vi.yoffset = 0;
+        vi.bits_per_pixel = gr_framebuffer[0].pixel_bytes * 8;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) == 0 &&
+            ioctl(fd, FBIOGET_VSCREENINFO, &vi) == 0 &&
+            vi.yres_virtual >= vi.yres * buffers) {
+            return buffers;
+        }
+    }
+    vi = original;
+    if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
+        perror("failed to restore fb0 info");
+    }
+    return 1;
 }
 
 static GRSurface* fbdev_init(minui_backend* backend) {
@@ -136,66 +173,58 @@ static GRSurface* fbdev_init(minui_backend* backend) {
     gr_framebuffer[0].data = static_cast<uint8_t*>(bits);
     memset(gr_framebuffer[0].data, 0, gr_framebuffer[0].height * gr_framebuffer[0].row_bytes);
 
-    /* check if we can use double buffering */
-    if (vi.yres * fi.line_length * 2 <= fi.smem_len) {
-        double_buffered = true;
-
-        memcpy(gr_framebuffer+1, gr_framebuffer, sizeof(GRSurface));
-        gr_framebuffer[1].data = gr_framebuffer[0].data +
-            gr_framebuffer[0].height * gr_framebuffer[0].row_bytes;
-
-        gr_draw = gr_framebuffer+1;
-
-    } else {
-        double_buffered = false;
-
-        // Without double-buffering, we allocate RAM for a buffer to
-        // draw in, and then "flipping" the buffer consists of a
-        // memcpy from the buffer we allocated to the framebuffer.
-
-        gr_draw = (GRSurface*) malloc(sizeof(GRSurface));
-        memcpy(gr_draw, gr_framebuffer, sizeof(GRSurface));
-        gr_draw->data = (unsigned char*) malloc(gr_draw->height * gr_draw->row_bytes);
-        if (!gr_draw->data) {
-            perror("failed to allocate in-memory surface");
-            return NULL;
-        }
+    /* check if we can use double (or triple) buffering */
+    num_buffers = fi.smem_len / (vi.yres * fi.line_length);
+    if (num_buffers > MAX_BUFFERS) num_buffers = MAX_BUFFERS;
+    if (num_buffers > 1) num_buffers = set_virtual_height(fd, num_buffers);
+    if (num_buffers < 1) num_buffers = 1;
+
+    // With a single buffer, each flip copies straight into the one on the
+    // screen.
+    for (int i = 1; i < num_buffers; ++i) {
+        memcpy(gr_framebuffer+i, gr_framebuffer, sizeof(GRSurface));
+        gr_framebuffer[i].data = gr_framebuffer[0].data +
+            i * gr_framebuffer[0].height * gr_framebuffer[0].row_bytes;
     }
+    draw_buffer = (num_buffers > 1) ? 1 : 0;
 
-    memset(gr_draw->data, 0, gr_draw->height * gr_draw->row_bytes);
     fb_fd = fd;
     set_displayed_framebuffer(0);
+    // That wasn't a frame.
+    memset(&frame_stats, 0, sizeof(frame_stats));
 
-    printf("framebuffer: %d (%d x %d)\n", fb_fd, gr_draw->width, gr_draw->height);
+    printf("framebuffer: %d (%d x %d), %d buffer(s)\n", fb_fd, gr_framebuffer[0].width,
+           gr_framebuffer[0].height, num_buffers);
 
     fbdev_blank(backend, true);
     fbdev_blank(backend, false);
 
-    return gr_draw;
+    return gr_framebuffer + draw_buffer;
 }
 
-static GRSurface* fbdev_flip(minui_backend* backend __unused) {
-    if (double_buffered) {
-        // Change gr_draw to point to the buffer currently displayed,
-        // then flip the driver so we're displaying the other buffer
-        // instead.
-        gr_draw = gr_framebuffer + displayed_buffer;
-        set_displayed_framebuffer(1-displayed_buffer);
+static GRSurface* fbdev_flip_damage(minui_backend* backend __unused, const GRSurface* source,
+                                    const GRRect* damage, int count) {
+    size_t bytes = gr_copy_damage(source, gr_framebuffer + draw_buffer, damage, count);
+    frame_stats.bytes_copied += bytes;
+    frame_stats.last_bytes_copied = bytes;
+
+    if (num_buffers > 1) {
+        // Display the buffer just drawn, and draw into the one that has
+        // been displayed longest ago next.
+        set_displayed_framebuffer(draw_buffer);
+        draw_buffer = (draw_buffer + 1) % num_buffers;
     } else {
-        // Copy from the in-memory surface to the framebuffer.
-        memcpy(gr_framebuffer[0].data, gr_draw->data,
-               gr_draw->height * gr_draw->row_bytes);
+        frame_stats_add(&frame_stats, &last_frame_us, frame_stats_now_us());
     }
-    return gr_draw;
+    return gr_framebuffer + draw_buffer;
+}
+
+static bool fbdev_frame_stats(minui_backend* backend __unused, GRFrameStats* stats) {
+    *stats = frame_stats;
+    return true;
 }
 
 static void fbdev_exit(minui_backend* backend __unused) {
     close(fb_fd);
     fb_fd = -1;
-
-    if (!double_buffered && gr_draw) {
-        free(gr_draw->data);
-        free(gr_draw);
-    }
-    gr_draw = NULL;
 }
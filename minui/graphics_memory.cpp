@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A backend that draws into malloc'd surfaces instead of a display, so
+// that the UI can be run and timed without one.  It behaves like a
+// display with the requested number of buffers: with one, flips copy the
+// drawing surface to the "screen" the way single-buffered fbdev does;
+// with more, flips rotate through the buffers the way ADF and DRM do.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/cdefs.h>
+
+#include "minui.h"
+#include "graphics.h"
+
+static const int kMaxBuffers = 3;
+
+static GRSurface* memory_init(minui_backend*);
+static GRSurface* memory_flip_damage(minui_backend*, const GRSurface*, const GRRect*, int);
+static void memory_blank(minui_backend*, bool);
+static void memory_exit(minui_backend*);
+static bool memory_frame_stats(minui_backend*, GRFrameStats*);
+
+static int requested_width;
+static int requested_height;
+static int requested_buffers;
+
+// Stands in for a display's buffers, so minui copies into them the same
+// way it would into device memory.
+static GRSurface surfaces[kMaxBuffers];
+static int num_buffers;
+static int draw_buffer;
+static int displayed_buffer;
+
+static GRFrameStats frame_stats;
+static uint64_t last_frame_us;
+
+static minui_backend my_backend = {
+    .init = memory_init,
+    .flip_damage = memory_flip_damage,
+    .blank = memory_blank,
+    .exit = memory_exit,
+    .frame_stats = memory_frame_stats,
+};
+
+void gr_set_memory_backend(int width, int height, int buffers) {
+    requested_width = width;
+    requested_height = height;
+    requested_buffers = buffers;
+}
+
+const GRSurface* gr_memory_displayed() {
+    if (num_buffers == 0) return NULL;
+    return &surfaces[displayed_buffer];
+}
+
+minui_backend* open_memory() {
+    if (requested_width <= 0 || requested_height <= 0) return NULL;
+    return &my_backend;
+}
+
+static GRSurface* memory_init(minui_backend* backend __unused) {
+    if (requested_buffers < 1 || requested_buffers > kMaxBuffers) {
+        fprintf(stderr, "memory backend: can't have %d buffers\n", requested_buffers);
+        return NULL;
+    }
+
+    num_buffers = requested_buffers;
+    for (int i = 0; i < num_buffers; ++i) {
+        surfaces[i].width = requested_width;
+        surfaces[i].height = requested_height;
+        surfaces[i].pixel_bytes = 4;
+        surfaces[i].row_bytes = requested_width * 4;
+        surfaces[i].data = static_cast<unsigned char*>(
+                calloc(requested_height, surfaces[i].row_bytes));
+        if (surfaces[i].data == NULL) {
+            perror("memory backend: failed to allocate surface");
+            memory_exit(backend);
+            return NULL;
+        }
+    }
+
+    printf("memory backend: %d x %d, %d buffer(s)\n",
+           requested_width, requested_height, num_buffers);
+
+    draw_buffer = 0;
+    displayed_buffer = 0;
+    memset(&frame_stats, 0, sizeof(frame_stats));
+    return &surfaces[draw_buffer];
+}
+
+static void count_frame(size_t bytes_copied) {
+    frame_stats.bytes_copied += bytes_copied;
+    frame_stats.last_bytes_copied = bytes_copied;
+    frame_stats_add(&frame_stats, &last_frame_us, frame_stats_now_us());
+}
+
+static GRSurface* memory_flip_damage(minui_backend* backend __unused, const GRSurface* source,
+                                     const GRRect* damage, int count) {
+    count_frame(gr_copy_damage(source, &surfaces[draw_buffer], damage, count));
+    displayed_buffer = draw_buffer;
+    draw_buffer = (draw_buffer + 1) % num_buffers;
+    return &surfaces[draw_buffer];
+}
+
+static bool memory_frame_stats(minui_backend* backend __unused, GRFrameStats* stats) {
+    *stats = frame_stats;
+    return true;
+}
+
+static void memory_blank(minui_backend* backend __unused, bool blank __unused) {
+}
+
+static void memory_exit(minui_backend* backend __unused) {
+    for (int i = 0; i < kMaxBuffers; ++i) {
+        free(surfaces[i].data);
+        surfaces[i].data = NULL;
+    }
+    num_buffers = 0;
+}
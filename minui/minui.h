@@ -17,6 +17,7 @@
 #ifndef _MINUI_H_
 #define _MINUI_H_
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #include <functional>
@@ -61,6 +62,43 @@ int gr_measure(const GRFont* font, const char *s);
 void gr_font_size(const GRFont* font, int *x, int *y);
 
 void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy);
+
+// Moves the contents of the given area up (dy < 0) or down (dy > 0) by
+// |dy| rows.  The rows scrolled into view keep what they had before and
+// need to be redrawn.
+void gr_scroll(int x, int y, int w, int h, int dy);
+
+// minui keeps track of what each drawing call changes, and after
+// gr_flip() the surface being drawn always starts out holding the frame
+// that was just displayed, whatever buffering the display uses.  So it's
+// enough to redraw the parts of the screen that have changed.
+
+// How frames have been getting to the display.  DRM times frames by
+// when they reached the screen; fbdev and the memory backend by when
+// they were flipped.  Intervals are between consecutive frames, so they
+// include the time nothing new was drawn.  Backends also count the bytes
+// copied from minui's drawing surface into their buffers.
+struct GRFrameStats {
+    uint64_t frames;             // frames displayed
+    uint64_t wait_us;            // time gr_flip() has spent waiting for the display
+    uint32_t last_interval_us;   // between the last two frames
+    uint32_t max_interval_us;    // the longest interval so far
+    uint64_t bytes_copied;       // copied to the display
+    uint32_t last_bytes_copied;  // by the last flip
+};
+
+// Returns false if the backend doesn't keep frame statistics.
+bool gr_frame_stats(GRFrameStats* stats);
+
+// Makes gr_init() draw into memory instead of looking for a display,
+// with 'buffers' (1 to 3) surfaces of the given size behaving like a
+// display buffered that many times.  For benchmarks and tests.
+void gr_set_memory_backend(int width, int height, int buffers);
+
+// The frame the memory backend is currently "displaying", or NULL if it
+// isn't in use.
+const GRSurface* gr_memory_displayed();
+
 unsigned int gr_get_width(GRSurface* surface);
 unsigned int gr_get_height(GRSurface* surface);
 
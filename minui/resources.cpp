@@ -409,6 +409,10 @@ int res_create_localized_alpha_surface(const char* name,
         goto exit;
     }
 
+    // The locales are stacked vertically, each a header row followed by its
+    // image.  There is no index of where each one starts: the compressed rows
+    // can't be skipped without inflating them, so every row up to the match
+    // is decoded.
     row.resize(width);
     for (y = 0; y < height; ++y) {
         png_read_row(png_ptr, row.data(), NULL);
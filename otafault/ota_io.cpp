@@ -22,11 +22,15 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
 
 #include "config.h"
 
+// Guards filename_cache, since applypatch may do I/O from several threads.
+static std::mutex filename_cache_lock;
 static std::map<intptr_t, const char*> filename_cache;
 static std::string read_fault_file_name = "";
 static std::string write_fault_file_name = "";
@@ -50,29 +54,35 @@ void ota_set_fault_files() {
     }
 }
 
-bool have_eio_error = false;
+std::atomic<bool> have_eio_error(false);
 
 int ota_open(const char* path, int oflags) {
     // Let the caller handle errors; we do not care if open succeeds or fails
     int fd = open(path, oflags);
+    std::lock_guard<std::mutex> lock(filename_cache_lock);
     filename_cache[fd] = path;
     return fd;
 }
 
 int ota_open(const char* path, int oflags, mode_t mode) {
     int fd = open(path, oflags, mode);
+    std::lock_guard<std::mutex> lock(filename_cache_lock);
     filename_cache[fd] = path;
     return fd; }
 
 FILE* ota_fopen(const char* path, const char* mode) {
     FILE* fh = fopen(path, mode);
+    std::lock_guard<std::mutex> lock(filename_cache_lock);
     filename_cache[(intptr_t)fh] = path;
     return fh;
 }
 
 static int __ota_close(int fd) {
     // descriptors can be reused, so make sure not to leave them in the cache
-    filename_cache.erase(fd);
+    {
+        std::lock_guard<std::mutex> lock(filename_cache_lock);
+        filename_cache.erase(fd);
+    }
     return close(fd);
 }
 
@@ -85,7 +95,10 @@ int ota_close(unique_fd& fd) {
 }
 
 static int __ota_fclose(FILE* fh) {
-    filename_cache.erase(reinterpret_cast<intptr_t>(fh));
+    {
+        std::lock_guard<std::mutex> lock(filename_cache_lock);
+        filename_cache.erase(reinterpret_cast<intptr_t>(fh));
+    }
     return fclose(fh);
 }
 
@@ -99,6 +112,7 @@ int ota_fclose(unique_file& fh) {
 
 size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream) {
     if (should_fault_inject(OTAIO_READ)) {
+        std::lock_guard<std::mutex> lock(filename_cache_lock);
         auto cached = filename_cache.find((intptr_t)stream);
         const char* cached_path = cached->second;
         if (cached != filename_cache.end() &&
@@ -119,6 +133,7 @@ size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream) {
 
 ssize_t ota_read(int fd, void* buf, size_t nbyte) {
     if (should_fault_inject(OTAIO_READ)) {
+        std::lock_guard<std::mutex> lock(filename_cache_lock);
         auto cached = filename_cache.find(fd);
         const char* cached_path = cached->second;
         if (cached != filename_cache.end()
@@ -138,6 +153,7 @@ ssize_t ota_read(int fd, void* buf, size_t nbyte) {
 
 size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
     if (should_fault_inject(OTAIO_WRITE)) {
+        std::lock_guard<std::mutex> lock(filename_cache_lock);
         auto cached = filename_cache.find((intptr_t)stream);
         const char* cached_path = cached->second;
         if (cached != filename_cache.end() &&
@@ -157,6 +173,7 @@ size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
 
 ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
     if (should_fault_inject(OTAIO_WRITE)) {
+        std::lock_guard<std::mutex> lock(filename_cache_lock);
         auto cached = filename_cache.find(fd);
         const char* cached_path = cached->second;
         if (cached != filename_cache.end() &&
@@ -176,6 +193,7 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
 
 int ota_fsync(int fd) {
     if (should_fault_inject(OTAIO_FSYNC)) {
+        std::lock_guard<std::mutex> lock(filename_cache_lock);
         auto cached = filename_cache.find(fd);
         const char* cached_path = cached->second;
         if (cached != filename_cache.end() &&
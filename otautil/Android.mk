@@ -18,7 +18,8 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
     SysUtil.cpp \
     DirUtil.cpp \
-    ZipUtil.cpp
+    ZipUtil.cpp \
+    StatusChannel.cpp
 
 LOCAL_STATIC_LIBRARIES := libselinux libbase
 
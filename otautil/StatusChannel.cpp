@@ -0,0 +1,323 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StatusChannel.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+constexpr std::chrono::milliseconds StatusWriter::PROGRESS_INTERVAL;
+
+static constexpr size_t MAX_FRAME_PAYLOAD = 0xffff;
+
+StatusWriter::StatusWriter(FILE* pipe, bool framed)
+    : pipe_(pipe), framed_(framed), flush_thread_(&StatusWriter::FlushThreadLoop, this) {}
+
+StatusWriter::~StatusWriter() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopping_ = true;
+  }
+  progress_cv_.notify_one();
+  flush_thread_.join();
+  Flush();
+}
+
+void StatusWriter::FlushThreadLoop() {
+  std::unique_lock<std::mutex> lock(lock_);
+  while (!stopping_) {
+    if (!progress_pending_) {
+      progress_cv_.wait(lock);
+      continue;
+    }
+    auto due = last_progress_ + PROGRESS_INTERVAL;
+    if (std::chrono::steady_clock::now() >= due) {
+      WritePendingLocked();
+    } else {
+      progress_cv_.wait_until(lock, due);
+    }
+  }
+}
+
+void StatusWriter::WriteLocked(StatusCommand command, const void* payload, size_t size,
+                               const std::string& text_line) {
+  if (framed_) {
+    size = std::min(size, MAX_FRAME_PAYLOAD);
+    std::vector<uint8_t> frame(STATUS_FRAME_HEADER_SIZE + size);
+    frame[0] = STATUS_FRAME_MAGIC;
+    frame[1] = static_cast<uint8_t>(command);
+    frame[2] = static_cast<uint8_t>(size & 0xff);
+    frame[3] = static_cast<uint8_t>(size >> 8);
+    if (size > 0) {
+      memcpy(frame.data() + STATUS_FRAME_HEADER_SIZE, payload, size);
+    }
+    fwrite(frame.data(), 1, frame.size(), pipe_);
+  } else {
+    fputs(text_line.c_str(), pipe_);
+  }
+  fflush(pipe_);
+  ++messages_written_;
+}
+
+void StatusWriter::WritePendingLocked() {
+  if (!progress_pending_) {
+    return;
+  }
+  WriteLocked(StatusCommand::SET_PROGRESS, &pending_fraction_, sizeof(pending_fraction_),
+              android::base::StringPrintf("set_progress %f\n", pending_fraction_));
+  progress_pending_ = false;
+  last_progress_ = std::chrono::steady_clock::now();
+}
+
+void StatusWriter::Progress(float fraction, int seconds) {
+  std::lock_guard<std::mutex> lock(lock_);
+  WritePendingLocked();
+  uint8_t payload[sizeof(float) + sizeof(int32_t)];
+  int32_t secs = seconds;
+  memcpy(payload, &fraction, sizeof(float));
+  memcpy(payload + sizeof(float), &secs, sizeof(int32_t));
+  WriteLocked(StatusCommand::PROGRESS, payload, sizeof(payload),
+              android::base::StringPrintf("progress %f %d\n", fraction, seconds));
+}
+
+void StatusWriter::SetProgress(float fraction) {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (progress_pending_) {
+    ++progress_coalesced_;
+  }
+  pending_fraction_ = fraction;
+  progress_pending_ = true;
+  if (std::chrono::steady_clock::now() - last_progress_ >= PROGRESS_INTERVAL) {
+    WritePendingLocked();
+  } else {
+    progress_cv_.notify_one();
+  }
+}
+
+void StatusWriter::UiPrint(const std::string& buffer) {
+  std::vector<std::string> lines = android::base::Split(buffer, "\n");
+  std::lock_guard<std::mutex> lock(lock_);
+  WritePendingLocked();
+  if (!framed_) {
+    // A text ui_print doesn't end the line, so each one is followed by an
+    // empty one.
+    for (const auto& line : lines) {
+      if (!line.empty()) {
+        WriteLocked(StatusCommand::UI_PRINT, nullptr, 0, "ui_print " + line + "\n");
+        WriteLocked(StatusCommand::UI_PRINT, nullptr, 0, "ui_print\n");
+      }
+    }
+    return;
+  }
+
+  // Frames carry the newlines, so the whole buffer usually fits in one;
+  // recovery prints the pieces of an oversized one back to back.
+  std::string text;
+  for (const auto& line : lines) {
+    if (!line.empty()) {
+      text += line + "\n";
+    }
+  }
+  for (size_t pos = 0; pos < text.size(); pos += MAX_FRAME_PAYLOAD) {
+    size_t size = std::min(text.size() - pos, MAX_FRAME_PAYLOAD);
+    WriteLocked(StatusCommand::UI_PRINT, text.data() + pos, size, "");
+  }
+}
+
+void StatusWriter::Log(const std::string& text) {
+  std::lock_guard<std::mutex> lock(lock_);
+  WritePendingLocked();
+  WriteLocked(StatusCommand::LOG, text.data(), text.size(), "log " + text + "\n");
+}
+
+void StatusWriter::Send(StatusCommand command) {
+  const char* name;
+  switch (command) {
+    case StatusCommand::WIPE_CACHE:
+      name = "wipe_cache";
+      break;
+    case StatusCommand::CLEAR_DISPLAY:
+      name = "clear_display";
+      break;
+    case StatusCommand::ENABLE_REBOOT:
+      name = "enable_reboot";
+      break;
+    case StatusCommand::RETRY_UPDATE:
+      name = "retry_update";
+      break;
+    default:
+      LOG(ERROR) << "status command " << static_cast<int>(command) << " needs arguments";
+      return;
+  }
+  std::lock_guard<std::mutex> lock(lock_);
+  WritePendingLocked();
+  WriteLocked(command, nullptr, 0, std::string(name) + "\n");
+}
+
+void StatusWriter::Flush() {
+  std::lock_guard<std::mutex> lock(lock_);
+  WritePendingLocked();
+}
+
+bool StatusReader::Fill() {
+  if (eof_) {
+    return false;
+  }
+  uint8_t chunk[4096];
+  ssize_t n = TEMP_FAILURE_RETRY(read(fd_, chunk, sizeof(chunk)));
+  if (n <= 0) {
+    if (n == -1) {
+      PLOG(ERROR) << "failed to read status from the update binary";
+    }
+    eof_ = true;
+    return false;
+  }
+  // Drop the consumed bytes once they make up most of the buffer. This
+  // moves the data, so it only happens when there is more to parse.
+  if (start_ > 0 && start_ * 2 >= buffer_.size()) {
+    buffer_.erase(buffer_.begin(), buffer_.begin() + start_);
+    start_ = 0;
+  }
+  buffer_.insert(buffer_.end(), chunk, chunk + n);
+  return true;
+}
+
+bool StatusReader::ParseFrame(StatusMessage* message) {
+  const uint8_t* frame = buffer_.data() + start_;
+  size_t size = frame[2] | (frame[3] << 8);
+  const uint8_t* payload = frame + STATUS_FRAME_HEADER_SIZE;
+  start_ += STATUS_FRAME_HEADER_SIZE + size;
+
+  *message = StatusMessage();
+  message->command = static_cast<StatusCommand>(frame[1]);
+  switch (message->command) {
+    case StatusCommand::PROGRESS:
+      if (size < sizeof(float) + sizeof(int32_t)) {
+        return false;
+      }
+      memcpy(&message->fraction, payload, sizeof(float));
+      memcpy(&message->seconds, payload + sizeof(float), sizeof(int32_t));
+      return true;
+    case StatusCommand::SET_PROGRESS:
+      if (size < sizeof(float)) {
+        return false;
+      }
+      memcpy(&message->fraction, payload, sizeof(float));
+      return true;
+    case StatusCommand::UI_PRINT:
+    case StatusCommand::LOG:
+      message->text.assign(reinterpret_cast<const char*>(payload), size);
+      return true;
+    case StatusCommand::WIPE_CACHE:
+    case StatusCommand::CLEAR_DISPLAY:
+    case StatusCommand::ENABLE_REBOOT:
+    case StatusCommand::RETRY_UPDATE:
+      return true;
+    default:
+      message->command = StatusCommand::UNKNOWN;
+      message->text = android::base::StringPrintf("frame %d", frame[1]);
+      return true;
+  }
+}
+
+void StatusReader::ParseLine(const std::string& line, StatusMessage* message) {
+  *message = StatusMessage();
+
+  size_t begin = line.find_first_not_of(' ');
+  size_t end = line.find(' ', begin);
+  std::string command = line.substr(begin, end - begin);
+  // The rest of the line after the single space that ends the command.
+  std::string rest = (end == std::string::npos) ? "" : line.substr(end + 1);
+
+  if (command == "progress") {
+    message->command = StatusCommand::PROGRESS;
+    const char* p = rest.c_str();
+    char* next;
+    message->fraction = strtof(p, &next);
+    message->seconds = strtol(next, nullptr, 10);
+  } else if (command == "set_progress") {
+    message->command = StatusCommand::SET_PROGRESS;
+    message->fraction = strtof(rest.c_str(), nullptr);
+  } else if (command == "ui_print") {
+    message->command = StatusCommand::UI_PRINT;
+    message->text = rest;
+  } else if (command == "wipe_cache") {
+    message->command = StatusCommand::WIPE_CACHE;
+  } else if (command == "clear_display") {
+    message->command = StatusCommand::CLEAR_DISPLAY;
+  } else if (command == "enable_reboot") {
+    message->command = StatusCommand::ENABLE_REBOOT;
+  } else if (command == "retry_update") {
+    message->command = StatusCommand::RETRY_UPDATE;
+  } else if (command == "log") {
+    message->command = StatusCommand::LOG;
+    message->text = rest;
+  } else {
+    message->text = command;
+  }
+}
+
+bool StatusReader::Next(StatusMessage* message) {
+  while (true) {
+    size_t available = buffer_.size() - start_;
+    if (available == 0) {
+      if (!Fill()) {
+        return false;
+      }
+      continue;
+    }
+
+    if (buffer_[start_] == STATUS_FRAME_MAGIC) {
+      if (available < STATUS_FRAME_HEADER_SIZE ||
+          available < STATUS_FRAME_HEADER_SIZE +
+                      (buffer_[start_ + 2] | (buffer_[start_ + 3] << 8))) {
+        if (!Fill()) {
+          LOG(ERROR) << "status stream ended inside a frame";
+          return false;
+        }
+        continue;
+      }
+      if (ParseFrame(message)) {
+        return true;
+      }
+      LOG(ERROR) << "dropping truncated status frame " << static_cast<int>(message->command);
+      continue;
+    }
+
+    auto first = buffer_.begin() + start_;
+    auto newline = std::find(first, buffer_.end(), '\n');
+    if (newline == buffer_.end() && Fill()) {
+      continue;
+    }
+    std::string line(first, newline);
+    start_ = (newline == buffer_.end()) ? buffer_.size() : newline - buffer_.begin() + 1;
+    if (line.find_first_not_of(' ') == std::string::npos) {
+      continue;
+    }
+    ParseLine(line, message);
+    return true;
+  }
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_STATUS_CHANNEL
+#define _OTAUTIL_STATUS_CHANNEL
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * The updater reports back to recovery over a pipe. The original protocol
+ * is one text command per line, e.g. "set_progress 0.250000\n". Recovery
+ * also accepts binary frames, and says so by setting STATUS_FRAMES_ENV in
+ * the updater's environment; an updater that doesn't see it keeps writing
+ * text. Text lines and frames may be mixed on the same pipe.
+ *
+ * A frame is STATUS_FRAME_MAGIC, a StatusCommand byte, the payload length
+ * as a little-endian uint16 and the payload. Floats and ints in payloads
+ * are in host byte order, since both ends run on the same device.
+ * STATUS_FRAME_MAGIC can't start a text command.
+ */
+static constexpr const char* STATUS_FRAMES_ENV = "RECOVERY_STATUS_FRAMES";
+static constexpr uint8_t STATUS_FRAME_MAGIC = 0xff;
+static constexpr size_t STATUS_FRAME_HEADER_SIZE = 4;
+
+enum class StatusCommand : uint8_t {
+  UNKNOWN = 0,        // text: the unrecognized command
+  PROGRESS = 1,       // fraction, seconds
+  SET_PROGRESS = 2,   // fraction
+  UI_PRINT = 3,       // text; empty prints a newline
+  WIPE_CACHE = 4,
+  CLEAR_DISPLAY = 5,
+  ENABLE_REBOOT = 6,
+  RETRY_UPDATE = 7,
+  LOG = 8,            // text
+};
+
+struct StatusMessage {
+  StatusCommand command = StatusCommand::UNKNOWN;
+  float fraction = 0;
+  int32_t seconds = 0;
+  std::string text;
+};
+
+/*
+ * Updater side. set_progress updates are coalesced: one is written at most
+ * every PROGRESS_INTERVAL, and a pending one goes out before any other
+ * message, on Flush(), or from a background thread once the interval is up,
+ * so recovery always ends up with the latest value in the original order
+ * even while the script is busy. Safe to use from several threads.
+ *
+ * Each message is written with a single stdio call, so text commands that
+ * others fprintf() to the same FILE land between messages rather than
+ * inside a frame.
+ */
+class StatusWriter {
+ public:
+  static constexpr std::chrono::milliseconds PROGRESS_INTERVAL{ 100 };
+
+  StatusWriter(FILE* pipe, bool framed);
+  ~StatusWriter();
+
+  void Progress(float fraction, int seconds);
+  void SetProgress(float fraction);
+  // Prints each non-empty line of 'buffer' on its own line on the screen,
+  // without other messages in between.
+  void UiPrint(const std::string& buffer);
+  void Log(const std::string& text);
+  // For the commands without arguments.
+  void Send(StatusCommand command);
+  void Flush();
+
+  size_t messages_written() const { return messages_written_; }
+  size_t progress_coalesced() const { return progress_coalesced_; }
+
+ private:
+  void FlushThreadLoop();
+  void WritePendingLocked();
+  void WriteLocked(StatusCommand command, const void* payload, size_t size,
+                   const std::string& text_line);
+
+  std::mutex lock_;
+  FILE* pipe_;
+  bool framed_;
+
+  bool progress_pending_ = false;
+  float pending_fraction_ = 0;
+  std::chrono::steady_clock::time_point last_progress_;
+
+  // Wakes up flush_thread_ when an update is left pending, or to stop it.
+  std::condition_variable progress_cv_;
+  bool stopping_ = false;
+  std::thread flush_thread_;
+
+  // Read without lock_, while flush_thread_ may be writing.
+  std::atomic<size_t> messages_written_{ 0 };
+  std::atomic<size_t> progress_coalesced_{ 0 };
+};
+
+/*
+ * Recovery side. Reads text lines and frames from 'fd' and returns them one
+ * message at a time. Next() returns false at the end of the stream.
+ */
+class StatusReader {
+ public:
+  explicit StatusReader(int fd) : fd_(fd) {}
+
+  bool Next(StatusMessage* message);
+
+ private:
+  bool Fill();
+  bool ParseFrame(StatusMessage* message);
+  void ParseLine(const std::string& line, StatusMessage* message);
+
+  int fd_;
+  bool eof_ = false;
+  std::vector<uint8_t> buffer_;
+  size_t start_ = 0;
+};
+
+#endif  // _OTAUTIL_STATUS_CHANNEL
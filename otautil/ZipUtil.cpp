@@ -18,9 +18,16 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
@@ -33,9 +40,49 @@
 static constexpr mode_t UNZIP_DIRMODE = 0755;
 static constexpr mode_t UNZIP_FILEMODE = 0644;
 
-bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
-                             const std::string& dest_path, const struct utimbuf* timestamp,
-                             struct selabel_handle* sehnd) {
+struct ExtractJob {
+    ZipEntry entry;
+    std::string path;
+    std::string secontext;
+};
+
+static bool ExtractEntry(ZipArchiveHandle zip, ExtractJob* job, const struct utimbuf* timestamp) {
+    const std::string& path = job->path;
+    if (!job->secontext.empty()) {
+        setfscreatecon(job->secontext.c_str());
+    }
+    android::base::unique_fd fd(open(path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, UNZIP_FILEMODE));
+    if (!job->secontext.empty()) {
+        setfscreatecon(NULL);
+    }
+    if (fd == -1) {
+        PLOG(ERROR) << "Can't create target file \"" << path << "\"";
+        return false;
+    }
+
+    int err = ExtractEntryToFile(zip, &job->entry, fd);
+    if (err != 0) {
+        LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
+        return false;
+    }
+
+    if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
+        PLOG(ERROR) << "Error touching \"" << path << "\"";
+        return false;
+    }
+
+    LOG(INFO) << "Extracted file \"" << path << "\"";
+    return true;
+}
+
+// A ZipArchiveHandle isn't safe to read from several threads at once, so
+// every worker but the calling thread reads through its own handle, made by
+// open_archive(). Without open_archive, everything is extracted on the
+// calling thread.
+static bool ExtractPackage(ZipArchiveHandle zip,
+                           const std::function<ZipArchiveHandle()>& open_archive,
+                           const std::string& zip_path, const std::string& dest_path,
+                           const struct utimbuf* timestamp, struct selabel_handle* sehnd) {
     if (!zip_path.empty() && zip_path[0] == '/') {
         LOG(ERROR) << "ExtractPackageRecursive(): zip_path must be a relative path " << zip_path;
         return false;
@@ -65,7 +112,8 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
     std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
     ZipEntry entry;
     ZipString name;
-    int extractCount = 0;
+    std::set<std::string> created_dirs;
+    std::vector<ExtractJob> jobs;
     while (Next(cookie, &entry, &name) == 0) {
         std::string entry_name(name.name, name.name + name.name_length);
         CHECK_LE(prefix_path.size(), entry_name.size());
@@ -76,46 +124,130 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
         }
         //TODO(b/31917448) handle the symlink.
 
-        if (dirCreateHierarchy(path.c_str(), UNZIP_DIRMODE, timestamp, true, sehnd) != 0) {
-            LOG(ERROR) << "failed to create dir for " << path;
-            return false;
+        // Entries of the same directory are usually adjacent, so remember what
+        // has been created already instead of walking the hierarchy each time.
+        std::string dir = path.substr(0, path.rfind('/'));
+        if (created_dirs.find(dir) == created_dirs.end()) {
+            if (dirCreateHierarchy(path.c_str(), UNZIP_DIRMODE, timestamp, true, sehnd) != 0) {
+                LOG(ERROR) << "failed to create dir for " << path;
+                return false;
+            }
+            created_dirs.insert(dir);
         }
 
-        char *secontext = NULL;
+        // Look up the labels upfront, since selabel_lookup() isn't safe to
+        // call from the workers.
+        std::string context;
         if (sehnd) {
-            selabel_lookup(sehnd, &secontext, path.c_str(), UNZIP_FILEMODE);
-            setfscreatecon(secontext);
-        }
-        android::base::unique_fd fd(open(path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, UNZIP_FILEMODE));
-        if (fd == -1) {
-            PLOG(ERROR) << "Can't create target file \"" << path << "\"";
-            return false;
-        }
-        if (secontext) {
-            freecon(secontext);
-            setfscreatecon(NULL);
+            char* secontext = NULL;
+            if (selabel_lookup(sehnd, &secontext, path.c_str(), UNZIP_FILEMODE) == 0 &&
+                    secontext != NULL) {
+                context = secontext;
+                freecon(secontext);
+            }
         }
+        jobs.push_back({ entry, path, context });
+    }
 
-        int err = ExtractEntryToFile(zip, &entry, fd);
-        if (err != 0) {
-            LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
-            return false;
+    // The workers overlap inflating the entries with creating and labeling
+    // the files (the fscreate context is per-thread), writing them out and
+    // setting their timestamps. They share nothing but the job list.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = std::max<size_t>(1, std::min<size_t>(jobs.size(), cpus > 0 ? cpus : 1));
+    if (!open_archive) {
+        thread_count = 1;
+    }
+    std::atomic<size_t> next_job(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&](ZipArchiveHandle handle) {
+        for (size_t i = next_job++; i < jobs.size() && !failed; i = next_job++) {
+            if (!ExtractEntry(handle, &jobs[i], timestamp)) {
+                failed = true;
+            }
         }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back([&]() {
+            // If the archive can't be opened again, this worker just leaves
+            // its share to the others.
+            ZipArchiveHandle handle = open_archive();
+            if (handle != nullptr) {
+                worker(handle);
+                CloseArchive(handle);
+            }
+        });
+    }
+    worker(zip);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (failed) {
+        return false;
+    }
 
-        if (fsync(fd) != 0) {
-            PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << path << "\"";
+    // Flush all the extracted files in one go, rather than an fsync per file.
+    // With nothing under zip_path there's nothing to flush, and target_dir
+    // may not even exist.
+    if (!jobs.empty()) {
+        android::base::unique_fd dest_fd(open(target_dir.c_str(), O_RDONLY | O_DIRECTORY));
+        if (dest_fd == -1 || syncfs(dest_fd) != 0) {
+            PLOG(ERROR) << "Error syncing extracted files under \"" << target_dir << "\"";
             return false;
         }
+    }
 
-        if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
-            PLOG(ERROR) << "Error touching \"" << path << "\"";
-            return false;
-        }
+    LOG(INFO) << "Extracted " << jobs.size() << " file(s) with " << thread_count << " thread(s)";
+    return true;
+}
 
-        LOG(INFO) << "Extracted file \"" << path << "\"";
-        ++extractCount;
+bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
+                             const std::string& dest_path, const struct utimbuf* timestamp,
+                             struct selabel_handle* sehnd) {
+    // The workers reopen the archive's file rather than dup() it, so that
+    // they don't share a file offset. An archive opened from memory has no
+    // file, and is only read on this thread.
+    std::function<ZipArchiveHandle()> open_archive;
+    int fd = GetFileDescriptor(zip);
+    if (fd != -1) {
+        std::string fd_path = "/proc/self/fd/" + std::to_string(fd);
+        open_archive = [fd_path]() -> ZipArchiveHandle {
+            int worker_fd = open(fd_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (worker_fd == -1) {
+                PLOG(WARNING) << "Failed to reopen " << fd_path;
+                return nullptr;
+            }
+            ZipArchiveHandle handle;
+            int err = OpenArchiveFd(worker_fd, fd_path.c_str(), &handle, true);
+            if (err != 0) {
+                LOG(WARNING) << "Failed to reopen " << fd_path << ": " << ErrorCodeString(err);
+                CloseArchive(handle);
+                return nullptr;
+            }
+            return handle;
+        };
     }
+    return ExtractPackage(zip, open_archive, zip_path, dest_path, timestamp, sehnd);
+}
 
-    LOG(INFO) << "Extracted " << extractCount << " file(s)";
-    return true;
+bool ExtractPackageRecursive(uint8_t* zip_addr, size_t zip_len, const std::string& zip_path,
+                             const std::string& dest_path, const struct utimbuf* timestamp,
+                             struct selabel_handle* sehnd) {
+    auto open_archive = [zip_addr, zip_len]() -> ZipArchiveHandle {
+        ZipArchiveHandle handle;
+        int err = OpenArchiveFromMemory(zip_addr, zip_len, "package", &handle);
+        if (err != 0) {
+            LOG(ERROR) << "Failed to open the package: " << ErrorCodeString(err);
+            CloseArchive(handle);
+            return nullptr;
+        }
+        return handle;
+    };
+    ZipArchiveHandle zip = open_archive();
+    if (zip == nullptr) {
+        return false;
+    }
+    bool success = ExtractPackage(zip, open_archive, zip_path, dest_path, timestamp, sehnd);
+    CloseArchive(zip);
+    return success;
 }
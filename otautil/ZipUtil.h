@@ -17,6 +17,7 @@
 #ifndef _OTAUTIL_ZIPUTIL_H
 #define _OTAUTIL_ZIPUTIL_H
 
+#include <stdint.h>
 #include <utime.h>
 
 #include <string>
@@ -48,10 +49,25 @@
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
+ * The files are written on a pool of worker threads, and the destination
+ * filesystem is synced once after all of them have been written. Each
+ * worker reads from its own copy of the archive, which is reopened from
+ * zip's file. An archive opened from memory is only read on the calling
+ * thread. zip must not be used by anything else until the call returns.
+ *
  * Returns true on success, false on failure.
  */
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
                              struct selabel_handle* sehnd);
 
+/*
+ * Same as above, for a package mapped at zip_addr. Every worker, the calling
+ * thread included, opens its own handle on the mapping, so no handle the
+ * caller holds is touched.
+ */
+bool ExtractPackageRecursive(uint8_t* zip_addr, size_t zip_len, const std::string& zip_path,
+                             const std::string& dest_path, const struct utimbuf* timestamp,
+                             struct selabel_handle* sehnd);
+
 #endif // _OTAUTIL_ZIPUTIL_H
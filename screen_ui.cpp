@@ -29,6 +29,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -44,6 +48,11 @@
 
 #define TEXT_INDENT     4
 
+// How many animation frames to keep decoded, counting the one on screen.
+// Decoding a frame takes a fraction of a frame interval, so the animation
+// thread stays ahead with only a few.
+static const size_t kAnimationCacheFrames = 8;
+
 // Return the current time as a double (including fractions of a second).
 static double now() {
     struct timeval tv;
@@ -54,6 +63,9 @@ static double now() {
 ScreenRecoveryUI::ScreenRecoveryUI() :
     currentIcon(NONE),
     locale(nullptr),
+    drawn_frame_(0),
+    shown_frame_(0),
+    frame_height_(0),
     progressBarType(EMPTY),
     progressScopeStart(0),
     progressScopeSize(0),
@@ -65,6 +77,13 @@ ScreenRecoveryUI::ScreenRecoveryUI() :
     text_col_(0),
     text_row_(0),
     text_top_(0),
+    log_valid_(false),
+    log_top_(0),
+    log_rows_(0),
+    log_scrolled_(0),
+    log_dirty_(false),
+    prints_received_(0),
+    frames_rendered_(0),
     show_text(false),
     show_text_ever(false),
     menu_(nullptr),
@@ -72,6 +91,9 @@ ScreenRecoveryUI::ScreenRecoveryUI() :
     menu_items(0),
     menu_sel(0),
     file_viewer_text_(nullptr),
+    animation_cond_(PTHREAD_COND_INITIALIZER),
+    init_time_(0),
+    first_frame_drawn_(false),
     intro_frames(0),
     loop_frames(0),
     current_frame(0),
@@ -83,13 +105,40 @@ ScreenRecoveryUI::ScreenRecoveryUI() :
     rtl_locale(false) {
 }
 
+// Should only be called with updateMutex locked.
 GRSurface* ScreenRecoveryUI::GetCurrentFrame() {
     if (currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) {
-        return intro_done ? loopFrames[current_frame] : introFrames[current_frame];
+        size_t index = CurrentFrameIndex();
+        if (index != drawn_frame_) {
+            drawn_frame_ = index;
+            pthread_cond_signal(&animation_cond_);
+        }
+        if (frames_[index] != nullptr) {
+            shown_frame_ = index;
+        }
+        // Otherwise the animation thread hasn't got to it yet (or it's
+        // broken), so keep showing the last frame there was.  Decoding it
+        // here would hold up everything waiting on updateMutex.
+        GRSurface* frame = frames_[shown_frame_];
+        if (frame != nullptr && !first_frame_drawn_) {
+            first_frame_drawn_ = true;
+            printf("First animation frame %.3f s after UI init\n", now() - init_time_);
+        }
+        return frame;
     }
     return error_icon;
 }
 
+// Should only be called with updateMutex locked.
+size_t ScreenRecoveryUI::CurrentFrameIndex() {
+    return intro_done ? intro_frames + current_frame : current_frame;
+}
+
+// The frame that follows 'index': the intro plays once, then the loop repeats.
+size_t ScreenRecoveryUI::NextFrameIndex(size_t index) {
+    return (index + 1 < frames_.size()) ? index + 1 : intro_frames;
+}
+
 GRSurface* ScreenRecoveryUI::GetCurrentText() {
     switch (currentIcon) {
         case ERASING: return erasing_text;
@@ -130,7 +179,7 @@ static constexpr int kLayouts[LAYOUT_MAX][DIMENSION_MAX] = {
 
 int ScreenRecoveryUI::GetAnimationBaseline() {
     return GetTextBaseline() - PixelsFromDp(kLayouts[layout_][ICON]) -
-            gr_get_height(loopFrames[0]);
+            frame_height_;
 }
 
 int ScreenRecoveryUI::GetTextBaseline() {
@@ -285,6 +334,7 @@ static const char* LONG_PRESS_HELP[] = {
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::draw_screen_locked() {
     if (!show_text) {
+        log_valid_ = false;
         draw_background_locked();
         draw_foreground_locked();
     } else {
@@ -329,17 +379,34 @@ void ScreenRecoveryUI::draw_screen_locked() {
         // display from the bottom up, until we hit the top of the
         // screen, the bottom of the menu, or we've displayed the
         // entire text buffer.
-        SetColor(LOG);
-        int row = (text_top_ + text_rows_ - 1) % text_rows_;
-        size_t count = 0;
-        for (int ty = gr_fb_height() - char_height_;
-             ty >= y && count < text_rows_;
-             ty -= char_height_, ++count) {
-            gr_text(gr_sys_font(), 0, ty, text_[row], false);
-            --row;
-            if (row < 0) row = text_rows_ - 1;
+        log_rows_ = draw_log_locked(y, text_rows_, false);
+        log_top_ = gr_fb_height() - log_rows_ * char_height_;
+        log_scrolled_ = 0;
+        log_valid_ = true;
+        log_dirty_ = false;
+    }
+}
+
+// Draws the newest 'count' lines of the log from the bottom of the screen
+// up, stopping at 'top'.  With 'erase', clears behind each line first.
+// Returns the number of lines drawn.
+// Should only be called with updateMutex locked.
+size_t ScreenRecoveryUI::draw_log_locked(int top, size_t count, bool erase) {
+    int row = (text_top_ + text_rows_ - 1) % text_rows_;
+    size_t drawn = 0;
+    for (int ty = gr_fb_height() - char_height_;
+         ty >= top && drawn < count;
+         ty -= char_height_, ++drawn) {
+        if (erase) {
+            gr_color(0, 0, 0, 255);
+            gr_fill(0, ty, gr_fb_width(), ty + char_height_);
         }
+        SetColor(LOG);
+        gr_text(gr_sys_font(), 0, ty, text_[row], false);
+        --row;
+        if (row < 0) row = text_rows_ - 1;
     }
+    return drawn;
 }
 
 // Redraw everything on the screen and flip the screen (make it visible).
@@ -347,6 +414,28 @@ void ScreenRecoveryUI::draw_screen_locked() {
 void ScreenRecoveryUI::update_screen_locked() {
     draw_screen_locked();
     gr_flip();
+    ++frames_rendered_;
+}
+
+// Shows new log text.  If the screen still shows the log as it was last
+// drawn, scrolls the lines already there and draws only the new ones.
+// Should only be called with updateMutex locked.
+void ScreenRecoveryUI::update_log_locked() {
+    log_dirty_ = false;
+    if (!log_valid_ || log_scrolled_ >= log_rows_) {
+        update_screen_locked();
+        return;
+    }
+
+    if (log_scrolled_ > 0) {
+        gr_scroll(0, log_top_, gr_fb_width(), gr_fb_height() - log_top_,
+                  -static_cast<int>(log_scrolled_) * char_height_);
+    }
+    // The line that was at the bottom may have grown too.
+    draw_log_locked(log_top_, log_scrolled_ + 1, true);
+    log_scrolled_ = 0;
+    gr_flip();
+    ++frames_rendered_;
 }
 
 // Updates only the progress bar, if possible, otherwise redraws the screen.
@@ -359,6 +448,7 @@ void ScreenRecoveryUI::update_progress_locked() {
         draw_foreground_locked();  // Draw only the progress bar and overlays
     }
     gr_flip();
+    ++frames_rendered_;
 }
 
 // Keeps the progress bar updated, even when the process is otherwise busy.
@@ -404,7 +494,12 @@ void ScreenRecoveryUI::ProgressThreadLoop() {
             }
         }
 
-        if (redraw) update_progress_locked();
+        if (redraw) {
+            update_progress_locked();
+        } else if (show_text && log_dirty_) {
+            // Everything printed since the last frame goes out together.
+            update_log_locked();
+        }
 
         pthread_mutex_unlock(&updateMutex);
         double end = now();
@@ -429,6 +524,24 @@ void ScreenRecoveryUI::LoadLocalizedBitmap(const char* filename, GRSurface** sur
     }
 }
 
+// Runs the tasks on up to kLoaderThreads threads and returns once they
+// have all finished.
+static void RunInParallel(const std::vector<std::function<void()>>& tasks) {
+    static const size_t kLoaderThreads = 4;
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min(tasks.size(), kLoaderThreads); ++i) {
+        threads.emplace_back([&tasks, &next]() {
+            for (size_t task = next++; task < tasks.size(); task = next++) {
+                tasks[task]();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
 static char** Alloc2d(size_t rows, size_t cols) {
     char** result = new char*[rows];
     for (size_t i = 0; i < rows; ++i) {
@@ -460,6 +573,7 @@ bool ScreenRecoveryUI::InitTextParams() {
 }
 
 bool ScreenRecoveryUI::Init() {
+    init_time_ = now();
     RecoveryUI::Init();
     if (!InitTextParams()) {
       return false;
@@ -479,24 +593,30 @@ bool ScreenRecoveryUI::Init() {
     text_col_ = text_row_ = 0;
     text_top_ = 1;
 
-    LoadBitmap("icon_error", &error_icon);
-
-    LoadBitmap("progress_empty", &progressBarEmpty);
-    LoadBitmap("progress_fill", &progressBarFill);
-
-    LoadBitmap("stage_empty", &stageMarkerEmpty);
-    LoadBitmap("stage_fill", &stageMarkerFill);
-
     // Background text for "installing_update" could be "installing update"
     // or "installing security update". It will be set after UI init according
     // to commands in BCB.
     installing_text = nullptr;
-    LoadLocalizedBitmap("erasing_text", &erasing_text);
-    LoadLocalizedBitmap("no_command_text", &no_command_text);
-    LoadLocalizedBitmap("error_text", &error_text);
-
-    LoadAnimation();
 
+    // The images are independent of each other, so decode them in
+    // parallel.  The slowest (the animation and the tall multi-locale text
+    // images) go first.
+    double load_start = now();
+    RunInParallel({
+        [this]() { LoadAnimation(); },
+        [this]() { LoadLocalizedBitmap("no_command_text", &no_command_text); },
+        [this]() { LoadLocalizedBitmap("erasing_text", &erasing_text); },
+        [this]() { LoadLocalizedBitmap("error_text", &error_text); },
+        [this]() { LoadBitmap("icon_error", &error_icon); },
+        [this]() { LoadBitmap("progress_empty", &progressBarEmpty); },
+        [this]() { LoadBitmap("progress_fill", &progressBarFill); },
+        [this]() { LoadBitmap("stage_empty", &stageMarkerEmpty); },
+        [this]() { LoadBitmap("stage_fill", &stageMarkerFill); },
+    });
+    printf("UI images loaded in %.3f s (%.3f s after UI init)\n",
+           now() - load_start, now() - init_time_);
+
+    pthread_create(&animation_thread_, nullptr, AnimationThreadStartRoutine, this);
     pthread_create(&progress_thread_, nullptr, ProgressThreadStartRoutine, this);
 
     return true;
@@ -528,14 +648,63 @@ void ScreenRecoveryUI::LoadAnimation() {
     std::sort(intro_frame_names.begin(), intro_frame_names.end());
     std::sort(loop_frame_names.begin(), loop_frame_names.end());
 
-    introFrames = new GRSurface*[intro_frames];
-    for (size_t i = 0; i < intro_frames; i++) {
-        LoadBitmap(intro_frame_names.at(i).c_str(), &introFrames[i]);
-    }
+    frame_names_ = intro_frame_names;
+    frame_names_.insert(frame_names_.end(), loop_frame_names.begin(), loop_frame_names.end());
+    frames_.assign(frame_names_.size(), nullptr);
+    frame_failed_.assign(frame_names_.size(), false);
+
+    // Only the first frame is decoded now, for its size; the animation
+    // thread decodes the rest as they're needed.
+    LoadBitmap(frame_names_[0].c_str(), &frames_[0]);
+    frame_failed_[0] = (frames_[0] == nullptr);
+    frame_height_ = gr_get_height(frames_[0]);
+}
+
+void* ScreenRecoveryUI::AnimationThreadStartRoutine(void* data) {
+    reinterpret_cast<ScreenRecoveryUI*>(data)->AnimationThreadLoop();
+    return nullptr;
+}
+
+// Keeps the frames about to be drawn decoded, one at a time and outside
+// updateMutex, and frees the ones that have been left behind.
+void ScreenRecoveryUI::AnimationThreadLoop() {
+    pthread_mutex_lock(&updateMutex);
+    while (true) {
+        std::vector<bool> wanted(frames_.size(), false);
+        size_t missing = frames_.size();
+        size_t index = CurrentFrameIndex();
+        for (size_t i = 0; i < kAnimationCacheFrames && !wanted[index]; ++i) {
+            wanted[index] = true;
+            if (frames_[index] == nullptr && !frame_failed_[index] && missing == frames_.size()) {
+                missing = index;
+            }
+            index = NextFrameIndex(index);
+        }
+        // Still on the screen until the next frame is ready.
+        wanted[shown_frame_] = true;
+        for (size_t i = 0; i < frames_.size(); ++i) {
+            if (!wanted[i] && frames_[i] != nullptr) {
+                res_free_surface(frames_[i]);
+                frames_[i] = nullptr;
+            }
+        }
 
-    loopFrames = new GRSurface*[loop_frames];
-    for (size_t i = 0; i < loop_frames; i++) {
-        LoadBitmap(loop_frame_names.at(i).c_str(), &loopFrames[i]);
+        if (missing == frames_.size()) {
+            pthread_cond_wait(&animation_cond_, &updateMutex);
+            continue;
+        }
+
+        std::string name = frame_names_[missing];
+        pthread_mutex_unlock(&updateMutex);
+        GRSurface* surface = nullptr;
+        LoadBitmap(name.c_str(), &surface);
+        pthread_mutex_lock(&updateMutex);
+
+        if (surface == nullptr) {
+            frame_failed_[missing] = true;
+        } else {
+            frames_[missing] = surface;
+        }
     }
 }
 
@@ -629,6 +798,7 @@ void ScreenRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap)
     }
 
     pthread_mutex_lock(&updateMutex);
+    ++prints_received_;
     if (text_rows_ > 0 && text_cols_ > 0) {
         for (const char* ptr = str.c_str(); *ptr != '\0'; ++ptr) {
             if (*ptr == '\n' || text_col_ >= text_cols_) {
@@ -636,11 +806,14 @@ void ScreenRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap)
                 text_col_ = 0;
                 text_row_ = (text_row_ + 1) % text_rows_;
                 if (text_row_ == text_top_) text_top_ = (text_top_ + 1) % text_rows_;
+                ++log_scrolled_;
             }
             if (*ptr != '\n') text_[text_row_][text_col_++] = *ptr;
         }
         text_[text_row_][text_col_] = '\0';
-        update_screen_locked();
+        // Don't hold up the caller with drawing: the progress thread puts
+        // the new text on the screen with its next frame.
+        log_dirty_ = true;
     }
     pthread_mutex_unlock(&updateMutex);
 }
@@ -661,6 +834,7 @@ void ScreenRecoveryUI::PrintOnScreenOnly(const char *fmt, ...) {
 
 void ScreenRecoveryUI::PutChar(char ch) {
     pthread_mutex_lock(&updateMutex);
+    log_valid_ = false;
     if (ch != '\n') text_[text_row_][text_col_++] = ch;
     if (ch == '\n' || text_col_ >= text_cols_) {
         text_col_ = 0;
@@ -673,6 +847,7 @@ void ScreenRecoveryUI::PutChar(char ch) {
 
 void ScreenRecoveryUI::ClearText() {
     pthread_mutex_lock(&updateMutex);
+    log_valid_ = false;
     text_col_ = 0;
     text_row_ = 0;
     text_top_ = 1;
@@ -755,6 +930,7 @@ void ScreenRecoveryUI::ShowFile(const char* filename) {
     text_col_ = old_text_col;
     text_row_ = old_text_row;
     text_top_ = old_text_top;
+    log_valid_ = false;
 }
 
 void ScreenRecoveryUI::StartMenu(const char* const * headers, const char* const * items,
@@ -829,6 +1005,30 @@ void ScreenRecoveryUI::Redraw() {
     pthread_mutex_unlock(&updateMutex);
 }
 
+size_t ScreenRecoveryUI::GetPrintCount() {
+    pthread_mutex_lock(&updateMutex);
+    size_t count = prints_received_;
+    pthread_mutex_unlock(&updateMutex);
+    return count;
+}
+
+size_t ScreenRecoveryUI::GetAnimationMemory() {
+    pthread_mutex_lock(&updateMutex);
+    size_t bytes = 0;
+    for (GRSurface* frame : frames_) {
+        if (frame != nullptr) bytes += frame->height * frame->row_bytes;
+    }
+    pthread_mutex_unlock(&updateMutex);
+    return bytes;
+}
+
+size_t ScreenRecoveryUI::GetFrameCount() {
+    pthread_mutex_lock(&updateMutex);
+    size_t count = frames_rendered_;
+    pthread_mutex_unlock(&updateMutex);
+    return count;
+}
+
 void ScreenRecoveryUI::KeyLongPress(int) {
     // Redraw so that if we're in the menu, the highlight
     // will change color to indicate a successful long press.
@@ -20,6 +20,9 @@
 #include <pthread.h>
 #include <stdio.h>
 
+#include <string>
+#include <vector>
+
 #include "ui.h"
 #include "minui/minui.h"
 
@@ -63,6 +66,14 @@ class ScreenRecoveryUI : public RecoveryUI {
 
     void Redraw();
 
+    // Print() only records the text; the screen catches up on its next
+    // frame.  These count how many of each there have been.
+    size_t GetPrintCount();
+    size_t GetFrameCount();
+
+    // Bytes of decoded animation frames currently held in memory.
+    size_t GetAnimationMemory();
+
     enum UIElement {
         HEADER, MENU, MENU_SEL_BG, MENU_SEL_BG_ACTIVE, MENU_SEL_FG, LOG, TEXT_FILL, INFO
     };
@@ -85,8 +96,20 @@ class ScreenRecoveryUI : public RecoveryUI {
     GRSurface* installing_text;
     GRSurface* no_command_text;
 
-    GRSurface** introFrames;
-    GRSurface** loopFrames;
+    // The animation's intro frames followed by its loop frames.  Only the
+    // frames about to be shown are kept decoded (the rest are nullptr);
+    // the animation thread decodes them ahead of time.  Frames that failed
+    // to decode aren't tried again.
+    std::vector<std::string> frame_names_;
+    std::vector<GRSurface*> frames_;
+    std::vector<bool> frame_failed_;
+    // The frame the animation is at, as an index into frames_.
+    size_t drawn_frame_;
+    // The frame actually on the screen.  It stays behind drawn_frame_
+    // while the animation thread catches up, and is kept decoded.
+    size_t shown_frame_;
+    // All the frames are the same size.
+    int frame_height_;
 
     GRSurface* progressBarEmpty;
     GRSurface* progressBarFill;
@@ -107,6 +130,19 @@ class ScreenRecoveryUI : public RecoveryUI {
     char** text_;
     size_t text_col_, text_row_, text_top_;
 
+    // Where the log is on the screen, so that new lines can be scrolled
+    // in without redrawing the rest.  Only meaningful while log_valid_.
+    bool log_valid_;
+    int log_top_;
+    size_t log_rows_;
+    // Lines added since the log was last drawn.
+    size_t log_scrolled_;
+    // Text has been added since the log was last drawn.
+    bool log_dirty_;
+
+    size_t prints_received_;
+    size_t frames_rendered_;
+
     bool show_text;
     bool show_text_ever;   // has show_text ever been true?
 
@@ -119,6 +155,13 @@ class ScreenRecoveryUI : public RecoveryUI {
     char** file_viewer_text_;
 
     pthread_t progress_thread_;
+    pthread_t animation_thread_;
+    // Signalled when the animation moves on to another frame.
+    pthread_cond_t animation_cond_;
+
+    // When Init() started, for reporting the time to the first frame.
+    double init_time_;
+    bool first_frame_drawn_;
 
     // Number of intro frames and loop frames in the animation.
     size_t intro_frames;
@@ -143,6 +186,7 @@ class ScreenRecoveryUI : public RecoveryUI {
     virtual void draw_foreground_locked();
     virtual void draw_screen_locked();
     virtual void update_screen_locked();
+    virtual void update_log_locked();
     virtual void update_progress_locked();
 
     GRSurface* GetCurrentFrame();
@@ -151,6 +195,11 @@ class ScreenRecoveryUI : public RecoveryUI {
     static void* ProgressThreadStartRoutine(void* data);
     void ProgressThreadLoop();
 
+    size_t CurrentFrameIndex();
+    size_t NextFrameIndex(size_t index);
+    static void* AnimationThreadStartRoutine(void* data);
+    void AnimationThreadLoop();
+
     virtual void ShowFile(FILE*);
     virtual void PrintV(const char*, bool, va_list);
     void PutChar(char);
@@ -168,6 +217,7 @@ class ScreenRecoveryUI : public RecoveryUI {
     void DrawHorizontalRule(int* y);
     void DrawTextLine(int x, int* y, const char* line, bool bold);
     void DrawTextLines(int x, int* y, const char* const* lines);
+    size_t draw_log_locked(int top, size_t count, bool erase);
 };
 
 #endif  // RECOVERY_UI_H
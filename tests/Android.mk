@@ -25,17 +25,25 @@ LOCAL_STATIC_LIBRARIES := \
     libverifier \
     libminui \
     libotautil \
+    libupdate_verifier \
     libziparchive \
     libutils \
     libz \
     libselinux \
+    libcrypto \
+    libcutils \
     libbase
 
 LOCAL_SRC_FILES := \
     unit/asn1_decoder_test.cpp \
+    unit/blend_test.cpp \
     unit/dirutil_test.cpp \
+    unit/glyph_cache_test.cpp \
+    unit/graphics_test.cpp \
     unit/locale_test.cpp \
+    unit/status_channel_test.cpp \
     unit/sysutil_test.cpp \
+    unit/update_verifier_test.cpp \
     unit/zip_test.cpp \
     unit/ziputil_test.cpp
 
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTA_TEST_RANDOM_PIXELS_H
+#define _OTA_TEST_RANDOM_PIXELS_H
+
+#include <stddef.h>
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// Base fixture for the minui tests that compare drawing code against a
+// reference on random pixels.  The generator is seeded, so a failure
+// reproduces.
+class RandomPixelsTest : public ::testing::Test {
+  protected:
+    std::vector<unsigned char> RandomBytes(size_t size) {
+        std::vector<unsigned char> bytes(size);
+        for (auto& b : bytes) {
+            b = rng_() % 256;
+        }
+        return bytes;
+    }
+
+    // A mask that is mostly 0 and 255 with some edges, like font glyphs.
+    // 'zeros' out of every four bytes are 0 on average, and one is 255.
+    std::vector<unsigned char> RandomMask(size_t size, int zeros = 1) {
+        std::vector<unsigned char> mask(size);
+        for (auto& m : mask) {
+            int kind = rng_() % 4;
+            m = (kind < zeros) ? 0 : (kind == zeros) ? 255 : rng_() % 256;
+        }
+        return mask;
+    }
+
+    std::mt19937 rng_{ 2016 };
+};
+
+#endif  // _OTA_TEST_RANDOM_PIXELS_H
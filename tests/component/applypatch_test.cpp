@@ -244,6 +244,28 @@ TEST_F(ApplyPatchTest, CheckModeEmmcTarget) {
   ASSERT_EQ(0, applypatch_check(src_file.c_str(), sha1s));
 }
 
+TEST_F(ApplyPatchTest, LoadFileSha1EmmcPrefix) {
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(old_file, &data));
+  size_t prefix_size = old_size / 2;
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(data.c_str()), prefix_size, digest);
+  std::string prefix_sha1 = print_sha1(digest);
+
+  // The smallest matching candidate wins, and only its prefix is hashed.
+  std::string src_file = "EMMC:" + old_file + ":" +
+                         std::to_string(old_size) + ":" + old_sha1 + ":" +
+                         std::to_string(prefix_size - 1) + ":" + prefix_sha1 + ":" +
+                         std::to_string(prefix_size) + ":" + prefix_sha1;
+  uint8_t sha1[SHA_DIGEST_LENGTH];
+  ASSERT_EQ(0, LoadFileSha1(src_file.c_str(), sha1));
+  ASSERT_EQ(prefix_sha1, print_sha1(sha1));
+
+  // Regular files are hashed as a whole.
+  ASSERT_EQ(0, LoadFileSha1(old_file.c_str(), sha1));
+  ASSERT_EQ(old_sha1, print_sha1(sha1));
+}
+
 TEST_F(ApplyPatchCacheTest, CheckCacheCorruptedSingle) {
   mangle_file(old_file);
   std::vector<std::string> sha1s = { old_sha1 };
@@ -340,6 +362,28 @@ TEST_F(ApplyPatchDoubleCacheTest, ApplyDoubleCorruptedInNewLocation) {
   ASSERT_FALSE(file_cmp(output_loc, new_file));
 }
 
+TEST_F(ApplyPatchFullTest, ApplyCorruptedEmmcInPlaceKeepsCopy) {
+  std::vector<std::string> sha1s = { bad_sha1_a, old_sha1 };
+
+  // A partition that is both source and target, and no longer holds the source.
+  TemporaryFile partition;
+  cp(old_file, partition.path);
+  mangle_file(partition.path);
+  std::string src_file =
+      "EMMC:" + std::string(partition.path) + ":" + std::to_string(old_size) + ":" + old_sha1;
+  std::string tgt_file = "EMMC:" + std::string(partition.path);
+
+  // Patching from the copy in cache doesn't produce the expected SHA-1, after the partition has
+  // been written. The copy must still be there for the next attempt.
+  ASSERT_NE(0, applypatch(&src_file[0], &tgt_file[0], &bad_sha1_b[0], new_size, sha1s, patches,
+                          nullptr));
+  ASSERT_TRUE(file_cmp(cache_file, old_file));
+
+  ASSERT_EQ(0, applypatch(&src_file[0], &tgt_file[0], &new_sha1[0], new_size, sha1s, patches,
+                          nullptr));
+  ASSERT_TRUE(file_cmp(partition.path, new_file));
+}
+
 TEST(ApplyPatchModesTest, InvalidArgs) {
   // At least two args (including the filename).
   ASSERT_EQ(2, applypatch_modes(1, (const char* []){ "applypatch" }));
@@ -412,6 +456,50 @@ TEST(ApplyPatchModesTest, PatchMode) {
   ASSERT_EQ(0, applypatch_modes(args3.size(), args3.data()));
 }
 
+TEST(ApplyPatchModesTest, BatchMode) {
+  std::string boot_img = from_testdata_base("boot.img");
+  size_t boot_img_size;
+  std::string boot_img_sha1;
+  sha1sum(boot_img, &boot_img_sha1, &boot_img_size);
+
+  std::string recovery_img = from_testdata_base("recovery.img");
+  std::string recovery_img_sha1;
+  size_t size;
+  sha1sum(recovery_img, &recovery_img_sha1, &size);
+  std::string recovery_img_size = std::to_string(size);
+
+  // <src-file> <tgt-file> <tgt-sha1> <tgt-size> <src-sha1>:<patch>, for a few targets.
+  TemporaryFile tmp1;
+  TemporaryFile tmp2;
+  TemporaryFile tmp3;
+  std::string manifest = "# comment\n\n";
+  for (const char* target : { tmp1.path, tmp2.path, tmp3.path }) {
+    manifest += boot_img + " " + target + " " + recovery_img_sha1 + " " + recovery_img_size +
+                " " + boot_img_sha1 + ":" + from_testdata_base("recovery-from-boot-with-bonus.p") +
+                "\n";
+  }
+  TemporaryFile manifest_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(manifest, manifest_file.path));
+  ASSERT_EQ(0, applypatch_modes(3, (const char* []){ "applypatch", "-m", manifest_file.path }));
+  for (const char* target : { tmp1.path, tmp2.path, tmp3.path }) {
+    std::string target_sha1;
+    sha1sum(target, &target_sha1);
+    ASSERT_EQ(recovery_img_sha1, target_sha1);
+  }
+
+  // Running it again finds all the targets already patched.
+  ASSERT_EQ(0, applypatch_modes(3, (const char* []){ "applypatch", "-m", manifest_file.path }));
+
+  // A line with a bad sha1 fails to parse.
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      boot_img + " - xyz " + recovery_img_size + " " + boot_img_sha1 + ":" + boot_img + "\n",
+      manifest_file.path));
+  ASSERT_EQ(1, applypatch_modes(3, (const char* []){ "applypatch", "-m", manifest_file.path }));
+
+  // Insufficient args.
+  ASSERT_EQ(2, applypatch_modes(2, (const char* []){ "applypatch", "-m" }));
+}
+
 TEST(ApplyPatchModesTest, PatchModeEmmcTarget) {
   std::string boot_img = from_testdata_base("boot.img");
   size_t boot_img_size;
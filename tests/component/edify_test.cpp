@@ -14,19 +14,30 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
+
+#include <chrono>
+#include <memory>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include <android-base/stringprintf.h>
 #include <gtest/gtest.h>
 
 #include "edify/expr.h"
 
 static void expect(const char* expr_str, const char* expected) {
+    ExprArena arena;
     Expr* e;
     int error_count = 0;
-    EXPECT_EQ(0, parse_string(expr_str, &e, &error_count));
+    EXPECT_EQ(0, parse_string(expr_str, &e, &error_count, &arena));
     EXPECT_EQ(0, error_count);
 
-    State state(expr_str, nullptr);
+    // State keeps a reference to the script, so it must not be a temporary.
+    std::string script(expr_str);
+    State state(script, nullptr);
 
     std::string result;
     bool status = Evaluate(&state, e, &result);
@@ -36,7 +47,6 @@ static void expect(const char* expr_str, const char* expected) {
     } else {
         EXPECT_STREQ(expected, result.c_str());
     }
-
 }
 
 class EdifyTest : public ::testing::Test {
@@ -152,18 +162,173 @@ TEST_F(EdifyTest, big_string) {
 TEST_F(EdifyTest, unknown_function) {
     // unknown function
     const char* script1 = "unknown_function()";
+    ExprArena arena;
     Expr* expr;
     int error_count = 0;
-    EXPECT_EQ(1, parse_string(script1, &expr, &error_count));
+    EXPECT_EQ(1, parse_string(script1, &expr, &error_count, &arena));
     EXPECT_EQ(1, error_count);
 
     const char* script2 = "abc; unknown_function()";
     error_count = 0;
-    EXPECT_EQ(1, parse_string(script2, &expr, &error_count));
+    EXPECT_EQ(1, parse_string(script2, &expr, &error_count, &arena));
     EXPECT_EQ(1, error_count);
 
     const char* script3 = "unknown_function1() || yes";
     error_count = 0;
-    EXPECT_EQ(1, parse_string(script3, &expr, &error_count));
+    EXPECT_EQ(1, parse_string(script3, &expr, &error_count, &arena));
     EXPECT_EQ(1, error_count);
 }
+
+TEST_F(EdifyTest, function_lookup) {
+    // The function table is shared by the whole test binary, so take the
+    // test names out again however this test ends.
+    struct TestFunctions {
+        ~TestFunctions() {
+            for (int i = 0; i < 300; ++i) {
+                UnregisterFunction(android::base::StringPrintf("test_fn_%d", i));
+            }
+        }
+    } test_functions;
+
+    // Registering more names rebuilds the index; every name must still
+    // resolve, and lookups of unregistered names must fail.
+    for (int i = 0; i < 300; ++i) {
+        RegisterFunction(android::base::StringPrintf("test_fn_%d", i), Literal);
+    }
+    for (int i = 0; i < 300; ++i) {
+        ASSERT_EQ(Literal, FindFunction(android::base::StringPrintf("test_fn_%d", i)));
+    }
+    ASSERT_EQ(IfElseFn, FindFunction("ifelse"));
+    ASSERT_EQ(AssertFn, FindFunction("assert"));
+    ASSERT_EQ(nullptr, FindFunction("test_fn_300"));
+    ASSERT_EQ(nullptr, FindFunction(""));
+    ASSERT_EQ(nullptr, FindFunction("ifelse2"));
+
+    RegisterFunction("test_fn_0", AbortFn);
+    ASSERT_EQ(AbortFn, FindFunction("test_fn_0"));
+
+    UnregisterFunction("test_fn_0");
+    ASSERT_EQ(nullptr, FindFunction("test_fn_0"));
+    ASSERT_EQ(Literal, FindFunction("test_fn_1"));
+    ASSERT_EQ(IfElseFn, FindFunction("ifelse"));
+}
+
+TEST_F(EdifyTest, big_script_parse) {
+    // A few megabytes of calls with long argument lists, all allocated from
+    // one arena.
+    std::string script;
+    for (int i = 0; i < 20000; ++i) {
+        script += android::base::StringPrintf(
+            "ifelse(is_substring(\"build%d\", concat(a, b, c, d, e, f, g, h, i, \"build%d\")), "
+            "\"ok\", abort(\"E3004: wrong build %d\"));\n",
+            i, i, i);
+    }
+    script += "done";
+
+    auto start = std::chrono::steady_clock::now();
+    ExprArena arena;
+    Expr* e;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(script.c_str(), &e, &error_count, &arena));
+    ASSERT_EQ(0, error_count);
+    std::chrono::duration<double> parse = std::chrono::steady_clock::now() - start;
+
+    State state(script, nullptr);
+    std::string result;
+    ASSERT_TRUE(Evaluate(&state, e, &result));
+    ASSERT_EQ("done", result);
+
+    printf("parsed %zu-byte script in %.3f ms into %zu arena bytes\n", script.size(),
+           parse.count() * 1000, arena.allocated());
+}
+
+TEST_F(EdifyTest, parallel) {
+    expect("parallel()", "");
+    expect("parallel(a)", "a");
+    expect("parallel(a, b + c, concat(d, e))", "de");
+    expect("parallel(a == a, parallel(b, c)) + d", "cd");
+    expect("parallel(a, abort(), c)", nullptr);
+
+    // Every branch runs, and the error of the first failing one in argument
+    // order is reported regardless of which finished first.
+    std::string script = "parallel(t, concat(x), abort(\"first\"), abort(\"second\"))";
+    ExprArena arena;
+    Expr* e;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(script.c_str(), &e, &error_count, &arena));
+    for (int i = 0; i < 20; ++i) {
+        State state(script, nullptr);
+        std::string result;
+        ASSERT_FALSE(Evaluate(&state, e, &result));
+        ASSERT_EQ("first", state.errmsg);
+    }
+}
+
+TEST_F(EdifyTest, value_pool) {
+    // A freed Value's slot is what the next allocation on the thread gets.
+    Value* v = StringValue("a");
+    void* slot = v;
+    delete v;
+    std::unique_ptr<Value> reused(StringValue("b"));
+    ASSERT_EQ(slot, reused.get());
+
+    // Values freed by a thread that then exits are reused by the others.
+    std::vector<Value*> values;
+    std::set<void*> freed;
+    for (int i = 0; i < 200; ++i) {
+        values.push_back(StringValue("x"));
+        freed.insert(values.back());
+    }
+    std::thread([&values]() {
+        for (Value* value : values) {
+            delete value;
+        }
+    }).join();
+    values.clear();
+    for (int i = 0; i < 400; ++i) {
+        values.push_back(StringValue("y"));
+        freed.erase(values.back());
+    }
+    ASSERT_TRUE(freed.empty());
+    for (Value* value : values) {
+        delete value;
+    }
+}
+
+// The buffer of the last string big_value() returned.
+static const char* big_value_data = nullptr;
+
+static Value* BigValueFn(const char* name, State* state, int argc, Expr* argv[]) {
+    Value* v = StringValue(std::string(4096, 'x'));
+    big_value_data = v->data.data();
+    return v;
+}
+
+TEST_F(EdifyTest, moved_results) {
+    RegisterFunction("big_value", BigValueFn);
+    struct TestFunctions {
+        ~TestFunctions() {
+            UnregisterFunction("big_value");
+        }
+    } test_functions;
+
+    // A result passed up through the operators keeps its buffer all the way
+    // to the caller, rather than being copied at each level.
+    for (const char* script : { "big_value()", "a; big_value()", "ifelse(t, big_value(), b)",
+                                "concat(big_value())", "concat(big_value(), \"\")",
+                                "parallel(a, big_value())" }) {
+        ExprArena arena;
+        Expr* e;
+        int error_count = 0;
+        ASSERT_EQ(0, parse_string(script, &e, &error_count, &arena)) << script;
+
+        // State keeps a reference to the script, so it must not be a temporary.
+        std::string script_str(script);
+        State state(script_str, nullptr);
+        std::string result;
+        ASSERT_TRUE(Evaluate(&state, e, &result)) << script;
+        ASSERT_EQ(4096U, result.size()) << script;
+        ASSERT_EQ(big_value_data, result.data()) << script;
+    }
+}
+
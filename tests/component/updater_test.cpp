@@ -14,22 +14,27 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/properties.h>
 #include <android-base/test_utils.h>
 #include <bootloader_message/bootloader_message.h>
 #include <gtest/gtest.h>
+#include <openssl/sha.h>
 #include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
 
 #include "common/test_constants.h"
 #include "edify/expr.h"
 #include "error_code.h"
+#include "print_sha1.h"
 #include "updater/install.h"
 #include "updater/updater.h"
 
@@ -37,12 +42,15 @@ struct selabel_handle *sehandle = nullptr;
 
 static void expect(const char* expected, const char* expr_str, CauseCode cause_code,
                    UpdaterInfo* info = nullptr) {
+  ExprArena arena;
   Expr* e;
   int error_count = 0;
-  ASSERT_EQ(0, parse_string(expr_str, &e, &error_count));
+  ASSERT_EQ(0, parse_string(expr_str, &e, &error_count, &arena));
   ASSERT_EQ(0, error_count);
 
-  State state(expr_str, info);
+  // State keeps a reference to the script, so it must not be a temporary.
+  std::string script(expr_str);
+  State state(script, info);
 
   std::string result;
   bool status = Evaluate(&state, e, &result);
@@ -110,6 +118,85 @@ TEST_F(UpdaterTest, sha1_check) {
     expect(nullptr, "sha1_check()", kArgsParsingFailure);
 }
 
+TEST_F(UpdaterTest, hash_file) {
+    TemporaryFile temp_file;
+    ASSERT_TRUE(android::base::WriteStringToFile("abcd", temp_file.path));
+    std::string path(temp_file.path);
+
+    // hash_file(filename, algorithm) returns the digest of the file.
+    expect("81fe8bfe87576c3ecb22426f8e57847382917acf",
+           ("hash_file(\"" + path + "\", \"sha1\")").c_str(), kNoCause);
+    expect("88d4266fd4e6338d13b845fcf289579d209c897823b9217da3e161936f031589",
+           ("hash_file(\"" + path + "\", \"sha256\")").c_str(), kNoCause);
+
+    // "EMMC:" targets may limit the number of bytes to hash.
+    expect("da23614e02469a0d7c7bd1bdab5c9c474b1904dc",
+           ("hash_file(\"EMMC:" + path + ":2\", \"sha1\")").c_str(), kNoCause);
+    expect("81fe8bfe87576c3ecb22426f8e57847382917acf",
+           ("hash_file(\"EMMC:" + path + "\", \"sha1\")").c_str(), kNoCause);
+    // Or fail if the target is shorter than that.
+    expect("", ("hash_file(\"EMMC:" + path + ":5\", \"sha1\")").c_str(), kNoCause);
+
+    // hash_file(filename, algorithm, digest, ...) returns the matched digest, or "".
+    expect("81FE8BFE87576C3ECB22426F8E57847382917ACF",
+           ("hash_file(\"" + path + "\", \"sha1\", \"wrong_sha1\", " +
+            "\"81FE8BFE87576C3ECB22426F8E57847382917ACF\")").c_str(),
+           kNoCause);
+    expect("", ("hash_file(\"" + path + "\", \"sha1\", \"wrong_sha1\")").c_str(), kNoCause);
+
+    // Missing files and unknown algorithms.
+    expect("", "hash_file(\"/doesntexist\", \"sha1\")", kNoCause);
+    expect(nullptr, ("hash_file(\"" + path + "\", \"md5\")").c_str(), kArgsParsingFailure);
+    expect(nullptr, "hash_file(\"/doesntexist\")", kArgsParsingFailure);
+}
+
+// Returns the peak resident set size of this process in KiB, or 0 if unknown.
+static size_t GetPeakRssKb() {
+    std::string status;
+    if (!android::base::ReadFileToString("/proc/self/status", &status)) {
+        return 0;
+    }
+    size_t pos = status.find("VmHWM:");
+    return pos == std::string::npos ? 0 : strtoul(status.c_str() + pos + 6, nullptr, 10);
+}
+
+TEST_F(UpdaterTest, hash_file_peak_rss) {
+    // Resetting the peak RSS needs a 4.0+ kernel.
+    if (!android::base::WriteStringToFile("5", "/proc/self/clear_refs")) {
+        GTEST_LOG_(INFO) << "Can't reset peak RSS; skipping";
+        return;
+    }
+
+    std::string data(64 * 1024 * 1024, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = i % 251;
+    }
+    TemporaryFile temp_file;
+    ASSERT_TRUE(android::base::WriteStringToFile(data, temp_file.path));
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+    std::string sha1 = print_sha1(digest);
+    data.clear();
+    data.shrink_to_fit();
+    std::string path(temp_file.path);
+
+    ASSERT_TRUE(android::base::WriteStringToFile("5", "/proc/self/clear_refs"));
+    size_t base_kb = GetPeakRssKb();
+    expect(sha1.c_str(), ("sha1_check(read_file(\"" + path + "\"))").c_str(), kNoCause);
+    size_t read_file_kb = GetPeakRssKb() - base_kb;
+
+    ASSERT_TRUE(android::base::WriteStringToFile("5", "/proc/self/clear_refs"));
+    base_kb = GetPeakRssKb();
+    expect(sha1.c_str(), ("hash_file(\"" + path + "\", \"sha1\")").c_str(), kNoCause);
+    size_t hash_file_kb = GetPeakRssKb() - base_kb;
+
+    GTEST_LOG_(INFO) << "Peak RSS growth: read_file " << read_file_kb << " KiB, hash_file "
+                     << hash_file_kb << " KiB";
+    // read_file() holds the whole file, while hash_file() only needs its buffer.
+    ASSERT_GE(read_file_kb, 64u * 1024);
+    ASSERT_LT(hash_file_kb, 8u * 1024);
+}
+
 TEST_F(UpdaterTest, file_getprop) {
     // file_getprop() expects two arguments.
     expect(nullptr, "file_getprop()", kArgsParsingFailure);
@@ -271,6 +358,59 @@ TEST_F(UpdaterTest, symlink) {
     ASSERT_EQ(0, unlink(src2.c_str()));
 }
 
+TEST_F(UpdaterTest, set_metadata_recursive) {
+    // set_metadata_recursive expects an odd number of arguments.
+    expect(nullptr, "set_metadata_recursive()", kArgsParsingFailure);
+    expect(nullptr, "set_metadata_recursive(\"/system\", \"mode\")", kArgsParsingFailure);
+
+    // Target doesn't exist.
+    expect(nullptr, "set_metadata_recursive(\"/doesntexist\", \"mode\", \"0644\")",
+           kSetMetadataFailure);
+
+    // Build a tree with enough files to be spread across the workers.
+    TemporaryDir td;
+    std::string root = std::string(td.path) + "/root";
+    std::vector<std::string> dirs = { root, root + "/a", root + "/a/b", root + "/c" };
+    for (const auto& dir : dirs) {
+        ASSERT_EQ(0, mkdir(dir.c_str(), 0700));
+    }
+    std::vector<std::string> files;
+    for (const auto& dir : dirs) {
+        for (int i = 0; i < 64; ++i) {
+            std::string file = dir + "/file" + std::to_string(i);
+            ASSERT_TRUE(android::base::WriteStringToFile("abc", file));
+            ASSERT_EQ(0, chmod(file.c_str(), 0600));
+            files.push_back(file);
+        }
+    }
+    std::string link = root + "/a/link";
+    ASSERT_EQ(0, symlink(files[0].c_str(), link.c_str()));
+
+    std::string script("set_metadata_recursive(\"" + root + "\", \"dmode\", \"0750\", " +
+                       "\"fmode\", \"0640\")");
+    expect("", script.c_str(), kNoCause);
+
+    struct stat sb;
+    for (const auto& dir : dirs) {
+        ASSERT_EQ(0, stat(dir.c_str(), &sb));
+        ASSERT_EQ(static_cast<mode_t>(0750), sb.st_mode & 07777);
+    }
+    for (const auto& file : files) {
+        ASSERT_EQ(0, stat(file.c_str(), &sb));
+        ASSERT_EQ(static_cast<mode_t>(0640), sb.st_mode & 07777);
+    }
+    ASSERT_TRUE(lstat(link.c_str(), &sb) == 0 && S_ISLNK(sb.st_mode));
+
+    // Clean up the leftovers.
+    ASSERT_EQ(0, unlink(link.c_str()));
+    for (const auto& file : files) {
+        ASSERT_EQ(0, unlink(file.c_str()));
+    }
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+        ASSERT_EQ(0, rmdir(it->c_str()));
+    }
+}
+
 TEST_F(UpdaterTest, package_extract_dir) {
   // package_extract_dir expects 2 arguments.
   expect(nullptr, "package_extract_dir()", kArgsParsingFailure);
@@ -510,3 +650,89 @@ TEST_F(UpdaterTest, set_stage) {
   script = "set_stage(\"/dev/full\", \"1/3\")";
   expect("", script.c_str(), kNoCause);
 }
+
+TEST_F(UpdaterTest, apply_patch_batch) {
+  // apply_patch_batch expects 1 argument.
+  expect(nullptr, "apply_patch_batch()", kArgsParsingFailure);
+  expect(nullptr, "apply_patch_batch(\"arg1\", \"arg2\")", kArgsParsingFailure);
+
+  std::string old_data, new_data, patch_data;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("old.file"), &old_data));
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("new.file"), &new_data));
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("patch.bsdiff"), &patch_data));
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(old_data.c_str()), old_data.size(), digest);
+  std::string old_sha1 = print_sha1(digest);
+  SHA1(reinterpret_cast<const uint8_t*>(new_data.c_str()), new_data.size(), digest);
+  std::string new_sha1 = print_sha1(digest);
+
+  // A package with the patch in it.
+  TemporaryFile zip_file;
+  FILE* zip_fp = fdopen(zip_file.fd, "w");
+  ZipWriter writer(zip_fp);
+  ASSERT_EQ(0, writer.StartEntry("patch.bsdiff", ZipWriter::kCompress));
+  ASSERT_EQ(0, writer.WriteBytes(patch_data.data(), patch_data.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(zip_fp));
+  zip_file.fd = -1;
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_file.path, &handle));
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+
+  auto manifest_line = [&](const std::string& source, const std::string& target,
+                           const std::string& patch) {
+    return source + " " + target + " " + new_sha1 + " " + std::to_string(new_data.size()) + " " +
+           old_sha1 + ":" + patch + "\\n";
+  };
+
+  // Two files patched in place and one into a new file share the patch; a
+  // partition always goes through the one-at-a-time fallback.
+  TemporaryDir td;
+  std::string dir(td.path);
+  std::vector<std::string> sources = { dir + "/a", dir + "/b", dir + "/c", dir + "/partition" };
+  for (const auto& source : sources) {
+    ASSERT_TRUE(android::base::WriteStringToFile(old_data, source));
+  }
+  std::string partition_target = dir + "/partition_new";
+  ASSERT_TRUE(android::base::WriteStringToFile("", partition_target));
+  std::string manifest = manifest_line(sources[0], "-", "patch.bsdiff") +
+                         manifest_line(sources[1], "-", "patch.bsdiff") +
+                         manifest_line(sources[2], dir + "/c_new", "patch.bsdiff") +
+                         manifest_line("EMMC:" + sources[3] + ":" + std::to_string(old_data.size()) +
+                                       ":" + old_sha1, "EMMC:" + partition_target, "patch.bsdiff");
+  std::string script("apply_patch_batch(\"" + manifest + "\")");
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string data;
+  for (const auto& target : { sources[0], sources[1], dir + "/c_new", partition_target }) {
+    ASSERT_TRUE(android::base::ReadFileToString(target, &data));
+    ASSERT_EQ(new_data, data) << target;
+  }
+
+  // Applying the same batch again finds the targets already patched.
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  // A patch that isn't in the package aborts the evaluation.
+  script = "apply_patch_batch(\"" + manifest_line(sources[2], "-", "doesntexist") + "\")";
+  expect(nullptr, script.c_str(), kPackageExtractFileFailure, &updater_info);
+
+  // A source that matches none of the patches fails in the worker pool and
+  // again in the fallback, which finds no copy of it in the cache either.
+  ASSERT_TRUE(android::base::WriteStringToFile("corrupted", sources[2]));
+  script = "apply_patch_batch(\"" + manifest_line(sources[2], "-", "patch.bsdiff") + "\")";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  // A target that is also the source of another file is rejected.
+  script = "apply_patch_batch(\"" + manifest_line(sources[0], sources[1], "patch.bsdiff") +
+           manifest_line(sources[1], dir + "/d", "patch.bsdiff") + "\")";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  for (const auto& file : { sources[0], sources[1], sources[2], sources[3], dir + "/c_new",
+                            partition_target }) {
+    ASSERT_EQ(0, unlink(file.c_str()));
+  }
+  CloseArchive(handle);
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/random_pixels.h"
+#include "minui/blend.h"
+
+// The per-pixel loops that text_blend() and gr_fill() used to run, with
+// real divisions.  Every kernel has to produce exactly these bytes.
+static void reference_mask(const unsigned char* src_p, int src_row_bytes,
+                           unsigned char* dst_p, int dst_row_bytes, int width, int height,
+                           unsigned char r, unsigned char g, unsigned char b, unsigned char ca) {
+    for (int j = 0; j < height; ++j) {
+        const unsigned char* sx = src_p;
+        unsigned char* px = dst_p;
+        for (int i = 0; i < width; ++i) {
+            unsigned char a = *sx++;
+            if (ca < 255) a = ((int)a * ca) / 255;
+            if (a == 255) {
+                *px++ = r;
+                *px++ = g;
+                *px++ = b;
+                px++;
+            } else if (a > 0) {
+                *px = (*px * (255-a) + r * a) / 255;
+                ++px;
+                *px = (*px * (255-a) + g * a) / 255;
+                ++px;
+                *px = (*px * (255-a) + b * a) / 255;
+                ++px;
+                ++px;
+            } else {
+                px += 4;
+            }
+        }
+        src_p += src_row_bytes;
+        dst_p += dst_row_bytes;
+    }
+}
+
+static void reference_fill(unsigned char* p, int row_bytes, int width, int height,
+                           unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    for (int y = 0; y < height; ++y) {
+        unsigned char* px = p;
+        for (int x = 0; x < width; ++x) {
+            if (a == 255) {
+                px[0] = r;
+                px[1] = g;
+                px[2] = b;
+            } else if (a > 0) {
+                px[0] = (px[0] * (255-a) + r * a) / 255;
+                px[1] = (px[1] * (255-a) + g * a) / 255;
+                px[2] = (px[2] * (255-a) + b * a) / 255;
+            }
+            px += 4;
+        }
+        p += row_bytes;
+    }
+}
+
+class BlendTest : public RandomPixelsTest {};
+
+static const unsigned char kAlphas[] = { 0, 1, 64, 127, 128, 200, 254, 255 };
+
+TEST_F(BlendTest, mask_matches_reference) {
+    // Odd widths and row strides exercise the tails after the vector loops.
+    for (int width = 1; width <= 37; ++width) {
+        int height = 3;
+        int src_row_bytes = width + 5;
+        int dst_row_bytes = width * 4 + 12;
+        std::vector<unsigned char> mask = RandomMask(src_row_bytes * height);
+        std::vector<unsigned char> dst = RandomBytes(dst_row_bytes * height);
+
+        for (unsigned char a : kAlphas) {
+            unsigned char r = rng_() % 256, g = rng_() % 256, b = rng_() % 256;
+            std::vector<unsigned char> expected = dst;
+            reference_mask(mask.data(), src_row_bytes, expected.data(), dst_row_bytes,
+                           width, height, r, g, b, a);
+
+            std::vector<unsigned char> actual = dst;
+            blend_mask(mask.data(), src_row_bytes, actual.data(), dst_row_bytes,
+                       width, height, r, g, b, a);
+            ASSERT_EQ(expected, actual) << "width " << width << " alpha " << int(a);
+
+            actual = dst;
+            blend_mask_generic(mask.data(), src_row_bytes, actual.data(), dst_row_bytes,
+                               width, height, r, g, b, a);
+            ASSERT_EQ(expected, actual) << "width " << width << " alpha " << int(a);
+        }
+    }
+}
+
+TEST_F(BlendTest, mask_exhaustive) {
+    // Every (dst, color, mask) byte combination, all in one 256-pixel row
+    // per mask value and color.
+    std::vector<unsigned char> dst(256 * 4);
+    for (int i = 0; i < 256; ++i) {
+        dst[i * 4] = dst[i * 4 + 1] = dst[i * 4 + 2] = i;
+        dst[i * 4 + 3] = 255 - i;
+    }
+    std::vector<unsigned char> mask(256);
+    for (int m = 0; m < 256; ++m) {
+        memset(mask.data(), m, mask.size());
+        for (int c = 0; c < 256; ++c) {
+            std::vector<unsigned char> expected = dst;
+            reference_mask(mask.data(), 256, expected.data(), 1024, 256, 1, c, 255 - c, c, 255);
+            std::vector<unsigned char> actual = dst;
+            blend_mask(mask.data(), 256, actual.data(), 1024, 256, 1, c, 255 - c, c, 255);
+            ASSERT_EQ(expected, actual) << "mask " << m << " color " << c;
+        }
+    }
+}
+
+TEST_F(BlendTest, fill_matches_reference) {
+    for (int width = 1; width <= 37; ++width) {
+        int height = 3;
+        int row_bytes = width * 4 + 8;
+        std::vector<unsigned char> dst = RandomBytes(row_bytes * height);
+
+        for (int a = 0; a < 256; ++a) {
+            unsigned char r = rng_() % 256, g = rng_() % 256, b = rng_() % 256;
+            std::vector<unsigned char> expected = dst;
+            reference_fill(expected.data(), row_bytes, width, height, r, g, b, a);
+
+            std::vector<unsigned char> actual = dst;
+            blend_fill(actual.data(), row_bytes, width, height, r, g, b, a);
+            ASSERT_EQ(expected, actual) << "width " << width << " alpha " << a;
+
+            actual = dst;
+            blend_fill_generic(actual.data(), row_bytes, width, height, r, g, b, a);
+            ASSERT_EQ(expected, actual) << "width " << width << " alpha " << a;
+        }
+    }
+}
+
+TEST_F(BlendTest, unaligned) {
+    // GRSurface rows are only guaranteed to be byte arrays.
+    std::vector<unsigned char> mask = RandomMask(64 + 1);
+    std::vector<unsigned char> dst = RandomBytes(64 * 4 + 3);
+    for (int offset = 0; offset < 4; ++offset) {
+        std::vector<unsigned char> expected = dst;
+        reference_mask(mask.data() + 1, 64, expected.data() + offset, 256, 61, 1, 10, 20, 30, 200);
+        std::vector<unsigned char> actual = dst;
+        blend_mask(mask.data() + 1, 64, actual.data() + offset, 256, 61, 1, 10, 20, 30, 200);
+        ASSERT_EQ(expected, actual);
+
+        expected = dst;
+        reference_fill(expected.data() + offset, 256, 61, 1, 10, 20, 30, 100);
+        actual = dst;
+        blend_fill(actual.data() + offset, 256, 61, 1, 10, 20, 30, 100);
+        ASSERT_EQ(expected, actual);
+    }
+}
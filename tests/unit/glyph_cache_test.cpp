@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/random_pixels.h"
+#include "minui/blend.h"
+#include "minui/glyph_cache.h"
+
+class GlyphCacheTest : public RandomPixelsTest {
+  protected:
+    void SetUp() override {
+        glyph_cache_clear();
+        // A font of random glyphs, with enough 0s to split rows into spans.
+        texture_data_ = RandomMask(96 * kCharWidth * 2 * kCharHeight, 2);
+        texture_.width = 96 * kCharWidth;
+        texture_.height = 2 * kCharHeight;
+        texture_.row_bytes = texture_.width;
+        texture_.pixel_bytes = 1;
+        texture_.data = texture_data_.data();
+        font_.texture = &texture_;
+        font_.char_width = kCharWidth;
+        font_.char_height = kCharHeight;
+    }
+
+    void TearDown() override {
+        glyph_cache_clear();
+    }
+
+    // What gr_text() used to do: blend each character from the font.
+    void ReferenceText(const char* s, bool bold, unsigned char* dst, int dst_row_bytes,
+                       unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+        for (; *s; ++s, dst += kCharWidth * 4) {
+            unsigned char ch = *s;
+            if (ch < ' ' || ch > '~') ch = '?';
+            blend_mask_generic(texture_.data + (ch - ' ') * kCharWidth +
+                               (bold ? kCharHeight * texture_.row_bytes : 0),
+                               texture_.row_bytes, dst, dst_row_bytes,
+                               kCharWidth, kCharHeight, r, g, b, a);
+        }
+    }
+
+    static const int kCharWidth = 11;
+    static const int kCharHeight = 7;
+
+    std::vector<unsigned char> texture_data_;
+    GRSurface texture_;
+    GRFont font_;
+};
+
+TEST_F(GlyphCacheTest, matches_blend_mask) {
+    std::string text;
+    for (int ch = 1; ch < 256; ++ch) text += static_cast<char>(ch);
+    int row_bytes = text.size() * kCharWidth * 4 + 12;
+    std::vector<unsigned char> dst = RandomBytes(row_bytes * kCharHeight);
+
+    // Twice over, so that the second time draws from the cache.
+    for (int pass = 0; pass < 2; ++pass) {
+        for (unsigned char a : { 1, 64, 127, 128, 200, 254, 255 }) {
+            for (bool bold : { false, true }) {
+                unsigned char r = rng_() % 256, g = rng_() % 256, b = rng_() % 256;
+                std::vector<unsigned char> expected = dst;
+                ReferenceText(text.c_str(), bold, expected.data(), row_bytes, r, g, b, a);
+                std::vector<unsigned char> actual = dst;
+                glyph_cache_text(&font_, text.c_str(), text.size(), bold, actual.data(),
+                                 row_bytes, r, g, b, a);
+                ASSERT_EQ(expected, actual) << "alpha " << int(a) << " bold " << bold;
+            }
+        }
+    }
+}
+
+TEST_F(GlyphCacheTest, count) {
+    std::vector<unsigned char> dst(4 * kCharWidth * 4 * kCharHeight, 0x55);
+    std::vector<unsigned char> expected = dst;
+    ReferenceText("ab", false, expected.data(), 4 * kCharWidth * 4, 1, 2, 3, 255);
+    glyph_cache_text(&font_, "abcd", 2, false, dst.data(), 4 * kCharWidth * 4, 1, 2, 3, 255);
+    ASSERT_EQ(expected, dst);
+
+    glyph_cache_text(&font_, "abcd", 0, false, dst.data(), 4 * kCharWidth * 4, 1, 2, 3, 255);
+    glyph_cache_text(&font_, "abcd", 4, false, dst.data(), 4 * kCharWidth * 4, 1, 2, 3, 0);
+    ASSERT_EQ(expected, dst);
+}
+
+TEST_F(GlyphCacheTest, bounded) {
+    std::string text;
+    for (int ch = ' '; ch <= '~'; ++ch) text += static_cast<char>(ch);
+    int row_bytes = text.size() * kCharWidth * 4;
+    std::vector<unsigned char> dst(row_bytes * kCharHeight);
+
+    for (int a = 1; a < 256; ++a) {
+        glyph_cache_text(&font_, text.c_str(), text.size(), false, dst.data(), row_bytes,
+                         0, 0, 0, a);
+    }
+    size_t bytes = glyph_cache_bytes();
+    ASSERT_GT(bytes, 0U);
+    // Every glyph set is smaller than a quarter of the limit.
+    ASSERT_LE(bytes, kGlyphCacheBytes + kGlyphCacheBytes / 4);
+
+    glyph_cache_clear();
+    ASSERT_EQ(0U, glyph_cache_bytes());
+}
+
+TEST_F(GlyphCacheTest, new_texture) {
+    // A font whose texture is replaced mustn't be drawn from stale glyphs.
+    std::vector<unsigned char> dst(kCharWidth * 4 * kCharHeight);
+    glyph_cache_text(&font_, "x", 1, false, dst.data(), kCharWidth * 4, 9, 9, 9, 255);
+
+    std::vector<unsigned char> other = texture_data_;
+    for (auto& m : other) m = 255 - m;
+    texture_.data = other.data();
+    std::vector<unsigned char> expected(dst.size());
+    ReferenceText("x", false, expected.data(), kCharWidth * 4, 9, 9, 9, 255);
+    std::vector<unsigned char> actual(dst.size());
+    glyph_cache_text(&font_, "x", 1, false, actual.data(), kCharWidth * 4, 9, 9, 9, 255);
+    ASSERT_EQ(expected, actual);
+}
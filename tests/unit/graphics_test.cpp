@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/random_pixels.h"
+#include "minui/minui.h"
+
+class GraphicsTest : public RandomPixelsTest {
+  protected:
+    void TearDown() override {
+        gr_set_memory_backend(0, 0, 0);
+    }
+
+    // Draws the same pseudo-random sequence of frames with a display
+    // buffered 'buffers' times, and returns every frame displayed.  Each
+    // frame only redraws part of the screen, so the rest has to carry
+    // over from the frames before it whatever the buffering.
+    std::vector<std::vector<unsigned char>> DrawFrames(int buffers) {
+        gr_set_memory_backend(kWidth, kHeight, buffers);
+        EXPECT_EQ(0, gr_init());
+
+        rng_.seed(2016);
+        int width = gr_fb_width();
+        int height = gr_fb_height();
+        std::vector<std::vector<unsigned char>> frames;
+        for (int frame = 0; frame < 200; ++frame) {
+            // Some frames draw nothing, and some more than minui keeps
+            // separate damage rectangles for.
+            int calls = (frame % 10 == 0) ? 0 : (frame % 10 == 1) ? 12 : rng_() % 4 + 1;
+            for (int i = 0; i < calls; ++i) {
+                gr_color(rng_() % 256, rng_() % 256, rng_() % 256,
+                         (rng_() % 2) ? 255 : rng_() % 256);
+                int x = rng_() % width;
+                int y = rng_() % height;
+                int w = rng_() % (width - x) + 1;
+                int h = rng_() % (height - y) + 1;
+                switch (rng_() % 5) {
+                    case 0:
+                        gr_fill(x, y, x + w, y + h);
+                        break;
+                    case 1:
+                        gr_scroll(x, y, w, h, -static_cast<int>(rng_() % h));
+                        break;
+                    case 2:
+                        gr_scroll(x, y, w, h, rng_() % h);
+                        break;
+                    case 3:
+                        gr_text(gr_sys_font(), x, y, "recovery", rng_() % 2);
+                        break;
+                    case 4:
+                        if (rng_() % 8 == 0) gr_clear();
+                        break;
+                }
+            }
+            gr_flip();
+
+            const GRSurface* displayed = gr_memory_displayed();
+            EXPECT_NE(nullptr, displayed);
+            if (displayed == nullptr) break;
+            frames.emplace_back(displayed->data,
+                                displayed->data + displayed->height * displayed->row_bytes);
+        }
+
+        gr_exit();
+        return frames;
+    }
+
+    static const int kWidth = 120;
+    static const int kHeight = 90;
+};
+
+TEST_F(GraphicsTest, buffering_doesnt_change_frames) {
+    std::vector<std::vector<unsigned char>> expected = DrawFrames(1);
+    ASSERT_EQ(200U, expected.size());
+
+    for (int buffers : { 2, 3 }) {
+        std::vector<std::vector<unsigned char>> frames = DrawFrames(buffers);
+        ASSERT_EQ(expected.size(), frames.size());
+        for (size_t i = 0; i < frames.size(); ++i) {
+            ASSERT_EQ(expected[i], frames[i]) << buffers << " buffers, frame " << i;
+        }
+    }
+}
+
+TEST_F(GraphicsTest, copies_only_what_buffers_miss) {
+    gr_set_memory_backend(kWidth, kHeight, 2);
+    ASSERT_EQ(0, gr_init());
+
+    // Each buffer gets the damage of the frame drawn into it, plus that of
+    // the frame shown while it was waiting.
+    GRFrameStats stats;
+    gr_color(255, 0, 0, 255);
+    gr_fill(0, 0, 10, 10);
+    gr_flip();
+    ASSERT_TRUE(gr_frame_stats(&stats));
+    ASSERT_EQ(10U * 10 * 4, stats.last_bytes_copied);
+
+    gr_flip();
+    ASSERT_TRUE(gr_frame_stats(&stats));
+    ASSERT_EQ(10U * 10 * 4, stats.last_bytes_copied);
+
+    gr_flip();
+    ASSERT_TRUE(gr_frame_stats(&stats));
+    ASSERT_EQ(0U, stats.last_bytes_copied);
+
+    gr_exit();
+}
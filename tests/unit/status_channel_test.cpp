@@ -0,0 +1,190 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otautil/StatusChannel.h"
+
+// Runs 'write' against a StatusWriter on a temporary file and returns the
+// messages a StatusReader gets back from it.
+template <typename Fn>
+static std::vector<StatusMessage> RoundTrip(bool framed, Fn write) {
+  TemporaryFile temp_file;
+  FILE* fp = fdopen(dup(temp_file.fd), "w");
+  {
+    StatusWriter writer(fp, framed);
+    write(&writer, fp);
+  }
+  fclose(fp);
+
+  std::vector<StatusMessage> messages;
+  EXPECT_EQ(0, lseek(temp_file.fd, 0, SEEK_SET));
+  StatusReader reader(temp_file.fd);
+  StatusMessage message;
+  while (reader.Next(&message)) {
+    messages.push_back(message);
+  }
+  return messages;
+}
+
+static void WriteAll(StatusWriter* writer, FILE*) {
+  writer->Progress(0.5f, 10);
+  writer->SetProgress(0.25f);
+  writer->UiPrint("line1\n\nline2");
+  writer->Log("bytes_written_system: 4096");
+  writer->Send(StatusCommand::WIPE_CACHE);
+  writer->Send(StatusCommand::ENABLE_REBOOT);
+}
+
+TEST(StatusChannelTest, text) {
+  std::vector<StatusMessage> messages = RoundTrip(false, WriteAll);
+
+  // Every line of a text ui_print is followed by an empty one.
+  ASSERT_EQ(9U, messages.size());
+  ASSERT_EQ(StatusCommand::PROGRESS, messages[0].command);
+  ASSERT_FLOAT_EQ(0.5f, messages[0].fraction);
+  ASSERT_EQ(10, messages[0].seconds);
+  ASSERT_EQ(StatusCommand::SET_PROGRESS, messages[1].command);
+  ASSERT_FLOAT_EQ(0.25f, messages[1].fraction);
+  ASSERT_EQ(StatusCommand::UI_PRINT, messages[2].command);
+  ASSERT_EQ("line1", messages[2].text);
+  ASSERT_EQ("", messages[3].text);
+  ASSERT_EQ("line2", messages[4].text);
+  ASSERT_EQ("", messages[5].text);
+  ASSERT_EQ(StatusCommand::LOG, messages[6].command);
+  ASSERT_EQ("bytes_written_system: 4096", messages[6].text);
+  ASSERT_EQ(StatusCommand::WIPE_CACHE, messages[7].command);
+  ASSERT_EQ(StatusCommand::ENABLE_REBOOT, messages[8].command);
+}
+
+TEST(StatusChannelTest, frames) {
+  std::vector<StatusMessage> messages = RoundTrip(true, WriteAll);
+
+  ASSERT_EQ(6U, messages.size());
+  ASSERT_EQ(StatusCommand::PROGRESS, messages[0].command);
+  ASSERT_FLOAT_EQ(0.5f, messages[0].fraction);
+  ASSERT_EQ(10, messages[0].seconds);
+  ASSERT_EQ(StatusCommand::SET_PROGRESS, messages[1].command);
+  ASSERT_FLOAT_EQ(0.25f, messages[1].fraction);
+  ASSERT_EQ(StatusCommand::UI_PRINT, messages[2].command);
+  ASSERT_EQ("line1\nline2\n", messages[2].text);
+  ASSERT_EQ(StatusCommand::LOG, messages[3].command);
+  ASSERT_EQ("bytes_written_system: 4096", messages[3].text);
+  ASSERT_EQ(StatusCommand::WIPE_CACHE, messages[4].command);
+  ASSERT_EQ(StatusCommand::ENABLE_REBOOT, messages[5].command);
+}
+
+TEST(StatusChannelTest, mixed_and_legacy_text) {
+  // Device extensions may still fprintf() text commands to cmd_pipe.
+  std::vector<StatusMessage> messages = RoundTrip(true, [](StatusWriter* writer, FILE* fp) {
+    fputs("  ui_print hello world\nui_print\n\n", fp);
+    fflush(fp);
+    writer->Send(StatusCommand::RETRY_UPDATE);
+    fputs("progress 0.1 5\nbogus 1 2\nset_progress 0.75", fp);
+  });
+
+  ASSERT_EQ(6U, messages.size());
+  ASSERT_EQ(StatusCommand::UI_PRINT, messages[0].command);
+  ASSERT_EQ("hello world", messages[0].text);
+  ASSERT_EQ(StatusCommand::UI_PRINT, messages[1].command);
+  ASSERT_EQ("", messages[1].text);
+  ASSERT_EQ(StatusCommand::RETRY_UPDATE, messages[2].command);
+  ASSERT_EQ(StatusCommand::PROGRESS, messages[3].command);
+  ASSERT_FLOAT_EQ(0.1f, messages[3].fraction);
+  ASSERT_EQ(5, messages[3].seconds);
+  ASSERT_EQ(StatusCommand::UNKNOWN, messages[4].command);
+  ASSERT_EQ("bogus", messages[4].text);
+  // The last line doesn't need a newline.
+  ASSERT_EQ(StatusCommand::SET_PROGRESS, messages[5].command);
+  ASSERT_FLOAT_EQ(0.75f, messages[5].fraction);
+}
+
+TEST(StatusChannelTest, progress_coalescing) {
+  size_t written = 0;
+  size_t coalesced = 0;
+  std::vector<StatusMessage> messages = RoundTrip(true, [&](StatusWriter* writer, FILE*) {
+    for (int i = 1; i <= 10000; ++i) {
+      writer->SetProgress(i / 10000.0f);
+    }
+    writer->Flush();
+    written = writer->messages_written();
+    coalesced = writer->progress_coalesced();
+  });
+
+  // The first update goes out right away and the last one on Flush(); the
+  // ones in between are only written once per PROGRESS_INTERVAL.
+  ASSERT_EQ(written, messages.size());
+  ASSERT_EQ(10000U, written + coalesced);
+  ASSERT_GE(written, 2U);
+  ASSERT_LT(written, 100U);
+  ASSERT_FLOAT_EQ(0.0001f, messages.front().fraction);
+  ASSERT_FLOAT_EQ(1.0f, messages.back().fraction);
+
+  // Any other message sends the pending value first, so nothing is
+  // reordered.
+  messages = RoundTrip(true, [](StatusWriter* writer, FILE*) {
+    writer->SetProgress(0.1f);
+    writer->SetProgress(0.2f);
+    writer->Log("done");
+  });
+  ASSERT_EQ(3U, messages.size());
+  ASSERT_FLOAT_EQ(0.1f, messages[0].fraction);
+  ASSERT_FLOAT_EQ(0.2f, messages[1].fraction);
+  ASSERT_EQ(StatusCommand::LOG, messages[2].command);
+}
+
+TEST(StatusChannelTest, long_ui_print) {
+  std::string line(100000, 'x');
+  std::vector<StatusMessage> messages = RoundTrip(true, [&line](StatusWriter* writer, FILE*) {
+    writer->UiPrint(line);
+  });
+
+  std::string printed;
+  for (const auto& message : messages) {
+    ASSERT_EQ(StatusCommand::UI_PRINT, message.command);
+    printed += message.text;
+  }
+  ASSERT_EQ(2U, messages.size());
+  ASSERT_EQ(line + "\n", printed);
+}
+
+TEST(StatusChannelTest, progress_flushed_while_idle) {
+  size_t written_before = 0;
+  size_t written_after = 0;
+  std::vector<StatusMessage> messages = RoundTrip(true, [&](StatusWriter* writer, FILE*) {
+    writer->SetProgress(0.25f);
+    writer->SetProgress(0.5f);
+    written_before = writer->messages_written();
+    // Nothing else is written, but the pending update still goes out once
+    // the interval is up.
+    std::this_thread::sleep_for(StatusWriter::PROGRESS_INTERVAL * 3);
+    written_after = writer->messages_written();
+  });
+
+  ASSERT_EQ(1U, written_before);
+  ASSERT_EQ(2U, written_after);
+  ASSERT_EQ(2U, messages.size());
+  ASSERT_FLOAT_EQ(0.5f, messages[1].fraction);
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <cutils/properties.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "print_sha1.h"
+#include "update_verifier/update_verifier.h"
+
+static constexpr size_t kBlockSize = 4096;
+static constexpr size_t kBlockCount = 16;
+
+class UpdateVerifierTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // verify_image() appends the slot suffix to the block device names in the care map.
+    char slot_suffix[PROPERTY_VALUE_MAX];
+    property_get("ro.boot.slot_suffix", slot_suffix, "");
+    system_dev_ = std::string(temp_dir_.path) + "/system";
+    vendor_dev_ = std::string(temp_dir_.path) + "/vendor";
+    system_path_ = system_dev_ + slot_suffix;
+    vendor_path_ = vendor_dev_ + slot_suffix;
+
+    for (size_t i = 0; i < kBlockCount * kBlockSize; ++i) {
+      image_.push_back(static_cast<char>((i * 7 + i / kBlockSize) & 0xff));
+    }
+    ASSERT_TRUE(android::base::WriteStringToFile(image_, system_path_));
+    ASSERT_TRUE(android::base::WriteStringToFile(image_, vendor_path_));
+  }
+
+  void TearDown() override {
+    unlink(system_path_.c_str());
+    unlink(vendor_path_.c_str());
+  }
+
+  // Returns the hex SHA-256 of blocks [start, end) of the image.
+  std::string digest(size_t start, size_t end) const {
+    uint8_t sha256[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(image_.data()) + start * kBlockSize,
+           (end - start) * kBlockSize, sha256);
+    return print_hex(sha256, SHA256_DIGEST_LENGTH);
+  }
+
+  bool verify(const std::string& care_map, bool verity_enforcing) {
+    EXPECT_TRUE(android::base::WriteStringToFile(care_map, care_map_file_.path));
+    return verify_image(care_map_file_.path, verity_enforcing);
+  }
+
+  TemporaryDir temp_dir_;
+  TemporaryFile care_map_file_;
+  std::string system_dev_;
+  std::string vendor_dev_;
+  std::string system_path_;
+  std::string vendor_path_;
+  std::string image_;
+};
+
+TEST_F(UpdateVerifierTest, verify_image_no_care_map) {
+  // A missing care map is only allowed when dm-verity will catch any corruption.
+  std::string missing = std::string(temp_dir_.path) + "/doesntexist";
+  ASSERT_TRUE(verify_image(missing, true));
+  ASSERT_FALSE(verify_image(missing, false));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_read_only) {
+  ASSERT_TRUE(verify(system_dev_ + "\n4,0,5,8,16\n", true));
+  ASSERT_TRUE(verify(system_dev_ + "\n2,0,16\n" + vendor_dev_ + "\n2,3,4\n", true));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_digests) {
+  std::string care_map = system_dev_ + "\n4,0,5,8,16\nsha256:" + digest(0, 5) + "," +
+                         digest(8, 16) + "\n";
+  ASSERT_TRUE(verify(care_map, true));
+  ASSERT_TRUE(verify(care_map, false));
+
+  // Digests are not case sensitive.
+  std::string upper = digest(8, 16);
+  std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+  ASSERT_TRUE(verify(system_dev_ + "\n4,0,5,8,16\nsha256:" + digest(0, 5) + "," + upper + "\n",
+                     false));
+
+  // Only one of the partitions needs to carry digests if dm-verity is enforcing.
+  ASSERT_TRUE(verify(system_dev_ + "\n2,0,16\n" + vendor_dev_ + "\n2,1,3\nsha256:" +
+                         digest(1, 3) + "\n",
+                     true));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_digest_mismatch) {
+  // The digests are listed in the wrong order.
+  ASSERT_FALSE(verify(system_dev_ + "\n4,0,5,8,16\nsha256:" + digest(8, 16) + "," +
+                          digest(0, 5) + "\n",
+                      true));
+
+  // The image no longer matches.
+  std::string care_map = system_dev_ + "\n2,0,16\nsha256:" + digest(0, 16) + "\n";
+  ASSERT_TRUE(verify(care_map, false));
+  image_[kBlockSize * 9] ^= 0x01;
+  ASSERT_TRUE(android::base::WriteStringToFile(image_, system_path_));
+  ASSERT_FALSE(verify(care_map, false));
+  ASSERT_FALSE(verify(care_map, true));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_non_enforcing_needs_digests) {
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,16\n", false));
+
+  // Every partition in the care map needs digests.
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,16\nsha256:" + digest(0, 16) + "\n" + vendor_dev_ +
+                          "\n2,0,16\n",
+                      false));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,16\n" + vendor_dev_ + "\n2,0,16\nsha256:" +
+                          digest(0, 16) + "\n",
+                      false));
+  ASSERT_TRUE(verify(system_dev_ + "\n2,0,16\nsha256:" + digest(0, 16) + "\n" + vendor_dev_ +
+                         "\n2,0,16\nsha256:" + digest(0, 16) + "\n",
+                     false));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_malformed_ranges) {
+  // The count must be even, non-zero and match the number of integers that follow.
+  ASSERT_FALSE(verify(system_dev_ + "\n0\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n3,0,1,2\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n4,0,1\n", true));
+
+  // Each range must be a pair of integers with start < end.
+  ASSERT_FALSE(verify(system_dev_ + "\n2,1,1\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,5,3\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n4,0,1,x,3\n", true));
+
+  // Missing range line, and too many partitions.
+  ASSERT_FALSE(verify(system_dev_ + "\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,1\n" + vendor_dev_ + "\n2,0,1\n" + system_dev_ +
+                          "\n2,0,1\n",
+                      true));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_digest_count_mismatch) {
+  ASSERT_FALSE(verify(system_dev_ + "\n4,0,5,8,16\nsha256:" + digest(0, 5) + "\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,5\nsha256:" + digest(0, 5) + "," + digest(0, 5) + "\n",
+                      true));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,5\nsha256:\n", true));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_invalid_digest) {
+  std::string good = digest(0, 5);
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,5\nsha256:" + good.substr(1) + "\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,5\nsha256:" + good + "0\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,0,5\nsha256:" + good.substr(1) + "g\n", true));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_past_end) {
+  // Reading past the end of the block device fails, with or without digests.
+  ASSERT_FALSE(verify(system_dev_ + "\n2,8,17\n", true));
+  ASSERT_FALSE(verify(system_dev_ + "\n2,16,17\nsha256:" + digest(0, 1) + "\n", false));
+}
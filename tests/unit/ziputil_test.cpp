@@ -189,3 +189,77 @@ TEST(ZipUtilTest, set_timestamp) {
 
   CloseArchive(handle);
 }
+
+TEST(ZipUtilTest, extract_no_matching_entries) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+
+  // Nothing is under "e/", so there's nothing to extract and the destination
+  // doesn't have to exist.
+  TemporaryDir td;
+  std::string dest = std::string(td.path) + "/e";
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "e", dest, nullptr, nullptr));
+  ASSERT_EQ(-1, access(dest.c_str(), F_OK));
+  ASSERT_EQ(ENOENT, errno);
+
+  CloseArchive(handle);
+}
+
+TEST(ZipUtilTest, extract_from_memory) {
+  // The updater opens the package from memory rather than from an fd.
+  std::string zip_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("ziptest_valid.zip"),
+                                              &zip_contents));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(&zip_contents[0], zip_contents.size(), "ziptest_valid.zip",
+                                     &handle));
+
+  TemporaryDir td;
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "", td.path, nullptr, nullptr));
+
+  std::string path(td.path);
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/a.txt", &content));
+  ASSERT_EQ(kATxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/b/c.txt", &content));
+  ASSERT_EQ(kCTxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/b/d.txt", &content));
+  ASSERT_EQ(kDTxtContents, content);
+
+  // Clean up the temp files under td.
+  ASSERT_EQ(0, unlink((path + "/a.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b/c.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/b/d.txt").c_str()));
+  ASSERT_EQ(0, rmdir((path + "/b").c_str()));
+
+  CloseArchive(handle);
+}
+
+TEST(ZipUtilTest, extract_from_mapping) {
+  // Every worker opens its own handle on the mapped package.
+  std::string zip_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("ziptest_valid.zip"),
+                                              &zip_contents));
+  uint8_t* zip_addr = reinterpret_cast<uint8_t*>(&zip_contents[0]);
+
+  TemporaryDir td;
+  ASSERT_TRUE(ExtractPackageRecursive(zip_addr, zip_contents.size(), "b", td.path, nullptr,
+                                      nullptr));
+
+  std::string path(td.path);
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/c.txt", &content));
+  ASSERT_EQ(kCTxtContents, content);
+  ASSERT_TRUE(android::base::ReadFileToString(path + "/d.txt", &content));
+  ASSERT_EQ(kDTxtContents, content);
+  ASSERT_EQ(-1, access((path + "/a.txt").c_str(), F_OK));
+
+  // Clean up the temp files under td.
+  ASSERT_EQ(0, unlink((path + "/c.txt").c_str()));
+  ASSERT_EQ(0, unlink((path + "/d.txt").c_str()));
+
+  // A truncated package can't be opened.
+  ASSERT_FALSE(ExtractPackageRecursive(zip_addr, 16, "b", td.path, nullptr, nullptr));
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the recovery UI against minui's memory backend and reports how long
+// it takes to draw and flip a frame in the install animation, in the menu
+// and while log text scrolls.  Nothing is shown on the display, so this
+// can run while recovery itself is running.  It needs recovery's images
+// in /res/images.
+//
+// With --display it uses the real display instead (so recovery mustn't
+// be running).  Either way it finishes with the backend's frame
+// statistics, such as how much it copied to the display.
+//
+//   recovery_ui_benchmark [--wear] [--size=WIDTHxHEIGHT] [--buffers=N]
+//                         [--frames=N] [--display]
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include <android-base/parseint.h>
+
+#include "minui/minui.h"
+#include "screen_ui.h"
+#include "wear_ui.h"
+
+// ShowFile() finds files through recovery's fopen_path(); nothing here
+// needs the partitions mounted.
+FILE* fopen_path(const char* path, const char* mode) {
+    return fopen(path, mode);
+}
+
+static double now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(const char* name, std::vector<double> times) {
+    std::sort(times.begin(), times.end());
+    double total = 0;
+    for (double t : times) total += t;
+    printf("%-10s %5zu frames   avg %7.3f   median %7.3f   p95 %7.3f   max %7.3f ms\n",
+           name, times.size(), total / times.size(), times[times.size() / 2],
+           times[times.size() * 95 / 100], times.back());
+}
+
+static const char* const kMenuHeaders[] = {
+    "Benchmark",
+    nullptr
+};
+
+static const char* const kMenuItems[] = {
+    "Reboot system now",
+    "Reboot to bootloader",
+    "Apply update from ADB",
+    "Apply update from SD card",
+    "Wipe data/factory reset",
+    "Wipe cache partition",
+    "Mount /system",
+    "View recovery logs",
+    "Run graphics test",
+    "Power off",
+    nullptr
+};
+
+// Drives a ScreenRecoveryUI or WearRecoveryUI.  Each scenario times the
+// same draw-and-flip calls recovery makes; the progress thread keeps
+// running alongside, as it does in recovery.
+template <typename UI>
+class BenchmarkUI : public UI {
+  public:
+    void Run(int frames) {
+        this->SetBackground(RecoveryUI::INSTALLING_UPDATE);
+        this->SetProgressType(RecoveryUI::DETERMINATE);
+        this->ShowProgress(1.0, 0);
+        // Paced like the progress thread, so that frames are decoded ahead
+        // of time as they would be in recovery.
+        report("animation", Time(frames, [this, frames](int i) {
+            this->current_frame = i % this->loop_frames;
+            this->intro_done = true;
+            this->progress = static_cast<float>(i) / frames;
+            this->update_progress_locked();
+        }, 1000000 / this->animation_fps));
+        printf("%zu KB of decoded animation frames\n", this->GetAnimationMemory() / 1024);
+
+        this->ShowText(true);
+        this->StartMenu(kMenuHeaders, kMenuItems, 0);
+        report("menu", Time(frames, [this](int i) {
+            this->menu_sel = i % this->menu_items;
+            this->update_screen_locked();
+        }));
+        this->EndMenu();
+
+        std::vector<double> times;
+        for (int i = 0; i < frames; ++i) {
+            this->PrintOnScreenOnly("Patching system image after verification (%d)\n", i);
+            pthread_mutex_lock(&this->updateMutex);
+            double start = now_ms();
+            this->update_log_locked();
+            times.push_back(now_ms() - start);
+            pthread_mutex_unlock(&this->updateMutex);
+        }
+        report("log", times);
+
+        printf("%zu prints, %zu frames rendered\n",
+               this->GetPrintCount(), this->GetFrameCount());
+
+        GRFrameStats stats;
+        if (gr_frame_stats(&stats)) {
+            printf("%llu frames displayed, last interval %.3f ms, max %.3f ms, "
+                   "%.3f ms waiting for the display\n",
+                   static_cast<unsigned long long>(stats.frames),
+                   stats.last_interval_us / 1000.0, stats.max_interval_us / 1000.0,
+                   stats.wait_us / 1000.0);
+            if (stats.bytes_copied > 0) {
+                printf("%llu KB copied to the display, %llu KB per frame\n",
+                       static_cast<unsigned long long>(stats.bytes_copied / 1024),
+                       static_cast<unsigned long long>(stats.bytes_copied / 1024 / stats.frames));
+            }
+        }
+    }
+
+  private:
+    std::vector<double> Time(int frames, const std::function<void(int)>& draw,
+                             useconds_t interval = 0) {
+        std::vector<double> times;
+        for (int i = 0; i < frames; ++i) {
+            pthread_mutex_lock(&this->updateMutex);
+            double start = now_ms();
+            draw(i);
+            times.push_back(now_ms() - start);
+            pthread_mutex_unlock(&this->updateMutex);
+            if (interval > 0) usleep(interval);
+        }
+        return times;
+    }
+};
+
+template <typename UI>
+static int run(int frames) {
+    // Never freed: the UI's threads run until the process exits.
+    BenchmarkUI<UI>* ui = new BenchmarkUI<UI>;
+    ui->SetLocale("en-US");
+    if (!ui->Init()) {
+        fprintf(stderr, "failed to initialize the UI\n");
+        return 1;
+    }
+    ui->Run(frames);
+    return 0;
+}
+
+static const struct option OPTIONS[] = {
+    { "wear", no_argument, nullptr, 'w' },
+    { "size", required_argument, nullptr, 's' },
+    { "buffers", required_argument, nullptr, 'b' },
+    { "frames", required_argument, nullptr, 'f' },
+    { "display", no_argument, nullptr, 'd' },
+    { nullptr, 0, nullptr, 0 },
+};
+
+int main(int argc, char** argv) {
+    bool wear = false;
+    int width = 1440, height = 2560;
+    int buffers = 2;
+    int frames = 200;
+    bool display = false;
+
+    int arg;
+    while ((arg = getopt_long(argc, argv, "", OPTIONS, nullptr)) != -1) {
+        switch (arg) {
+        case 'w': wear = true; break;
+        case 'd': display = true; break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2) {
+                fprintf(stderr, "bad --size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (!android::base::ParseInt(optarg, &buffers, 1, 3)) {
+                fprintf(stderr, "bad --buffers: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            if (!android::base::ParseInt(optarg, &frames, 1)) {
+                fprintf(stderr, "bad --frames: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--wear] [--size=WIDTHxHEIGHT] [--buffers=N] "
+                    "[--frames=N] [--display]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!display) {
+        gr_set_memory_backend(width, height, buffers);
+    }
+    return wear ? run<WearRecoveryUI>(frames) : run<ScreenRecoveryUI>(frames);
+}
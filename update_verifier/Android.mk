@@ -14,14 +14,39 @@
 
 LOCAL_PATH := $(call my-dir)
 
+# libupdate_verifier (static library)
+# ===============================
 include $(CLEAR_VARS)
 
 LOCAL_CLANG := true
 LOCAL_SRC_FILES := update_verifier.cpp
 
+LOCAL_MODULE := libupdate_verifier
+LOCAL_STATIC_LIBRARIES := \
+    libbase \
+    libcrypto \
+    libcutils
+
+LOCAL_CFLAGS := -Werror
+LOCAL_C_INCLUDES += \
+    $(LOCAL_PATH)/include \
+    $(LOCAL_PATH)/..
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/include
+
+include $(BUILD_STATIC_LIBRARY)
+
+# update_verifier (executable)
+# ===============================
+include $(CLEAR_VARS)
+
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := update_verifier_main.cpp
+
 LOCAL_MODULE := update_verifier
+LOCAL_STATIC_LIBRARIES := libupdate_verifier
 LOCAL_SHARED_LIBRARIES := \
     libbase \
+    libcrypto \
     libcutils \
     libhardware \
     liblog \
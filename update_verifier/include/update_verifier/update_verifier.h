@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATE_VERIFIER_UPDATE_VERIFIER_H
+#define _UPDATE_VERIFIER_UPDATE_VERIFIER_H
+
+#include <string>
+
+// Reads all the blocks listed in the care map 'care_map_name', and checks the
+// ranges that carry a "sha256:" digest against it. The block device names in
+// the care map get the ro.boot.slot_suffix property appended. If dm-verity is
+// not enforcing, every partition in the care map must have digests. A missing
+// care map is only accepted when dm-verity is enforcing. Returns true if all
+// the blocks could be read and all the digests match.
+bool verify_image(const std::string& care_map_name, bool verity_enforcing);
+
+#endif  // _UPDATE_VERIFIER_UPDATE_VERIFIER_H
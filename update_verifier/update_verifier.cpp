@@ -26,16 +26,28 @@
  * for example, veritymode=EIO) are not accepted and simply lead to a
  * verification failure.
  *
+ * The care map may optionally carry a SHA-256 digest for every block range.
+ * When present, the ranges are hashed and compared in userspace as well, which
+ * also allows the verification to proceed when dm-verity is not enforcing.
+ *
  * The current slot will be marked as having booted successfully if the
  * verifier reaches the end after the verification.
  *
  */
 
+#include "update_verifier/update_verifier.h"
+
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <string>
 #include <vector>
 
@@ -45,80 +57,204 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <cutils/properties.h>
-#include <android/hardware/boot/1.0/IBootControl.h>
+#include <openssl/sha.h>
 
-using android::sp;
-using android::hardware::boot::V1_0::IBootControl;
-using android::hardware::boot::V1_0::BoolResult;
-using android::hardware::boot::V1_0::CommandResult;
+#include "print_sha1.h"
 
-constexpr auto CARE_MAP_FILE = "/data/ota_package/care_map.txt";
 constexpr int BLOCKSIZE = 4096;
 
-static bool read_blocks(const std::string& blk_device_prefix, const std::string& range_str) {
-    char slot_suffix[PROPERTY_VALUE_MAX];
-    property_get("ro.boot.slot_suffix", slot_suffix, "");
-    std::string blk_device = blk_device_prefix + std::string(slot_suffix);
-    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(blk_device.c_str(), O_RDONLY)));
-    if (fd.get() == -1) {
-        PLOG(ERROR) << "Error reading partition " << blk_device;
-        return false;
-    }
+constexpr auto DIGEST_PREFIX = "sha256:";
+// Ranges without a digest are split into work items of at most this many blocks, so that a
+// single large range can still be read by all the workers.
+constexpr size_t MAX_BLOCKS_PER_ITEM = 8192;
+// Size of the buffer each worker reads into.
+constexpr size_t READ_CHUNK_BLOCKS = 256;
+
+struct BlockRange {
+    size_t start;
+    size_t end;
+    // Expected SHA-256 of the range in hex, or empty if the range is only read.
+    std::string sha256;
+};
 
+struct CareMapEntry {
+    std::string blk_device;
+    std::vector<BlockRange> ranges;
+    bool has_digests = false;
+};
+
+static bool parse_ranges(const std::string& range_str, std::vector<BlockRange>* ranges) {
     // For block range string, first integer 'count' equals 2 * total number of valid ranges,
     // followed by 'count' number comma separated integers. Every two integers reprensent a
     // block range with the first number included in range but second number not included.
     // For example '4,64536,65343,74149,74150' represents: [64536,65343) and [74149,74150).
-    std::vector<std::string> ranges = android::base::Split(range_str, ",");
+    std::vector<std::string> pieces = android::base::Split(range_str, ",");
     size_t range_count;
-    bool status = android::base::ParseUint(ranges[0].c_str(), &range_count);
+    bool status = android::base::ParseUint(pieces[0].c_str(), &range_count);
     if (!status || (range_count == 0) || (range_count % 2 != 0) ||
-            (range_count != ranges.size()-1)) {
+            (range_count != pieces.size()-1)) {
         LOG(ERROR) << "Error in parsing range string.";
         return false;
     }
 
-    size_t blk_count = 0;
-    for (size_t i = 1; i < ranges.size(); i += 2) {
+    for (size_t i = 1; i < pieces.size(); i += 2) {
         unsigned int range_start, range_end;
-        bool parse_status = android::base::ParseUint(ranges[i].c_str(), &range_start);
-        parse_status = parse_status && android::base::ParseUint(ranges[i+1].c_str(), &range_end);
+        bool parse_status = android::base::ParseUint(pieces[i].c_str(), &range_start);
+        parse_status = parse_status && android::base::ParseUint(pieces[i+1].c_str(), &range_end);
         if (!parse_status || range_start >= range_end) {
-            LOG(ERROR) << "Invalid range pair " << ranges[i] << ", " << ranges[i+1];
+            LOG(ERROR) << "Invalid range pair " << pieces[i] << ", " << pieces[i+1];
             return false;
         }
+        ranges->push_back({ range_start, range_end, "" });
+    }
+    return true;
+}
 
-        if (lseek64(fd.get(), static_cast<off64_t>(range_start) * BLOCKSIZE, SEEK_SET) == -1) {
-            PLOG(ERROR) << "lseek to " << range_start << " failed";
+// The optional digest line has the form 'sha256:<hex0>,<hex1>,...', holding one digest per
+// range in the preceding range line, in the same order.
+static bool parse_digests(const std::string& line, std::vector<BlockRange>* ranges) {
+    std::vector<std::string> digests =
+            android::base::Split(line.substr(strlen(DIGEST_PREFIX)), ",");
+    if (digests.size() != ranges->size()) {
+        LOG(ERROR) << "Found " << digests.size() << " digests for " << ranges->size()
+                   << " ranges in care map.";
+        return false;
+    }
+    for (size_t i = 0; i < digests.size(); ++i) {
+        std::string digest = android::base::Trim(digests[i]);
+        if (digest.size() != SHA256_DIGEST_LENGTH * 2 ||
+                digest.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+            LOG(ERROR) << "Invalid digest \"" << digest << "\" in care map.";
             return false;
         }
+        std::transform(digest.begin(), digest.end(), digest.begin(), ::tolower);
+        (*ranges)[i].sha256 = digest;
+    }
+    return true;
+}
+
+// Reads the given range, and checks it against its digest if the range has one.
+static bool read_range(int fd, const BlockRange& range, std::vector<uint8_t>* buf) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    bool check_hash = !range.sha256.empty();
 
-        size_t size = (range_end - range_start) * BLOCKSIZE;
-        std::vector<uint8_t> buf(size);
-        if (!android::base::ReadFully(fd.get(), buf.data(), size)) {
-            PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end;
+    for (size_t blk = range.start; blk < range.end; ) {
+        size_t count = std::min(range.end - blk, READ_CHUNK_BLOCKS);
+        size_t size = count * BLOCKSIZE;
+        off64_t offset = static_cast<off64_t>(blk) * BLOCKSIZE;
+        // Workers share the fd, so read with pread64 rather than seeking.
+        for (size_t so_far = 0; so_far < size; ) {
+            ssize_t r = TEMP_FAILURE_RETRY(pread64(fd, buf->data() + so_far, size - so_far,
+                                                   offset + so_far));
+            if (r == -1) {
+                PLOG(ERROR) << "Failed to read blocks " << blk << " to " << blk + count;
+                return false;
+            }
+            if (r == 0) {
+                LOG(ERROR) << "Failed to read blocks " << blk << " to " << blk + count
+                           << ": unexpected EOF";
+                return false;
+            }
+            so_far += r;
+        }
+        if (check_hash) {
+            SHA256_Update(&ctx, buf->data(), size);
+        }
+        blk += count;
+    }
+
+    if (check_hash) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        SHA256_Final(digest, &ctx);
+        std::string hex = print_hex(digest, SHA256_DIGEST_LENGTH);
+        if (hex != range.sha256) {
+            LOG(ERROR) << "Digest mismatch for blocks [" << range.start << ", " << range.end
+                       << "): expected " << range.sha256 << ", found " << hex;
             return false;
         }
-        blk_count += (range_end - range_start);
     }
+    return true;
+}
 
-    LOG(INFO) << "Finished reading " << blk_count << " blocks on " << blk_device;
+static bool read_blocks(const CareMapEntry& entry) {
+    char slot_suffix[PROPERTY_VALUE_MAX];
+    property_get("ro.boot.slot_suffix", slot_suffix, "");
+    std::string blk_device = entry.blk_device + std::string(slot_suffix);
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(blk_device.c_str(), O_RDONLY)));
+    if (fd.get() == -1) {
+        PLOG(ERROR) << "Error reading partition " << blk_device;
+        return false;
+    }
+
+    // A range with a digest must be hashed as a whole; ranges that are only read can be split
+    // so that the work spreads evenly across the workers.
+    std::vector<BlockRange> items;
+    size_t blk_count = 0;
+    for (const auto& range : entry.ranges) {
+        blk_count += range.end - range.start;
+        if (!range.sha256.empty()) {
+            items.push_back(range);
+            continue;
+        }
+        for (size_t start = range.start; start < range.end; start += MAX_BLOCKS_PER_ITEM) {
+            items.push_back({ start, std::min(range.end, start + MAX_BLOCKS_PER_ITEM), "" });
+        }
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = std::min(items.size(), static_cast<size_t>(cpus > 0 ? cpus : 1));
+    std::atomic<size_t> next_item(0);
+    std::atomic<bool> failed(false);
+
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<std::future<bool>> workers;
+    for (size_t t = 0; t < thread_count; ++t) {
+        workers.push_back(std::async(std::launch::async, [&]() {
+            std::vector<uint8_t> buf(READ_CHUNK_BLOCKS * BLOCKSIZE);
+            for (size_t i = next_item++; i < items.size() && !failed; i = next_item++) {
+                if (!read_range(fd.get(), items[i], &buf)) {
+                    failed = true;
+                    return false;
+                }
+            }
+            return true;
+        }));
+    }
+
+    bool ret = true;
+    for (auto& worker : workers) {
+        ret = worker.get() && ret;
+    }
+    if (!ret) {
+        LOG(ERROR) << "Failed to verify blocks on " << blk_device;
+        return false;
+    }
+
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start_time;
+    LOG(INFO) << "Finished " << (entry.has_digests ? "verifying " : "reading ") << blk_count
+              << " blocks on " << blk_device << " with " << thread_count << " threads in "
+              << duration.count() << " s";
     return true;
 }
 
-static bool verify_image(const std::string& care_map_name) {
+// When dm-verity is not enforcing, reading the blocks alone doesn't verify anything. In that
+// case every partition in the care map needs to carry the digests of its ranges.
+bool verify_image(const std::string& care_map_name, bool verity_enforcing) {
     android::base::unique_fd care_map_fd(TEMP_FAILURE_RETRY(open(care_map_name.c_str(), O_RDONLY)));
     // If the device is flashed before the current boot, it may not have care_map.txt
     // in /data/ota_package. To allow the device to continue booting in this situation,
     // we should print a warning and skip the block verification.
     if (care_map_fd.get() == -1) {
         LOG(WARNING) << "Warning: care map " << care_map_name << " not found.";
-        return true;
+        return verity_enforcing;
     }
-    // Care map file has four lines (two lines if vendor partition is not present):
+    // Care map file has two lines per partition (one or two partitions, depending on whether
+    // vendor partition is present), optionally followed by a third line with the digests:
     // First line has the block device name, e.g./dev/block/.../by-name/system.
     // Second line holds all ranges of blocks to verify.
-    // The next two lines have the same format but for vendor partition.
+    // The optional third line starts with "sha256:" and lists the digest of each range.
+    // The next lines have the same format but for vendor partition.
     std::string file_content;
     if (!android::base::ReadFdToString(care_map_fd.get(), &file_content)) {
         LOG(ERROR) << "Error reading care map contents to string.";
@@ -127,65 +263,46 @@ static bool verify_image(const std::string& care_map_name) {
 
     std::vector<std::string> lines;
     lines = android::base::Split(android::base::Trim(file_content), "\n");
-    if (lines.size() != 2 && lines.size() != 4) {
-        LOG(ERROR) << "Invalid lines in care_map: found " << lines.size()
-                   << " lines, expecting 2 or 4 lines.";
+    std::vector<CareMapEntry> entries;
+    for (size_t i = 0; i < lines.size(); ) {
+        if (i + 1 >= lines.size()) {
+            LOG(ERROR) << "Missing range line for " << lines[i] << " in care_map.";
+            return false;
+        }
+        CareMapEntry entry;
+        entry.blk_device = lines[i];
+        if (!parse_ranges(lines[i+1], &entry.ranges)) {
+            return false;
+        }
+        i += 2;
+        if (i < lines.size() && android::base::StartsWith(lines[i], DIGEST_PREFIX)) {
+            if (!parse_digests(lines[i], &entry.ranges)) {
+                return false;
+            }
+            entry.has_digests = true;
+            i++;
+        }
+        entries.push_back(std::move(entry));
+    }
+    if (entries.size() != 1 && entries.size() != 2) {
+        LOG(ERROR) << "Invalid partitions in care_map: found " << entries.size()
+                   << " partitions, expecting 1 or 2 partitions.";
         return false;
     }
 
-    for (size_t i = 0; i < lines.size(); i += 2) {
-        if (!read_blocks(lines[i], lines[i+1])) {
+    for (const auto& entry : entries) {
+        if (!verity_enforcing && !entry.has_digests) {
+            LOG(ERROR) << "dm-verity is not enforcing and care map has no digests for "
+                       << entry.blk_device;
             return false;
         }
     }
 
-    return true;
-}
+    for (const auto& entry : entries) {
+        if (!read_blocks(entry)) {
+            return false;
+        }
+    }
 
-int main(int argc, char** argv) {
-  for (int i = 1; i < argc; i++) {
-    LOG(INFO) << "Started with arg " << i << ": " << argv[i];
-  }
-
-  sp<IBootControl> module = IBootControl::getService("bootctrl");
-  if (module == nullptr) {
-    LOG(ERROR) << "Error getting bootctrl module.";
-    return -1;
-  }
-
-  uint32_t current_slot = module->getCurrentSlot();
-  BoolResult is_successful = module->isSlotMarkedSuccessful(current_slot);
-  LOG(INFO) << "Booting slot " << current_slot << ": isSlotMarkedSuccessful="
-            << static_cast<int32_t>(is_successful);
-
-  if (is_successful == BoolResult::FALSE) {
-    // The current slot has not booted successfully.
-    char verity_mode[PROPERTY_VALUE_MAX];
-    if (property_get("ro.boot.veritymode", verity_mode, "") == -1) {
-      LOG(ERROR) << "Failed to get dm-verity mode.";
-      return -1;
-    } else if (strcasecmp(verity_mode, "eio") == 0) {
-      // We shouldn't see verity in EIO mode if the current slot hasn't booted
-      // successfully before. Therefore, fail the verification when veritymode=eio.
-      LOG(ERROR) << "Found dm-verity in EIO mode, skip verification.";
-      return -1;
-    } else if (strcmp(verity_mode, "enforcing") != 0) {
-      LOG(ERROR) << "Unexpected dm-verity mode : " << verity_mode << ", expecting enforcing.";
-      return -1;
-    } else if (!verify_image(CARE_MAP_FILE)) {
-      LOG(ERROR) << "Failed to verify all blocks in care map file.";
-      return -1;
-    }
-
-    CommandResult cr;
-    module->markBootSuccessful([&cr](CommandResult result) { cr = result; });
-    if (!cr.success) {
-      LOG(ERROR) << "Error marking booted successfully: " << cr.errMsg;
-      return -1;
-    }
-    LOG(INFO) << "Marked slot " << current_slot << " as booted successfully.";
-  }
-
-  LOG(INFO) << "Leaving update_verifier.";
-  return 0;
+    return true;
 }
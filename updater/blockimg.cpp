@@ -32,13 +32,16 @@
 #include <unistd.h>
 #include <fec/io.h>
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <ziparchive/zip_archive.h>
@@ -69,9 +72,14 @@ struct RangeSet {
     std::vector<size_t> pos;  // Actual limit is INT_MAX.
 };
 
-static CauseCode failure_type = kNoCause;
-static bool is_retry = false;
+// failure_type is also set by range_sha1() and the other read-only functions,
+// which may run in parallel() branches. block_image_update() and
+// block_image_verify() share the stash state, so they hold block_image_lock
+// for the whole run.
+static std::atomic<CauseCode> failure_type(kNoCause);
+static std::atomic<bool> is_retry(false);
 static std::unordered_map<std::string, RangeSet> stash_map;
+static std::mutex block_image_lock;
 
 static void parse_range(const std::string& range_text, RangeSet& rs) {
 
@@ -1355,6 +1363,7 @@ struct Command {
 
 static Value* PerformBlockImageUpdate(const char* name, State* state, int /* argc */, Expr* argv[],
         const Command* commands, size_t cmdcount, bool dryrun) {
+    std::lock_guard<std::mutex> block_image_guard(block_image_lock);
     CommandParameters params = {};
     params.canwrite = !dryrun;
 
@@ -1399,10 +1408,12 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
         return StringValue("");
     }
 
-    FILE* cmd_pipe = ui->cmd_pipe;
+    StatusWriter* status = ui->status;
     ZipArchiveHandle za = ui->package_zip;
+    // The new data is streamed out of the package for the whole update.
+    std::lock_guard<std::mutex> package_zip_guard(ui->package_zip_lock);
 
-    if (cmd_pipe == nullptr || za == nullptr) {
+    if (status == nullptr || za == nullptr) {
         return StringValue("");
     }
 
@@ -1542,11 +1553,14 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
                 PLOG(ERROR) << "fsync failed";
                 goto pbiudone;
             }
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double) params.written / total_blocks);
-            fflush(cmd_pipe);
+            // Coalesced by the writer, so fast commands don't each cost a
+            // pipe write and a wakeup of the recovery UI.
+            status->SetProgress(static_cast<float>(params.written) / total_blocks);
         }
     }
 
+    status->Flush();
+
     if (params.canwrite) {
         pthread_join(params.thread, nullptr);
 
@@ -1556,11 +1570,10 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
 
         const char* partition = strrchr(blockdev_filename->data.c_str(), '/');
         if (partition != nullptr && *(partition+1) != 0) {
-            fprintf(cmd_pipe, "log bytes_written_%s: %zu\n", partition + 1,
-                    params.written * BLOCKSIZE);
-            fprintf(cmd_pipe, "log bytes_stashed_%s: %zu\n", partition + 1,
-                    params.stashed * BLOCKSIZE);
-            fflush(cmd_pipe);
+            status->Log(android::base::StringPrintf("bytes_written_%s: %zu", partition + 1,
+                                                    params.written * BLOCKSIZE));
+            status->Log(android::base::StringPrintf("bytes_stashed_%s: %zu", partition + 1,
+                                                    params.stashed * BLOCKSIZE));
         }
         // Delete stash only after successfully completing the update, as it
         // may contain blocks needed to complete the update later.
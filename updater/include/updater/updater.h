@@ -20,13 +20,27 @@
 #include <stdio.h>
 #include <ziparchive/zip_archive.h>
 
+#include <mutex>
+
+#include "otautil/StatusChannel.h"
+
 typedef struct {
+    // Commands to recovery should go through 'status', which writes to
+    // cmd_pipe in the format recovery asked for. cmd_pipe is only kept for
+    // device extensions that still fprintf() text commands to it; each of
+    // those lines lands between two of status's messages, never inside one.
     FILE* cmd_pipe;
+    StatusWriter* status = nullptr;
     ZipArchiveHandle package_zip;
     int version;
 
-    uint8_t* package_zip_addr;
-    size_t package_zip_len;
+    uint8_t* package_zip_addr = nullptr;
+    size_t package_zip_len = 0;
+
+    // Held while reading entries from package_zip, which isn't safe to use
+    // from several parallel() branches at once. Messages to recovery don't
+    // need it: StatusWriter serializes them itself.
+    std::mutex package_zip_lock;
 } UpdaterInfo;
 
 struct selabel_handle;
@@ -17,9 +17,9 @@
 #include "updater/install.h"
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -35,8 +35,14 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -49,6 +55,7 @@
 #include <cutils/android_reboot.h>
 #include <ext4_utils/make_ext4fs.h>
 #include <ext4_utils/wipe.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <selinux/label.h>
 #include <selinux/selinux.h>
@@ -66,19 +73,33 @@
 #include "tune2fs.h"
 #include "updater/updater.h"
 
+// parallel() may run any of these functions on several threads at once.
+// Most of them only touch what their arguments name, so they are safe to
+// run side by side as long as the branches don't depend on each other's
+// side effects. The rest share process-wide state, and are serialized by
+// the locks below (or, for the package and the block_image_* functions,
+// by UpdaterInfo::package_zip_lock and block_image_lock):
+//
+//   - apply_patch, apply_patch_check, apply_patch_space and
+//     apply_patch_batch share CACHE_TEMP_SOURCE and the index of
+//     expendable /cache files (applypatch_lock).
+//   - mount, format and package_extract_dir look up file labels in
+//     sehandle, and make_ext4fs() keeps its state in globals; tune2fs'
+//     state is global too; set_stage and get_stage read and rewrite the
+//     misc partition (global_state_lock).
+//
+// Each lock is taken after the function's arguments have been evaluated,
+// so nesting these calls in each other's arguments can't deadlock.
+static std::mutex applypatch_lock;
+static std::mutex global_state_lock;
+
 // Send over the buffer to recovery though the command pipe.
 static void uiPrint(State* state, const std::string& buffer) {
   UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
 
-  // "line1\nline2\n" will be split into 3 tokens: "line1", "line2" and "".
-  // So skip sending empty strings to UI.
-  std::vector<std::string> lines = android::base::Split(buffer, "\n");
-  for (auto& line : lines) {
-    if (!line.empty()) {
-      fprintf(ui->cmd_pipe, "ui_print %s\n", line.c_str());
-      fprintf(ui->cmd_pipe, "ui_print\n");
-    }
-  }
+  // Empty lines are skipped, and the message stays in one piece even if
+  // parallel() branches print at once.
+  ui->status->UiPrint(buffer);
 
   // On the updater side, we need to dump the contents to stderr (which has
   // been redirected to the log file). Because the recovery will only print
@@ -164,6 +185,7 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
   }
 
   {
+    std::lock_guard<std::mutex> lock(global_state_lock);
     char* secontext = nullptr;
 
     if (sehandle) {
@@ -303,6 +325,7 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
   }
 
   if (fs_type == "ext4") {
+    std::lock_guard<std::mutex> lock(global_state_lock);
     int status = make_ext4fs(location.c_str(), size, mount_point.c_str(), sehandle);
     if (status != 0) {
       LOG(ERROR) << name << ": make_ext4fs failed (" << status << ") on " << location;
@@ -419,7 +442,7 @@ Value* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
   }
 
   UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
-  fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+  ui->status->Progress(frac, sec);
 
   return StringValue(frac_str);
 }
@@ -442,7 +465,7 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
   }
 
   UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
-  fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+  ui->status->SetProgress(frac);
 
   return StringValue(frac_str);
 }
@@ -465,12 +488,23 @@ Value* PackageExtractDirFn(const char* name, State* state, int argc, Expr* argv[
   const std::string& zip_path = args[0];
   const std::string& dest_path = args[1];
 
-  ZipArchiveHandle za = static_cast<UpdaterInfo*>(state->cookie)->package_zip;
+  UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
 
   // To create a consistent system image, never use the clock for timestamps.
   constexpr struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
-  bool success = ExtractPackageRecursive(za, zip_path, dest_path, &timestamp, sehandle);
+  // Extracting from the mapped package opens private handles on it, so
+  // package_zip stays free for the other parallel() branches.
+  bool success;
+  if (ui->package_zip_addr != nullptr) {
+    std::lock_guard<std::mutex> state_lock(global_state_lock);
+    success = ExtractPackageRecursive(ui->package_zip_addr, ui->package_zip_len, zip_path,
+                                      dest_path, &timestamp, sehandle);
+  } else {
+    std::lock_guard<std::mutex> lock(ui->package_zip_lock);
+    std::lock_guard<std::mutex> state_lock(global_state_lock);
+    success = ExtractPackageRecursive(ui->package_zip, zip_path, dest_path, &timestamp, sehandle);
+  }
 
   return StringValue(success ? "t" : "");
 }
@@ -494,7 +528,9 @@ Value* PackageExtractFileFn(const char* name, State* state, int argc, Expr* argv
     const std::string& zip_path = args[0];
     const std::string& dest_path = args[1];
 
-    ZipArchiveHandle za = static_cast<UpdaterInfo*>(state->cookie)->package_zip;
+    UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
+    std::lock_guard<std::mutex> lock(ui->package_zip_lock);
+    ZipArchiveHandle za = ui->package_zip;
     ZipString zip_string_path(zip_path.c_str());
     ZipEntry entry;
     if (FindEntry(za, zip_string_path, &entry) != 0) {
@@ -536,7 +572,9 @@ Value* PackageExtractFileFn(const char* name, State* state, int argc, Expr* argv
     }
     const std::string& zip_path = args[0];
 
-    ZipArchiveHandle za = static_cast<UpdaterInfo*>(state->cookie)->package_zip;
+    UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
+    std::lock_guard<std::mutex> lock(ui->package_zip_lock);
+    ZipArchiveHandle za = ui->package_zip;
     ZipString zip_string_path(zip_path.c_str());
     ZipEntry entry;
     if (FindEntry(za, zip_string_path, &entry) != 0) {
@@ -708,69 +746,80 @@ static struct perm_parsed_args ParsePermArgs(State * state, int argc,
   return parsed;
 }
 
-static int ApplyParsedPerms(State* state, const char* filename, const struct stat* statptr,
-                            struct perm_parsed_args parsed) {
+// Applies the parsed metadata to a single file. Failures are described in
+// 'errors' instead of being printed, so that callers running this on several
+// threads can report them in a deterministic order.
+static int ApplyParsedPerms(const char* filename, mode_t st_mode,
+                            const struct perm_parsed_args& parsed, std::string* errors) {
   int bad = 0;
 
   if (parsed.has_selabel) {
     if (lsetfilecon(filename, parsed.selabel) != 0) {
-      uiPrintf(state, "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n", filename,
-               parsed.selabel, strerror(errno));
+      android::base::StringAppendF(errors,
+                                   "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
+                                   filename, parsed.selabel, strerror(errno));
       bad++;
     }
   }
 
   /* ignore symlinks */
-  if (S_ISLNK(statptr->st_mode)) {
+  if (S_ISLNK(st_mode)) {
     return bad;
   }
 
   if (parsed.has_uid) {
     if (chown(filename, parsed.uid, -1) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chown of %s to %d failed: %s\n", filename, parsed.uid,
-               strerror(errno));
+      android::base::StringAppendF(errors,
+                                   "ApplyParsedPerms: chown of %s to %d failed: %s\n",
+                                   filename, parsed.uid, strerror(errno));
       bad++;
     }
   }
 
   if (parsed.has_gid) {
     if (chown(filename, -1, parsed.gid) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chgrp of %s to %d failed: %s\n", filename, parsed.gid,
-               strerror(errno));
+      android::base::StringAppendF(errors,
+                                   "ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
+                                   filename, parsed.gid, strerror(errno));
       bad++;
     }
   }
 
   if (parsed.has_mode) {
     if (chmod(filename, parsed.mode) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.mode,
-               strerror(errno));
+      android::base::StringAppendF(errors,
+                                   "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
+                                   filename, parsed.mode, strerror(errno));
       bad++;
     }
   }
 
-  if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
+  if (parsed.has_dmode && S_ISDIR(st_mode)) {
     if (chmod(filename, parsed.dmode) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.dmode,
-               strerror(errno));
+      android::base::StringAppendF(errors,
+                                   "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
+                                   filename, parsed.dmode, strerror(errno));
       bad++;
     }
   }
 
-  if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
+  if (parsed.has_fmode && S_ISREG(st_mode)) {
     if (chmod(filename, parsed.fmode) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.fmode,
-               strerror(errno));
+      android::base::StringAppendF(errors,
+                                   "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
+                                   filename, parsed.fmode, strerror(errno));
       bad++;
     }
   }
 
-  if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
+  if (parsed.has_capabilities && S_ISREG(st_mode)) {
     if (parsed.capabilities == 0) {
       if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
         // Report failure unless it's ENODATA (attribute not set)
-        uiPrintf(state, "ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n", filename,
-                 parsed.capabilities, strerror(errno));
+        android::base::StringAppendF(errors,
+                                     "ApplyParsedPerms: removexattr of %s to %" PRIx64
+                                     " failed: %s\n",
+                                     filename, parsed.capabilities, strerror(errno));
         bad++;
       }
     } else {
@@ -782,8 +831,9 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
       cap_data.data[1].permitted = (uint32_t)(parsed.capabilities >> 32);
       cap_data.data[1].inheritable = 0;
       if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
-        uiPrintf(state, "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n", filename,
-                 parsed.capabilities, strerror(errno));
+        android::base::StringAppendF(errors,
+                                     "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
+                                     filename, parsed.capabilities, strerror(errno));
         bad++;
       }
     }
@@ -792,14 +842,137 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
   return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-static State* recursive_state;
+struct MetadataEntry {
+  std::string path;
+  mode_t st_mode;
+  int bad;
+  std::string errors;
+};
+
+// How many paths set_metadata_recursive walks before applying the metadata to
+// them. Only one batch of paths is held in memory at a time, rather than the
+// whole tree (which for /system is tens of thousands of entries).
+static constexpr size_t kMetadataBatchSize = 4096;
+
+// Only the errors of the first few paths that fail are printed; a tree where
+// every chown fails would otherwise flood the UI and the log with one line per
+// file. The total is still reported.
+static constexpr size_t kMaxReportedMetadataFailures = 10;
+
+struct MetadataWalk {
+  State* state;
+  const struct perm_parsed_args& parsed;
+  std::vector<MetadataEntry> entries;
+  int bad = 0;
+  size_t failed_paths = 0;
+
+  MetadataWalk(State* state, const struct perm_parsed_args& parsed)
+      : state(state), parsed(parsed) {}
+};
+
+// Applies the metadata to the walked entries on a pool of worker threads.
+// Regular files and other non-directories are handled in parallel; directories
+// are done afterwards in walk order, so that a directory still only changes
+// after its contents. Since every earlier batch is finished first, that holds
+// across batches too.
+static void ApplyMetadataBatch(MetadataWalk* walk) {
+  std::vector<MetadataEntry>& entries = walk->entries;
+  std::vector<size_t> files;
+  std::vector<size_t> dirs;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (S_ISDIR(entries[i].st_mode)) {
+      dirs.push_back(i);
+    } else {
+      files.push_back(i);
+    }
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t thread_count = std::max<size_t>(1, std::min<size_t>(files.size(), cpus > 0 ? cpus : 1));
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      MetadataEntry& entry = entries[files[i]];
+      entry.bad = ApplyParsedPerms(entry.path.c_str(), entry.st_mode, walk->parsed, &entry.errors);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (size_t i : dirs) {
+    MetadataEntry& entry = entries[i];
+    entry.bad = ApplyParsedPerms(entry.path.c_str(), entry.st_mode, walk->parsed, &entry.errors);
+  }
+
+  for (const auto& entry : entries) {
+    if (entry.bad > 0) {
+      if (walk->failed_paths < kMaxReportedMetadataFailures) {
+        uiPrintf(walk->state, "%s", entry.errors.c_str());
+      }
+      walk->failed_paths++;
+      walk->bad += entry.bad;
+    }
+  }
+  entries.clear();
+}
+
+// Walks 'path' and everything below it, in the same order as
+// nftw(FTW_DEPTH | FTW_PHYS) visits them: the contents of a directory come
+// before the directory itself, and symlinks are not followed.
+static void WalkMetadataEntries(MetadataWalk* walk, const std::string& path, mode_t st_mode) {
+  if (S_ISDIR(st_mode)) {
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(path.c_str()), closedir);
+    if (!d) {
+      // Like nftw, still apply the metadata to a directory we can't read.
+      PLOG(WARNING) << "failed to open directory " << path;
+    } else {
+      struct dirent* de;
+      while ((de = readdir(d.get())) != nullptr) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+          continue;
+        }
+        std::string child = path + "/" + de->d_name;
+        mode_t child_mode;
+        if (de->d_type != DT_UNKNOWN) {
+          child_mode = DTTOIF(de->d_type);
+        } else {
+          struct stat sb;
+          if (fstatat(dirfd(d.get()), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+            PLOG(WARNING) << "failed to lstat " << child;
+            continue;
+          }
+          child_mode = sb.st_mode;
+        }
+        WalkMetadataEntries(walk, child, child_mode);
+      }
+    }
+  }
+  walk->entries.push_back({ path, st_mode, 0, "" });
+  if (walk->entries.size() >= kMetadataBatchSize) {
+    ApplyMetadataBatch(walk);
+  }
+}
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat* statptr, int fileflags,
-                                   struct FTW* pfwt) {
-  return ApplyParsedPerms(recursive_state, filename, statptr, recursive_parsed_args);
+// Applies the metadata to everything under 'root', a batch of paths at a
+// time. Returns the number of failures.
+static int SetMetadataRecursive(State* state, const std::string& root, mode_t root_mode,
+                                const struct perm_parsed_args& parsed) {
+  MetadataWalk walk(state, parsed);
+  walk.entries.reserve(kMetadataBatchSize);
+  WalkMetadataEntries(&walk, root, root_mode);
+  ApplyMetadataBatch(&walk);
+
+  if (walk.failed_paths > kMaxReportedMetadataFailures) {
+    uiPrintf(state, "SetMetadataRecursive: %zu more paths under %s failed, %d failures in total\n",
+             walk.failed_paths - kMaxReportedMetadataFailures, root.c_str(), walk.bad);
+  }
+  return walk.bad;
 }
 
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -824,13 +997,16 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
   bool recursive = (strcmp(name, "set_metadata_recursive") == 0);
 
   if (recursive) {
-    recursive_parsed_args = parsed;
-    recursive_state = state;
-    bad += nftw(args[0].c_str(), do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-    memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-    recursive_state = NULL;
+    auto start = std::chrono::steady_clock::now();
+    bad += SetMetadataRecursive(state, args[0], sb.st_mode, parsed);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    LOG(INFO) << name << " on " << args[0] << " took " << duration.count() << " s";
   } else {
-    bad += ApplyParsedPerms(state, args[0].c_str(), &sb, parsed);
+    std::string errors;
+    bad += ApplyParsedPerms(args[0].c_str(), sb.st_mode, parsed, &errors);
+    if (bad > 0) {
+      uiPrintf(state, "%s", errors.c_str());
+    }
   }
 
   if (bad > 0) {
@@ -936,6 +1112,7 @@ Value* ApplyPatchSpaceFn(const char* name, State* state, int argc, Expr* argv[])
                       name, bytes_str.c_str());
   }
 
+  std::lock_guard<std::mutex> lock(applypatch_lock);
   return StringValue(CacheSizeCheck(bytes) ? "" : "t");
 }
 
@@ -996,6 +1173,7 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
         patches.push_back(std::move(arg_values[i * 2 + 1]));
     }
 
+    std::lock_guard<std::mutex> lock(applypatch_lock);
     int result = applypatch(source_filename.c_str(), target_filename.c_str(),
                             target_sha1.c_str(), target_size,
                             patch_sha_str, patches, nullptr);
@@ -1003,6 +1181,66 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(result == 0 ? "t" : "");
 }
 
+// apply_patch_batch(manifest)
+//   Applies all the patches listed in manifest, a string with one line per file of the form
+//   "<src-file> <tgt-file> <tgt-sha1> <tgt-size> <src-sha1>:<patch-entry> ...". The patches are
+//   read from the given entries of the update package. Files are patched in parallel, with
+//   partitions and files that fail in parallel retried one at a time as apply_patch() would.
+//   Returns "t" if every file was patched.
+Value* ApplyPatchBatchFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, kArgsParsingFailure, "%s() expects 1 arg, got %d", name, argc);
+    }
+
+    std::string manifest;
+    if (!Evaluate(state, argv[0], &manifest)) {
+        return nullptr;
+    }
+
+    std::vector<PatchJob> jobs;
+    if (!ParsePatchManifest(manifest, &jobs)) {
+        return ErrorAbort(state, kArgsParsingFailure, "%s(): failed to parse the manifest", name);
+    }
+
+    // Each patch is extracted straight into the Value of the job that uses
+    // it, so it's only held in memory once. A patch shared by several files
+    // is only extracted once and copied from the first job that uses it.
+    UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
+    std::unique_lock<std::mutex> lock(ui->package_zip_lock);
+    ZipArchiveHandle za = ui->package_zip;
+    std::map<std::string, const Value*> extracted;
+    for (auto& job : jobs) {
+        for (const auto& patch_name : job.patch_names) {
+            auto it = extracted.find(patch_name);
+            if (it != extracted.end()) {
+                job.patches.push_back(std::make_unique<Value>(VAL_BLOB, it->second->data));
+                continue;
+            }
+            ZipString zip_string_path(patch_name.c_str());
+            ZipEntry entry;
+            if (FindEntry(za, zip_string_path, &entry) != 0) {
+                return ErrorAbort(state, kPackageExtractFileFailure, "%s(): no %s in package",
+                                  name, patch_name.c_str());
+            }
+            std::string buffer(entry.uncompressed_length, '\0');
+            int32_t ret = ExtractToMemory(za, &entry, reinterpret_cast<uint8_t*>(&buffer[0]),
+                                          buffer.size());
+            if (ret != 0) {
+                return ErrorAbort(state, kPackageExtractFileFailure,
+                                  "%s: Failed to extract entry \"%s\" (%zu bytes) to memory: %s",
+                                  name, patch_name.c_str(), buffer.size(), ErrorCodeString(ret));
+            }
+            job.patches.push_back(std::make_unique<Value>(VAL_BLOB, std::move(buffer)));
+            extracted.emplace(patch_name, job.patches.back().get());
+        }
+    }
+    lock.unlock();
+
+    std::lock_guard<std::mutex> applypatch_guard(applypatch_lock);
+    int result = applypatch_batch(jobs, nullptr);
+    return StringValue(result == 0 ? "t" : "");
+}
+
 // apply_patch_check(filename, [sha1, ...])
 //   Returns true if the contents of filename or the temporary copy in the cache partition (if
 //   present) have a SHA-1 checksum equal to one of the given sha1 values. sha1 values are
@@ -1025,6 +1263,7 @@ Value* ApplyPatchCheckFn(const char* name, State* state, int argc, Expr* argv[])
   if (!ReadArgs(state, argc - 1, argv + 1, &sha1s)) {
     return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse the argument(s)", name);
   }
+  std::lock_guard<std::mutex> lock(applypatch_lock);
   int result = applypatch_check(filename.c_str(), sha1s);
 
   return StringValue(result == 0 ? "t" : "");
@@ -1047,7 +1286,7 @@ Value* WipeCacheFn(const char* name, State* state, int argc, Expr* argv[]) {
   if (argc != 0) {
     return ErrorAbort(state, kArgsParsingFailure, "%s() expects no args, got %d", name, argc);
   }
-  fprintf(static_cast<UpdaterInfo*>(state->cookie)->cmd_pipe, "wipe_cache\n");
+  static_cast<UpdaterInfo*>(state->cookie)->status->Send(StatusCommand::WIPE_CACHE);
   return StringValue("t");
 }
 
@@ -1147,16 +1386,69 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
   }
   const std::string& filename = args[0];
 
+  // Load straight into the Value to avoid holding a second copy of the contents.
   Value* v = new Value(VAL_INVALID, "");
-
-  FileContents fc;
-  if (LoadFileContents(filename.c_str(), &fc) == 0) {
+  if (LoadFileContents(filename.c_str(), &v->data) == 0) {
     v->type = VAL_BLOB;
-    v->data = std::string(fc.data.begin(), fc.data.end());
+  } else {
+    v->data.clear();
   }
   return v;
 }
 
+// hash_file(filename, algorithm[, digest1, digest2, ...])
+//   Computes the "sha1" or "sha256" digest of a file, or of a partition given as
+//   "EMMC:<partition_device>[:<size>]", reading it in bounded memory. With no
+//   digest arguments, returns the hex digest; otherwise returns the first
+//   argument that matches it, or "" if none does (just like sha1_check()).
+//   Returns "" if the file can't be read.
+//   Example: hash_file("EMMC:/dev/block/by-name/boot:8388608", "sha256")
+Value* HashFileFn(const char* name, State* state, int argc, Expr* argv[]) {
+  if (argc < 2) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() expects at least 2 args, got %d", name,
+                      argc);
+  }
+
+  std::vector<std::string> args;
+  if (!ReadArgs(state, argc, argv, &args)) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse the argument(s)", name);
+  }
+
+  const std::string& filename = args[0];
+  const std::string& algorithm = args[1];
+  const EVP_MD* md;
+  if (algorithm == "sha1") {
+    md = EVP_sha1();
+  } else if (algorithm == "sha256") {
+    md = EVP_sha256();
+  } else {
+    return ErrorAbort(state, kArgsParsingFailure, "%s(): unknown hash algorithm \"%s\"", name,
+                      algorithm.c_str());
+  }
+
+  std::vector<uint8_t> digest;
+  if (HashFileContents(filename.c_str(), md, &digest) != 0) {
+    return StringValue("");
+  }
+  std::string hex = print_hex(digest.data(), digest.size());
+
+  if (argc == 2) {
+    return StringValue(hex);
+  }
+
+  for (int i = 2; i < argc; ++i) {
+    std::string candidate = android::base::Trim(args[i]);
+    std::transform(candidate.begin(), candidate.end(), candidate.begin(), ::tolower);
+    if (candidate == hex) {
+      // Found a match.
+      return StringValue(args[i]);
+    }
+  }
+
+  // Didn't match any of the hex strings; return false.
+  return StringValue("");
+}
+
 // write_value(value, filename)
 //   Writes 'value' to 'filename'.
 //   Example: write_value("960000", "/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq")
@@ -1251,6 +1543,7 @@ Value* SetStageFn(const char* name, State* state, int argc, Expr* argv[]) {
   // bootloader message that the main recovery uses to save its
   // arguments in case of the device restarting midway through
   // package installation.
+  std::lock_guard<std::mutex> lock(global_state_lock);
   bootloader_message boot;
   std::string err;
   if (!read_bootloader_message_from(&boot, filename, &err)) {
@@ -1279,6 +1572,7 @@ Value* GetStageFn(const char* name, State* state, int argc, Expr* argv[]) {
   }
   const std::string& filename = args[0];
 
+  std::lock_guard<std::mutex> lock(global_state_lock);
   bootloader_message boot;
   std::string err;
   if (!read_bootloader_message_from(&boot, filename, &err)) {
@@ -1317,7 +1611,7 @@ Value* EnableRebootFn(const char* name, State* state, int argc, Expr* argv[]) {
     return ErrorAbort(state, kArgsParsingFailure, "%s() expects no args, got %d", name, argc);
   }
   UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
-  fprintf(ui->cmd_pipe, "enable_reboot\n");
+  ui->status->Send(StatusCommand::ENABLE_REBOOT);
   return StringValue("t");
 }
 
@@ -1343,6 +1637,7 @@ Value* Tune2FsFn(const char* name, State* state, int argc, Expr* argv[]) {
 
   // tune2fs changes the file system parameters on an ext2 file system; it
   // returns 0 on success.
+  std::lock_guard<std::mutex> lock(global_state_lock);
   int result = tune2fs_main(argc + 1, args2);
   if (result != 0) {
     return ErrorAbort(state, kTune2FsFailure, "%s() returned error code %d", name, result);
@@ -1381,6 +1676,7 @@ void RegisterInstallFunctions() {
   RegisterFunction("file_getprop", FileGetPropFn);
 
   RegisterFunction("apply_patch", ApplyPatchFn);
+  RegisterFunction("apply_patch_batch", ApplyPatchBatchFn);
   RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
   RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
 
@@ -1388,6 +1684,7 @@ void RegisterInstallFunctions() {
 
   RegisterFunction("read_file", ReadFileFn);
   RegisterFunction("sha1_check", Sha1CheckFn);
+  RegisterFunction("hash_file", HashFileFn);
   RegisterFunction("rename", RenameFn);
   RegisterFunction("write_value", WriteValueFn);
 
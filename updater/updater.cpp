@@ -21,9 +21,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
 #include <string>
 
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <selinux/label.h>
 #include <selinux/selinux.h>
@@ -45,7 +47,7 @@
 // (Note it's "updateR-script", not the older "update-script".)
 static constexpr const char* SCRIPT_NAME = "META-INF/com/google/android/updater-script";
 
-extern bool have_eio_error;
+extern std::atomic<bool> have_eio_error;
 
 struct selabel_handle *sehandle;
 
@@ -84,6 +86,7 @@ int main(int argc, char** argv) {
   int fd = atoi(argv[2]);
   FILE* cmd_pipe = fdopen(fd, "wb");
   setlinebuf(cmd_pipe);
+  StatusWriter status_writer(cmd_pipe, getenv(STATUS_FRAMES_ENV) != nullptr);
 
   // Extract the script from the package.
 
@@ -131,9 +134,10 @@ int main(int argc, char** argv) {
 
   // Parse the script.
 
+  ExprArena arena;
   Expr* root;
   int error_count = 0;
-  int error = parse_string(script.c_str(), &root, &error_count);
+  int error = parse_string(script.c_str(), &root, &error_count, &arena);
   if (error != 0 || error_count > 0) {
     LOG(ERROR) << error_count << " parse errors";
     CloseArchive(za);
@@ -145,13 +149,14 @@ int main(int argc, char** argv) {
   sehandle = selabel_open(SELABEL_CTX_FILE, seopts, 1);
 
   if (!sehandle) {
-    fprintf(cmd_pipe, "ui_print Warning: No file_contexts\n");
+    status_writer.UiPrint("Warning: No file_contexts");
   }
 
   // Evaluate the parsed script.
 
   UpdaterInfo updater_info;
   updater_info.cmd_pipe = cmd_pipe;
+  updater_info.status = &status_writer;
   updater_info.package_zip = za;
   updater_info.version = atoi(version);
   updater_info.package_zip_addr = map.addr;
@@ -171,13 +176,13 @@ int main(int argc, char** argv) {
   bool status = Evaluate(&state, root, &result);
 
   if (have_eio_error) {
-    fprintf(cmd_pipe, "retry_update\n");
+    status_writer.Send(StatusCommand::RETRY_UPDATE);
   }
 
   if (!status) {
     if (state.errmsg.empty()) {
       LOG(ERROR) << "script aborted (no error message)";
-      fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
+      status_writer.UiPrint("script aborted (no error message)");
     } else {
       LOG(ERROR) << "script aborted: " << state.errmsg;
       const std::vector<std::string> lines = android::base::Split(state.errmsg, "\n");
@@ -189,17 +194,16 @@ int main(int argc, char** argv) {
             LOG(ERROR) << "Failed to parse error code: [" << line << "]";
           }
         }
-        fprintf(cmd_pipe, "ui_print %s\n", line.c_str());
       }
-      fprintf(cmd_pipe, "ui_print\n");
+      status_writer.UiPrint(state.errmsg);
     }
 
     if (state.error_code != kNoError) {
-      fprintf(cmd_pipe, "log error: %d\n", state.error_code);
+      status_writer.Log(android::base::StringPrintf("error: %d", state.error_code));
       // Cause code should provide additional information about the abort;
       // report only when an error exists.
       if (state.cause_code != kNoCause) {
-        fprintf(cmd_pipe, "log cause: %d\n", state.cause_code);
+        status_writer.Log(android::base::StringPrintf("cause: %d", state.cause_code));
       }
     }
 
@@ -208,7 +212,7 @@ int main(int argc, char** argv) {
     }
     return 7;
   } else {
-    fprintf(cmd_pipe, "ui_print script succeeded: result was [%s]\n", result.c_str());
+    status_writer.UiPrint("script succeeded: result was [" + result + "]");
   }
 
   if (updater_info.package_zip) {
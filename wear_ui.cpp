@@ -77,11 +77,7 @@ void WearRecoveryUI::draw_background_locked()
     if (currentIcon != NONE) {
         GRSurface* surface;
         if (currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) {
-            if (!intro_done) {
-                surface = introFrames[current_frame];
-            } else {
-                surface = loopFrames[current_frame];
-            }
+            surface = GetCurrentFrame();
         }
         else {
             surface = backgroundIcon[currentIcon];
@@ -188,6 +184,7 @@ void WearRecoveryUI::draw_screen_locked()
 void WearRecoveryUI::update_progress_locked() {
     draw_screen_locked();
     gr_flip();
+    ++frames_rendered_;
 }
 
 bool WearRecoveryUI::InitTextParams() {
@@ -232,6 +229,7 @@ void WearRecoveryUI::Print(const char *fmt, ...)
 
     // This can get called before ui_init(), so be careful.
     pthread_mutex_lock(&updateMutex);
+    ++prints_received_;
     if (text_rows_ > 0 && text_cols_ > 0) {
         char *ptr;
         for (ptr = buf; *ptr != '\0'; ++ptr) {
@@ -244,7 +242,7 @@ void WearRecoveryUI::Print(const char *fmt, ...)
             if (*ptr != '\n') text_[text_row_][text_col_++] = *ptr;
         }
         text_[text_row_][text_col_] = '\0';
-        update_screen_locked();
+        log_dirty_ = true;
     }
     pthread_mutex_unlock(&updateMutex);
 }
@@ -396,6 +394,7 @@ void WearRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap) {
     }
 
     pthread_mutex_lock(&updateMutex);
+    ++prints_received_;
     if (text_rows_ > 0 && text_cols_ > 0) {
         for (const char* ptr = str.c_str(); *ptr != '\0'; ++ptr) {
             if (*ptr == '\n' || text_col_ >= text_cols_) {
@@ -407,7 +406,7 @@ void WearRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap) {
             if (*ptr != '\n') text_[text_row_][text_col_++] = *ptr;
         }
         text_[text_row_][text_col_] = '\0';
-        update_screen_locked();
+        log_dirty_ = true;
     }
     pthread_mutex_unlock(&updateMutex);
 }